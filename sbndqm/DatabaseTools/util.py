@@ -29,6 +29,7 @@ def type_to_struct_type(name):
     if name == "uint32_t": return "I"
     if name == "uint64_t": return "Q"
 
+    if name == "float16": return "H" # unpacked by half_to_float
     if name == "float": return "f"
     if name == "double": return "d"
 
@@ -43,19 +44,54 @@ def type_to_size(name):
     if name == "uint32_t": return 4
     if name == "uint64_t": return 8
 
+    if name == "float16": return 2
     if name == "float": return 4
     if name == "double": return 8
 
+def half_to_float(half):
+    sign = -1. if half & 0x8000 else 1.
+    exponent = (half >> 10) & 0x1F
+    mantissa = half & 0x3FF
+    if exponent == 0x1F:
+        return sign * float("inf") if mantissa == 0 else float("nan")
+    if exponent == 0:
+        return sign * mantissa * 2.**-24
+    return sign * (1024 + mantissa) * 2.**(exponent - 25)
+
 def parse_binary(binary, typename):
     size = type_to_size(typename)
     form = type_to_struct_type(typename)
     ret = []
     for i in range(len(binary) // size):
        dat = binary[i*size : (i+1)*size]
-       ret.append(struct.unpack(form, dat)[0]) 
+       ret.append(struct.unpack("<" + form, dat)[0]) 
 
+    if typename == "float16":
+        ret = [half_to_float(h) for h in ret]
     return ret
 
+# undo the difference + zig-zag + varint encoding of the "delta_varint" snapshots
+def parse_delta_varint(binary):
+    ret = []
+    last = 0
+    zigzag = 0
+    shift = 0
+    for byte in bytearray(binary):
+        zigzag |= (byte & 0x7F) << shift
+        shift += 7
+        if byte & 0x80: continue
+        last += (zigzag >> 1) ^ -(zigzag & 1)
+        ret.append(last)
+        zigzag = 0
+        shift = 0
+    return ret
+
+# parse the "Data" of a snapshot with the given "DataType" and "Encoding"
+def parse_snapshot(binary, typename, encoding=None):
+    if encoding == "delta_varint":
+        return parse_delta_varint(binary)
+    return parse_binary(binary, typename)
+
 
 def read_datum(dat):
     for key, val in dat.items():
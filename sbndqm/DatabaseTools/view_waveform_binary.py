@@ -19,6 +19,7 @@ def main(args):
         offset_type = redis.hget(key, "OffsetType")
         size_type = redis.hget(key, "SizeType")
         period = float(redis.hget(key, "TickPeriod"))
+        encoding = redis.hget(key, "Encoding")
         data = redis.hget(key, "Data")
         sizes = redis.hget(key, "Sizes")
         offsets = redis.hget(key, "Offsets")
@@ -26,7 +27,7 @@ def main(args):
          print "ERROR: key (%s) is misformed" % (args.key)
          return
 
-    data = util.parse_binary(data, data_type)
+    data = util.parse_snapshot(data, data_type, encoding)
     if sizes:
         sizes = util.parse_binary(sizes, size_type)
     else:
@@ -1,15 +1,117 @@
 #include <vector>
 #include <array>
+#include <algorithm>
 
 #include "Mode.hh"
 
 int16_t Mode(const std::vector<int16_t> &adcs, unsigned n_skip_samples) {
-  return Mode(&adcs[0], adcs.size(), n_skip_samples);
+  return Mode(adcs.data(), adcs.size(), n_skip_samples);
+}
+
+int16_t Mode(const int16_t *adcs, size_t n_adcs, unsigned n_skip_samples) {
+  // keep a histogram around for each thread
+  thread_local ModeFinder finder;
+  return finder.Find(adcs, n_adcs, n_skip_samples);
+}
+
+ModeFinder::ModeFinder(int16_t min_value, unsigned n_values):
+  _min_value(min_value),
+  _n_values(n_values),
+  _block_shift(0),
+  _histogram(n_values, 0),
+  _filled_blocks(0)
+{
+  // make the blocks big enough that there are at most 64 of them
+  while (((_n_values - 1) >> _block_shift) >= 64) _block_shift ++;
+}
+
+int16_t ModeFinder::Find(const int16_t *adcs, size_t n_adcs, unsigned n_skip_samples) {
+  if (n_adcs == 0) return Get();
+
+  // find the range of values first. This loop is vectorized by the compiler
+  // and lets the histogram be filled without checking each value.
+  int16_t min = adcs[0];
+  int16_t max = adcs[0];
+  if (n_skip_samples == 1) {
+    for (size_t adc_ind = 0; adc_ind < n_adcs; adc_ind++) {
+      min = std::min(min, adcs[adc_ind]);
+      max = std::max(max, adcs[adc_ind]);
+    }
+  }
+  else {
+    for (size_t adc_ind = 0; adc_ind < n_adcs; adc_ind += n_skip_samples) {
+      min = std::min(min, adcs[adc_ind]);
+      max = std::max(max, adcs[adc_ind]);
+    }
+  }
+
+  // some values don't fit in the histogram -- check each one
+  if (min < _min_value || (int)max - _min_value >= (int)_n_values) {
+    for (size_t adc_ind = 0; adc_ind < n_adcs; adc_ind += n_skip_samples) {
+      Add(adcs[adc_ind]);
+    }
+    return Get();
+  }
+
+  for (size_t adc_ind = 0; adc_ind < n_adcs; adc_ind += n_skip_samples) {
+    _histogram[adcs[adc_ind] - _min_value] ++;
+  }
+  // mark all the blocks between the min and max
+  unsigned lo_block = (unsigned)(min - _min_value) >> _block_shift;
+  unsigned hi_block = (unsigned)(max - _min_value) >> _block_shift;
+  uint64_t upto_hi = (hi_block == 63) ? ~(uint64_t)0 : ((uint64_t)1 << (hi_block + 1)) - 1;
+  _filled_blocks |= upto_hi & ~(((uint64_t)1 << lo_block) - 1);
+  return Get();
+}
+
+void ModeFinder::Find(const int16_t *const *data, const size_t *n_data, unsigned n_waveforms, int16_t *modes, unsigned n_skip_samples) {
+  for (unsigned i = 0; i < n_waveforms; i++) {
+    modes[i] = Find(data[i], n_data[i], n_skip_samples);
+  }
+}
+
+int16_t ModeFinder::Get() {
+  unsigned max_count = 0;
+  int16_t ret = 0;
+
+  // search (and clear) the filled blocks, lowest values first
+  unsigned block_size = 1 << _block_shift;
+  while (_filled_blocks) {
+    unsigned block = __builtin_ctzll(_filled_blocks);
+    _filled_blocks &= _filled_blocks - 1;
+    unsigned lo = block * block_size;
+    unsigned hi = std::min(lo + block_size, _n_values);
+    for (unsigned bin = lo; bin < hi; bin++) {
+      if (_histogram[bin] > max_count) {
+        max_count = _histogram[bin];
+        ret = _min_value + bin;
+      }
+      _histogram[bin] = 0;
+    }
+  }
+
+  // count up the values that didn't fit in the histogram
+  if (_overflow.size()) {
+    std::sort(_overflow.begin(), _overflow.end());
+    size_t start = 0;
+    for (size_t i = 1; i <= _overflow.size(); i++) {
+      if (i == _overflow.size() || _overflow[i] != _overflow[start]) {
+        unsigned count = i - start;
+        if (count > max_count || (count == max_count && _overflow[start] < ret)) {
+          max_count = count;
+          ret = _overflow[start];
+        }
+        start = i;
+      }
+    }
+    _overflow.clear();
+  }
+  return ret;
 }
 
 // Calculate the mode to find a baseline of the passed in waveform.
 // Mode finding algorithm from: http://erikdemaine.org/papers/NetworkStats_ESA2002/paper.pdf (Algorithm FREQUENT)
-int16_t Mode(const int16_t *adcs, size_t n_adcs, unsigned n_skip_samples) {
+int16_t ModeFrequent(const int16_t *adcs, size_t n_adcs, unsigned n_skip_samples) {
   // 10 counters seem good
   std::array<unsigned, 10> counters {}; // zero-initialize
   std::array<int16_t, 10> modes {};
@@ -55,4 +157,3 @@ int16_t Mode(const int16_t *adcs, size_t n_adcs, unsigned n_skip_samples) {
   }
   return ret;
 }
-
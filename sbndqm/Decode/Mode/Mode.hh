@@ -3,20 +3,72 @@
 
 #include <vector>
 #include <array>
-
-#include "Mode.hh"
+#include <cstdint>
+#include <cstddef>
 
 // Calculate the mode to find a baseline of the passed in waveform.
-// Mode finding algorithm from: http://erikdemaine.org/papers/NetworkStats_ESA2002/paper.pdf (Algorithm FREQUENT)
+//
+// The mode is found exactly from a histogram of the ADC values (see ModeFinder).
+// Ties go to the lowest ADC value.
+int16_t Mode(const int16_t *data, size_t n_data, unsigned n_skip_samples=1);
+
+int16_t Mode(const std::vector<int16_t> &adcs, unsigned n_skip_samples=1);
+
+// Approximate mode finding algorithm from: http://erikdemaine.org/papers/NetworkStats_ESA2002/paper.pdf (Algorithm FREQUENT)
+// This was the implementation of Mode() before it was made exact. Kept for comparison.
 
 // Citation:
 // Erik D. Demaine, Alejandro L ́opez-Ortiz, and J. Ian Munro. Frequency
 // estimation of internet packet streams with limited space. In Rolf
 // M ̈ohring and Rajeev Raman, editors, Algorithms — ESA 2002, pages
 // 348–360, Berlin, Heidelberg, 2002. Springer Berlin Heidelberg.
+int16_t ModeFrequent(const int16_t *data, size_t n_data, unsigned n_skip_samples=1);
 
-int16_t Mode(const int16_t *data, size_t n_data, unsigned n_skip_samples=1);
+// Exact mode finding from a histogram of ADC values.
+//
+// Values inside of [min_value, min_value + n_values) are histogrammed
+// directly (by default, the 12 bit ADC range). Values outside of that range
+// are still counted exactly, just more slowly.
+//
+// The histogram is split into 64 blocks, and only the blocks that were
+// filled are searched and cleared after each waveform. Since the ADC values
+// in a waveform are usually close together, this costs much less than
+// clearing the whole histogram.
+//
+// A ModeFinder is not thread safe. Use one per thread.
+class ModeFinder {
+public:
+  explicit ModeFinder(int16_t min_value=0, unsigned n_values=4096);
 
-int16_t Mode(const std::vector<int16_t> &adcs, unsigned n_skip_samples=1);
+  // mode of every n_skip_samples-th value of a waveform
+  int16_t Find(const int16_t *data, size_t n_data, unsigned n_skip_samples=1);
+  // modes of a batch of waveforms
+  void Find(const int16_t *const *data, const size_t *n_data, unsigned n_waveforms, int16_t *modes, unsigned n_skip_samples=1);
+
+  // Fill one value at a time (e.g. as part of another pass over the waveform)
+  inline void Add(int16_t val) {
+    unsigned bin = (unsigned)(val - _min_value);
+    if (bin < _n_values) {
+      _histogram[bin] ++;
+      _filled_blocks |= (uint64_t)1 << (bin >> _block_shift);
+    }
+    else {
+      _overflow.push_back(val);
+    }
+  }
+  // mode of the values added since the last call, resetting the histogram
+  int16_t Get();
+
+private:
+  int16_t _min_value;
+  unsigned _n_values;
+  // log2 of the number of bins in each block
+  unsigned _block_shift;
+  std::vector<unsigned> _histogram;
+  // bit i is set if block i of the histogram has any entries
+  uint64_t _filled_blocks;
+  // values outside of the histogram range
+  std::vector<int16_t> _overflow;
+};
 
 #endif
@@ -29,12 +29,17 @@
 #include "art/Framework/Core/ModuleMacros.h"
 #include "artdaq-core/Data/Fragment.hh"
 #include "artdaq-core/Data/ContainerFragment.hh"
+#include "artdaq-core/Data/detail/RawFragmentHeader.hh"
 #include "sbndaq-artdaq-core/Overlays/FragmentType.hh"
 #include "sbndaq-artdaq-core/Overlays/Common/CAENV1730Fragment.hh"
 #include "sbndaq-artdaq-core/Overlays/ICARUS/PhysCrateFragment.hh"
 #include "lardataobj/RawData/OpDetWaveform.h"
 #include "sbndqm/Decode/PMT/PMTDecodeData/PMTDigitizerInfo.hh"
 
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+#include "tbb/task_arena.h"
+
 
 namespace daq 
 {
@@ -57,6 +62,12 @@ namespace daq
           std::vector<art::InputTag>{ "daq:CAENV1730", "daq:ContainerCAENV1730" }
         };
 
+        fhicl::Atom<int> NThreads {
+          Name("NThreads"),
+          Comment("number of threads used to decode the boards (1: serially, 0: all available threads)"),
+          1
+        };
+
       };
 
       using Parameters = art::EDProducer::Table<Config>;
@@ -71,11 +82,30 @@ namespace daq
       
       DaqDecoderIcarusPMT & operator = (DaqDecoderIcarusPMT &&) = delete;
 
+      // A CAEN V1730 fragment, on its own or as a block of a container
+      // fragment, pointing into the event data
+      struct FragmentView 
+      {
+        std::size_t fragmentID;
+        artdaq::Fragment::timestamp_t timestamp;
+        sbndaq::CAENV1730FragmentMetadata const* metadata;
+        // the CAENV1730Event (header followed by the samples of each channel)
+        uint8_t const* dataBegin;
+
+        sbndaq::CAENV1730EventHeader const& header() const 
+          { return *reinterpret_cast<sbndaq::CAENV1730EventHeader const*>(dataBegin); }
+      };
+
       std::vector<art::Handle<artdaq::Fragments>> readHandles( art::Event const & event ) const;
 
-      artdaq::Fragments readFragments( std::vector<art::Handle<artdaq::Fragments>> handles );
+      // views of the fragments, valid as long as the handles are
+      std::vector<FragmentView> readFragments( std::vector<art::Handle<artdaq::Fragments>> const& handles ) const;
 
-      void processFragment( const artdaq::Fragment &artdaqFragment );
+      // number of waveforms in a fragment (one per enabled channel)
+      static std::size_t countWaveforms( FragmentView const& fragment );
+
+      // decode a fragment into countWaveforms() waveforms starting at wvfms
+      void processFragment( FragmentView const& fragment, raw::OpDetWaveform* wvfms, pmtAnalysis::PMTDigitizerInfo& info ) const;
 
       void produce(art::Event & e) override;
 
@@ -87,6 +117,9 @@ namespace daq
       
       std::vector<art::InputTag> m_input_tags;
 
+      int m_n_threads;
+      tbb::task_arena m_arena;
+
       using OpDetWaveformCollection    = std::vector<raw::OpDetWaveform>;
       using OpDetWaveformCollectionPtr = std::unique_ptr<OpDetWaveformCollection>;
       OpDetWaveformCollectionPtr fOpDetWaveformCollection;  
@@ -106,6 +139,8 @@ namespace daq
 daq::DaqDecoderIcarusPMT::DaqDecoderIcarusPMT(Parameters const & params)
   : art::EDProducer(params)
   , m_input_tags{ params().FragmentsLabels() }
+  , m_n_threads{ params().NThreads() }
+  , m_arena{ (m_n_threads > 0) ? m_n_threads : tbb::task_arena::automatic }
 
 {
   
@@ -155,10 +190,11 @@ std::vector<art::Handle<artdaq::Fragments>> daq::DaqDecoderIcarusPMT::readHandle
 } 
 
 
-artdaq::Fragments daq::DaqDecoderIcarusPMT::readFragments( std::vector<art::Handle<artdaq::Fragments>> handles ) {
+std::vector<daq::DaqDecoderIcarusPMT::FragmentView> daq::DaqDecoderIcarusPMT::readFragments( std::vector<art::Handle<artdaq::Fragments>> const& handles ) const {
 
-  // Hopefully-not-too-sloppy-code to create the fragment list out of the container  
-  artdaq::Fragments fragments;
+  // The fragment list out of the container, without copying any of the
+  // fragments (or the blocks of the container fragments)
+  std::vector<FragmentView> fragments;
   
   for( const auto& handle : handles ) {
     
@@ -170,9 +206,20 @@ artdaq::Fragments daq::DaqDecoderIcarusPMT::readFragments( std::vector<art::Hand
 	
 	       if( contf.fragment_type() != sbndaq::detail::FragmentType::CAENV1730 ) { break; }
 	
+	       // each block is a whole fragment: header, metadata and then data
+	       uint8_t const* blocks = reinterpret_cast<uint8_t const*>( contf.dataBegin() );
+
 	       for( size_t ii=0; ii < contf.block_count(); ii++ ) {
 	  
-	         fragments.push_back( *(contf[ii]) );
+	         uint8_t const* block = blocks + contf.fragmentIndex(ii);
+	         auto const* header = reinterpret_cast<artdaq::detail::RawFragmentHeader const*>(block);
+	         uint8_t const* metadata = block + artdaq::detail::RawFragmentHeader::num_words() * sizeof(artdaq::RawDataType);
+
+	         fragments.push_back( FragmentView{ 
+	           header->fragment_id, 
+	           header->timestamp, 
+	           reinterpret_cast<sbndaq::CAENV1730FragmentMetadata const*>(metadata),
+	           metadata + header->metadata_word_count * sizeof(artdaq::RawDataType) } );
 	  
 	       }
 
@@ -184,9 +231,13 @@ artdaq::Fragments daq::DaqDecoderIcarusPMT::readFragments( std::vector<art::Hand
       
       if ( handle->front().type() != sbndaq::detail::FragmentType::CAENV1730  ) { break; }
 	
-      for( auto frag : *handle ) {
+      for( auto const& frag : *handle ) {
 	  
-	       fragments.emplace_back( frag );
+	       fragments.push_back( FragmentView{ 
+	         frag.fragmentID(), 
+	         frag.timestamp(), 
+	         frag.metadata<sbndaq::CAENV1730FragmentMetadata>(),
+	         reinterpret_cast<uint8_t const*>( frag.dataBeginBytes() ) } );
       }
     } // end if container
   } // end for handles 
@@ -197,15 +248,26 @@ artdaq::Fragments daq::DaqDecoderIcarusPMT::readFragments( std::vector<art::Hand
 }
 
 
-void daq::DaqDecoderIcarusPMT::processFragment( const artdaq::Fragment &artdaqFragment ) {
+std::size_t daq::DaqDecoderIcarusPMT::countWaveforms( FragmentView const& fragment ) {
+
+  auto const [ chDataMap, nEnabledChannels ] = setBitIndices<16U>(fragment.header().ChannelMask());
+
+  std::size_t nWaveforms = 0;
+  for( size_t digitizerChannel=0; digitizerChannel<fragment.metadata->nChannels; digitizerChannel++ ) {
+    if (chDataMap[digitizerChannel] < nEnabledChannels) nWaveforms++;
+  }
+  return nWaveforms;
+
+}
+
+
+void daq::DaqDecoderIcarusPMT::processFragment( FragmentView const& fragment, raw::OpDetWaveform* wvfms, pmtAnalysis::PMTDigitizerInfo& info ) const {
 
-  size_t const fragment_id = artdaqFragment.fragmentID();
+  size_t const fragment_id = fragment.fragmentID;
   size_t const eff_fragment_id = fragment_id & 0x0fff;
 
-  sbndaq::CAENV1730Fragment fragment(artdaqFragment);
-  sbndaq::CAENV1730FragmentMetadata metafrag = *fragment.Metadata();
-  sbndaq::CAENV1730Event evt = *fragment.Event();
-  sbndaq::CAENV1730EventHeader header = evt.Header;
+  sbndaq::CAENV1730FragmentMetadata const& metafrag = *fragment.metadata;
+  sbndaq::CAENV1730EventHeader const& header = fragment.header();
   size_t nChannelsPerBoard = metafrag.nChannels;
 
   
@@ -215,13 +277,12 @@ void daq::DaqDecoderIcarusPMT::processFragment( const artdaq::Fragment &artdaqFr
   uint32_t nSamplesPerChannel         = data_size_double_bytes/nChannelsPerBoard;
   uint16_t const enabledChannels      = header.ChannelMask();
 
-  artdaq::Fragment::timestamp_t const fragmentTimestamp = artdaqFragment.timestamp(); 
+  artdaq::Fragment::timestamp_t const fragmentTimestamp = fragment.timestamp; 
   unsigned int const time_tag =  header.triggerTimeTag;
 
   auto const [ chDataMap, nEnabledChannels ] = setBitIndices<16U>(enabledChannels);
-  const uint16_t* data_begin = reinterpret_cast<const uint16_t*>(artdaqFragment.dataBeginBytes() + sizeof(sbndaq::CAENV1730EventHeader));
+  const uint16_t* data_begin = reinterpret_cast<const uint16_t*>(fragment.dataBegin + sizeof(sbndaq::CAENV1730EventHeader));
 
-  std::vector<uint16_t> wvfm(nSamplesPerChannel);
   float temperature = 0;
 
 
@@ -233,9 +294,10 @@ void daq::DaqDecoderIcarusPMT::processFragment( const artdaq::Fragment &artdaqFr
     if (channelPosInData >= nEnabledChannels) continue; // not enabled
     std::size_t const ch_offset = channelPosInData * nSamplesPerChannel;
 
-    std::copy_n(data_begin + ch_offset, nSamplesPerChannel, wvfm.begin());
-
-    fOpDetWaveformCollection->emplace_back(fragmentTimestamp, pmtID, wvfm);
+    // copy the samples straight from the fragment into the waveform
+    raw::OpDetWaveform wvfm(fragmentTimestamp, pmtID, nSamplesPerChannel);
+    wvfm.assign(data_begin + ch_offset, data_begin + ch_offset + nSamplesPerChannel);
+    *(wvfms++) = std::move(wvfm);
 
     temperature += float( metafrag.chTemps[digitizerChannel] );
 
@@ -244,7 +306,7 @@ void daq::DaqDecoderIcarusPMT::processFragment( const artdaq::Fragment &artdaqFr
   if (nEnabledChannels > 0) temperature /= nEnabledChannels;
   else temperature = -1.0f; // invalid temperature
 
-  fPMTDigitizerInfoCollection->emplace_back( eff_fragment_id, time_tag, fragmentTimestamp, temperature );
+  info = pmtAnalysis::PMTDigitizerInfo( eff_fragment_id, time_tag, fragmentTimestamp, temperature );
 
 }
 
@@ -265,11 +327,27 @@ void daq::DaqDecoderIcarusPMT::produce(art::Event & event)
     fPMTDigitizerInfoCollection = std::make_unique<PMTDigitizerInfoCollection>();
     
     if ( !fragments.empty()){
- 
-      for( auto const & fragment : fragments ) {   
-  
-          processFragment( fragment );
-   
+
+      // lay out the output from the channel masks: each fragment (board)
+      // fills its own slots, so the order doesn't depend on the threads
+      std::vector<std::size_t> offsets(fragments.size() + 1, 0);
+      for( size_t i=0; i < fragments.size(); i++ ) {
+        offsets[i+1] = offsets[i] + countWaveforms( fragments[i] );
+      }
+      fOpDetWaveformCollection->resize( offsets.back() );
+      fPMTDigitizerInfoCollection->resize( fragments.size() );
+
+      auto process_fragments = [&](const tbb::blocked_range<size_t> &range) {
+        for( size_t i=range.begin(); i < range.end(); i++ ) {
+          processFragment( fragments[i], fOpDetWaveformCollection->data() + offsets[i], (*fPMTDigitizerInfoCollection)[i] );
+        }
+      };
+      tbb::blocked_range<size_t> all_fragments(0, fragments.size(), 1);
+      if (m_n_threads == 1) {
+        process_fragments(all_fragments);
+      }
+      else {
+        m_arena.execute([&] { tbb::parallel_for(all_fragments, process_fragments); });
       }
     
     }
@@ -13,6 +13,8 @@
 #include "sbndaq-artdaq-core/Overlays/ICARUS/PhysCrateFragment.hh"
 #include "canvas/Utilities/InputTag.h"
 
+#include "tbb/task_arena.h"
+
 //#include "sbnddaq-datatypes/Overlays/NevisTPCFragment.hh"
 
 #include "../HeaderData.hh"
@@ -82,6 +84,9 @@ private:
     bool baseline_calc;
     unsigned n_mode_skip;
     bool subtract_pedestal;
+    int n_threads;
+    bool bulk_unpack;
+    bool verbose;
 
     unsigned channel_per_slot;
     unsigned min_slot_no;
@@ -93,9 +98,14 @@ private:
     Config(fhicl::ParameterSet const & p);
   };
 
-  // process an individual fragment inside an art event
-  void process_fragment(art::Event &event, const artdaq::Fragment &frag,
-    std::unique_ptr<std::vector<raw::RawDigit>> &product_collectionf);
+  // process an individual fragment inside an art event, decoding
+  // its waveforms into digits. Safe to call in parallel for different fragments.
+  void process_fragment(const artdaq::Fragment &frag, std::vector<raw::RawDigit> &digits);
+
+  // unpack all the waveforms of a board at once. Boards whose declared
+  // channel and sample counts don't fit in the fragment are skipped.
+  void unpack_board(const artdaq::Fragment &frag, const icarus::PhysCrateFragment &fragment, size_t i_b,
+    raw::ChannelID_t first_channel, std::vector<raw::RawDigit> &digits);
 
 
   // Gets the WIRE ID of the channel. This wire id can be then passed
@@ -113,6 +123,9 @@ private:
   // keeping track of incrementing numbers
   uint32_t _last_event_number;
   uint32_t _last_trig_frame_number;
+  // digits decoded from each fragment
+  std::vector<std::vector<raw::RawDigit>> _fragment_digits;
+  tbb::task_arena _arena;
 };
 
 #endif /* ICARUSTPCDecoder_h */
@@ -19,9 +19,18 @@
 #include <stdlib.h>
 #include <chrono>
 #include <thread>
+#include <algorithm>
+#include <iterator>
 
 #include "art/Framework/Core/ModuleMacros.h"
 
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "artdaq-core/Data/Fragment.hh"
 
 #include "lardataobj/RawData/RawDigit.h"
@@ -35,6 +44,74 @@
 
 DEFINE_ART_MODULE(daq::ICARUSTPCDecoder)
 
+namespace {
+  // Transposes an n_rows x n_cols matrix of 16 bit values (row i starting at
+  // in + i * in_stride) into columns (column j written to out[j]), keeping
+  // only the bits in mask.
+  //
+  // The PhysCrateFragment stores each board sample-major (all channels for
+  // a tick, then the next tick), so with ticks as rows this turns the board
+  // data into one waveform per channel.
+  void Transpose(const uint16_t *in, size_t in_stride, size_t n_rows, size_t n_cols, uint16_t mask, int16_t *const *out) {
+    size_t row = 0;
+#if defined(__SSE2__)
+    __m128i mask_v = _mm_set1_epi16((int16_t)mask);
+    // 8x8 blocks: 8 channels over 8 ticks at a time
+    for (; row + 8 <= n_rows; row += 8) {
+      size_t col = 0;
+      for (; col + 8 <= n_cols; col += 8) {
+        const uint16_t *block = in + row * in_stride + col;
+        __m128i r0 = _mm_loadu_si128((const __m128i *)(block + 0 * in_stride));
+        __m128i r1 = _mm_loadu_si128((const __m128i *)(block + 1 * in_stride));
+        __m128i r2 = _mm_loadu_si128((const __m128i *)(block + 2 * in_stride));
+        __m128i r3 = _mm_loadu_si128((const __m128i *)(block + 3 * in_stride));
+        __m128i r4 = _mm_loadu_si128((const __m128i *)(block + 4 * in_stride));
+        __m128i r5 = _mm_loadu_si128((const __m128i *)(block + 5 * in_stride));
+        __m128i r6 = _mm_loadu_si128((const __m128i *)(block + 6 * in_stride));
+        __m128i r7 = _mm_loadu_si128((const __m128i *)(block + 7 * in_stride));
+
+        // interleave 16 bit, then 32 bit, then 64 bit lanes
+        __m128i a0 = _mm_unpacklo_epi16(r0, r1);
+        __m128i a1 = _mm_unpackhi_epi16(r0, r1);
+        __m128i a2 = _mm_unpacklo_epi16(r2, r3);
+        __m128i a3 = _mm_unpackhi_epi16(r2, r3);
+        __m128i a4 = _mm_unpacklo_epi16(r4, r5);
+        __m128i a5 = _mm_unpackhi_epi16(r4, r5);
+        __m128i a6 = _mm_unpacklo_epi16(r6, r7);
+        __m128i a7 = _mm_unpackhi_epi16(r6, r7);
+
+        __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+        __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+        __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+        __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+        __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+        __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+        __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+        __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+        __m128i cols[8] = {
+          _mm_unpacklo_epi64(b0, b4), _mm_unpackhi_epi64(b0, b4),
+          _mm_unpacklo_epi64(b1, b5), _mm_unpackhi_epi64(b1, b5),
+          _mm_unpacklo_epi64(b2, b6), _mm_unpackhi_epi64(b2, b6),
+          _mm_unpacklo_epi64(b3, b7), _mm_unpackhi_epi64(b3, b7)
+        };
+        for (size_t i = 0; i < 8; i++) {
+          _mm_storeu_si128((__m128i *)(out[col + i] + row), _mm_and_si128(cols[i], mask_v));
+        }
+      }
+      // left over channels
+      for (; col < n_cols; col++) {
+        for (size_t i = row; i < row + 8; i++) out[col][i] = in[i * in_stride + col] & mask;
+      }
+    }
+#endif
+    // left over ticks
+    for (; row < n_rows; row++) {
+      for (size_t col = 0; col < n_cols; col++) out[col][row] = in[row * in_stride + col] & mask;
+    }
+  }
+}
+
 // constructs a header data object from a icarus header
 // construct from a icarus header
 
@@ -69,7 +146,8 @@ daq::ICARUSTPCDecoder::ICARUSTPCDecoder(fhicl::ParameterSet const & param):
   _tag(param.get<std::string>("raw_data_label", "daq"),param.get<std::string>("fragment_type_label", "PHYSCRATEDATA")),
   _config(param),
   _last_event_number(0),
-  _last_trig_frame_number(0)
+  _last_trig_frame_number(0),
+  _arena( (_config.n_threads > 0) ? _config.n_threads : tbb::task_arena::automatic)
  {
   
   // produce stuff
@@ -93,6 +171,14 @@ daq::ICARUSTPCDecoder::Config::Config(fhicl::ParameterSet const & param) {
   n_mode_skip = param.get<unsigned>("n_mode_skip", 1);
   // whether to subtract pedestal
   subtract_pedestal = param.get<bool>("subtract_pedestal", false);
+  // number of threads used to decode fragments
+  // 1 == decode fragments serially
+  // 0 == use as many threads as are available
+  n_threads = param.get<int>("n_threads", 1);
+  // whether to unpack all the waveforms on a board at once instead of sample by sample
+  bulk_unpack = param.get<bool>("bulk_unpack", false);
+  // whether to print out information on each fragment
+  verbose = param.get<bool>("verbose", false);
 
   // icarus readout window length
   timesize = param.get<unsigned>("timesize", 1);
@@ -119,9 +205,39 @@ void daq::ICARUSTPCDecoder::produce(art::Event & event)
   // storage for header info
  // std::unique_ptr<std::vector<tpcAnalysis::HeaderData>> header_collection(new std::vector<tpcAnalysis::HeaderData>);
 
-  for (auto const &rawfrag: *daq_handle) {
-    //process_fragment(event, rawfrag, product_collection, header_collection);
-    process_fragment(event, rawfrag, product_collection);
+  // Fragments are independent, so they can be decoded in parallel
+  const artdaq::Fragments &fragments = *daq_handle;
+  _fragment_digits.resize(fragments.size());
+  auto process_fragments = [&](const tbb::blocked_range<size_t> &range) {
+    for (size_t i = range.begin(); i < range.end(); i++) {
+      process_fragment(fragments[i], _fragment_digits[i]);
+    }
+  };
+  tbb::blocked_range<size_t> all_fragments(0, fragments.size(), 1);
+  if (_config.n_threads == 1) {
+    process_fragments(all_fragments);
+  }
+  else {
+    _arena.execute([&] { tbb::parallel_for(all_fragments, process_fragments); });
+  }
+
+  // collect the digits from each fragment
+  size_t n_digits = 0;
+  for (auto const &digits: _fragment_digits) n_digits += digits.size();
+  product_collection->reserve(n_digits);
+  for (auto &digits: _fragment_digits) {
+    std::move(digits.begin(), digits.end(), std::back_inserter(*product_collection));
+    digits.clear();
+  }
+
+  // order the output by channel
+  auto by_channel = [](const raw::RawDigit &a, const raw::RawDigit &b) { return a.Channel() < b.Channel(); };
+  if (!std::is_sorted(product_collection->begin(), product_collection->end(), by_channel)) {
+    std::sort(product_collection->begin(), product_collection->end(), by_channel);
+  }
+
+  if (_config.verbose) {
+    std::cout << "Total number of channels added is " << product_collection->size() << std::endl;
   }
 
   event.put(std::move(product_collection));
@@ -142,21 +258,28 @@ raw::ChannelID_t daq::ICARUSTPCDecoder::get_wire_id(const sbnddaq::NevisTPCHeade
   return (header->getSlot() - _config.min_slot_no) * _config.channel_per_slot + nevis_channel_id;
 }
 */
-void daq::ICARUSTPCDecoder::process_fragment(art::Event &event, const artdaq::Fragment &frag, 
-  std::unique_ptr<std::vector<raw::RawDigit>> &product_collection) {
+void daq::ICARUSTPCDecoder::process_fragment(const artdaq::Fragment &frag, std::vector<raw::RawDigit> &digits) {
 
   // convert fragment to Nevis fragment
   icarus::PhysCrateFragment fragment(frag);
-  std::cout << " n boards " << fragment.nBoards() << std::endl;
+  if (_config.verbose) {
+    std::cout << " n boards " << fragment.nBoards() << std::endl;
+  }
 
   // This is a placeholder using 0-7 for the 8 minicrates -- when we use the proper fragment IDs
   //    we will want to change to use a map here from FragmentID to ... something.
   unsigned int boardFragmentID = (unsigned int) frag.fragmentID();
 
+  digits.reserve(fragment.nBoards() * fragment.nChannelsPerBoard());
+
   //int channel_count=0;
   for(size_t i_b=0; i_b < fragment.nBoards(); i_b++){
 	//A2795DataBlock const& block_data = *(crate_data.BoardDataBlock(i_b));
 
+	if (_config.bulk_unpack) {
+	  unpack_board(frag, fragment, i_b, i_b*64 + boardFragmentID*576, digits);
+	  continue;
+	}
 
 	for(size_t i_ch=0; i_ch < fragment.nChannelsPerBoard(); ++i_ch){
 
@@ -168,15 +291,12 @@ void daq::ICARUSTPCDecoder::process_fragment(art::Event &event, const artdaq::Fr
            // if(channel_num==1855) std::cout << " sample " << i_t << " wave " << wvfm[i_t] << std::endl;
 	  }
 	  //   product_collection->emplace_back(channel_count++,fragment.nSamplesPerChannel(),wvfm);
-	  product_collection->emplace_back(channel_num,fragment.nSamplesPerChannel(),wvfm);
+	  digits.emplace_back(channel_num,fragment.nSamplesPerChannel(),std::move(wvfm));
 	  //std::cout << " channel " << channel_num << " waveform size " << fragment.nSamplesPerChannel() << std::endl;
 
 	}//loop over channels
 
       }//loop over boards
-      
-  std::cout << "Total number of channels added is " << product_collection->size() << std::endl;
-
 
   /*std::unordered_map<uint16_t,sbnddaq::NevisTPC_Data_t> waveform_map;
   size_t n_waveforms = fragment.decode_data(waveform_map);
@@ -226,6 +346,41 @@ void daq::ICARUSTPCDecoder::process_fragment(art::Event &event, const artdaq::Fr
 }
 
 
+void daq::ICARUSTPCDecoder::unpack_board(const artdaq::Fragment &frag, const icarus::PhysCrateFragment &fragment, size_t i_b,
+  raw::ChannelID_t first_channel, std::vector<raw::RawDigit> &digits) {
+
+  size_t n_channels = fragment.nChannelsPerBoard();
+  size_t n_samples = fragment.nSamplesPerChannel();
+  if (n_channels == 0 || n_samples == 0) return;
+
+  // board data is sample-major, see PhysCrateFragment::adc_val
+  const icarus::A2795DataBlock::data_t *board_data = fragment.BoardData(i_b);
+  // same bit as is masked out by PhysCrateFragment::adc_val
+  uint16_t mask = ~(1 << (fragment.metadata()->num_adc_bits() + 1));
+
+  // the declared number of channels and samples of the board has to fit
+  // between the start of its data and the next board (or the end of the fragment)
+  const char *data_begin = reinterpret_cast<const char *>(frag.dataBeginBytes());
+  const char *data_end = (i_b + 1 < fragment.nBoards()) ? reinterpret_cast<const char *>(fragment.BoardData(i_b + 1))
+    : reinterpret_cast<const char *>(frag.dataEndBytes());
+  const char *board_begin = reinterpret_cast<const char *>(board_data);
+  size_t board_size = n_channels * n_samples * sizeof(icarus::A2795DataBlock::data_t);
+  if (board_begin < data_begin || board_begin > data_end || (size_t)(data_end - board_begin) < board_size) {
+    std::cerr << "Warning: board " << i_b << " of fragment " << frag.fragmentID() << " declares " << n_channels << " channels of "
+              << n_samples << " samples, which do not fit in the fragment. Skipping the board." << std::endl;
+    return;
+  }
+
+  std::vector<raw::RawDigit::ADCvector_t> waveforms(n_channels, raw::RawDigit::ADCvector_t(n_samples));
+  std::vector<int16_t *> columns(n_channels);
+  for (size_t i_ch = 0; i_ch < n_channels; i_ch++) columns[i_ch] = waveforms[i_ch].data();
+  Transpose(board_data, n_channels, n_samples, n_channels, mask, columns.data());
+
+  for (size_t i_ch = 0; i_ch < n_channels; i_ch++) {
+    digits.emplace_back(first_channel + i_ch, n_samples, std::move(waveforms[i_ch]));
+  }
+}
+
 // Computes the checksum, given a nevis tpc header
 // Ideally this would be in sbnddaq-datatypes, but it's not and I can't
 // make changes to it, so put it here for now
@@ -14,9 +14,16 @@
 #include "artdaq-core/Data/Fragment.hh"
 #include "canvas/Utilities/InputTag.h"
 
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/task_arena.h"
+
+#include <atomic>
+#include <string>
+
 #include "sbndaq-artdaq-core/Overlays/SBND/NevisTPCFragment.hh"
 
 #include "../HeaderData.hh"
+#include "../../Mode/Mode.hh"
 
 /*
   * The Decoder module takes as input "NevisTPCFragments" and
@@ -57,6 +64,9 @@ private:
     bool baseline_calc;
     unsigned n_mode_skip;
     bool subtract_pedestal;
+    bool streaming_decode;
+    unsigned streaming_decode_check;
+    int n_threads;
 
     unsigned channel_per_slot;
     unsigned min_slot_no;
@@ -68,11 +78,26 @@ private:
     Config(fhicl::ParameterSet const & p);
   };
 
-  // process an individual fragment inside an art event
-  void process_fragment(art::Event &event, const artdaq::Fragment &frag,
-    std::unique_ptr<std::vector<raw::RawDigit>> &product_collection,
-    std::unique_ptr<std::vector<tpcAnalysis::HeaderData>> &header_collection);
+  // process an individual fragment inside an art event, decoding
+  // its waveforms into digits. Safe to call in parallel for different fragments.
+  void process_fragment(const artdaq::Fragment &frag, std::vector<raw::RawDigit> &digits);
+
+  // decode the waveforms of a fragment through NevisTPCFragment::decode_data
+  void decode_map(const sbndaq::NevisTPCFragment &fragment, std::vector<raw::RawDigit> &digits,
+    ModeFinder &mode_finder);
+
+  // decode the ADC words of a fragment straight into RawDigits, in a single
+  // pass with the pedestal finding
+  void decode_stream(const sbndaq::NevisTPCFragment &fragment, std::vector<raw::RawDigit> &digits,
+    ModeFinder &mode_finder);
+
+  // describes the first difference between two sets of digits (empty if they are the same)
+  static std::string compare_digits(const std::vector<raw::RawDigit> &digits,
+    const std::vector<raw::RawDigit> &reference);
 
+  // set the pedestal of (and/or subtract it from) a waveform and turn it into a RawDigit
+  void emplace_digit(std::vector<raw::RawDigit> &digits, raw::ChannelID_t wire_id,
+    std::vector<int16_t> &&waveform, ModeFinder &mode_finder, bool has_mode);
 
   // Gets the WIRE ID of the channel. This wire id can be then passed
   // to the Lariat geometry.
@@ -89,6 +114,12 @@ private:
   // keeping track of incrementing numbers
   uint32_t _last_event_number;
   uint32_t _last_trig_frame_number;
+  // number of fragments checked against decode_data
+  std::atomic<unsigned> _n_checked_fragments;
+  // digits decoded from each fragment
+  std::vector<std::vector<raw::RawDigit>> _fragment_digits;
+  tbb::enumerable_thread_specific<ModeFinder> _mode_finders;
+  tbb::task_arena _arena;
 };
 
 #endif /* SBNDTPCDecoder_h */
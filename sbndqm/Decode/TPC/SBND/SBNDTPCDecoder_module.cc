@@ -15,15 +15,22 @@
 #include "canvas/Utilities/InputTag.h"
 #include "fhiclcpp/ParameterSet.h"
 #include "messagefacility/MessageLogger/MessageLogger.h"
+#include "cetlib_except/exception.h"
 
 #include <memory>
 #include <iostream>
 #include <stdlib.h>
 #include <chrono>
 #include <thread>
+#include <algorithm>
+#include <iterator>
+#include <sstream>
 
 #include "art/Framework/Core/ModuleMacros.h"
 
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+
 #include "artdaq-core/Data/Fragment.hh"
 
 #include "lardataobj/RawData/RawDigit.h"
@@ -37,6 +44,29 @@
 
 DEFINE_ART_MODULE(daq::SBNDTPCDecoder)
 
+namespace {
+  // Nevis ADC word format, as read by NevisTPCFragment::decode_data (which
+  // stays the reference: see streaming_decode_check). The overlay does not
+  // export these constants. The top bits of each 16 bit word say what it is:
+  //  1xxx xxxx xxxx xxxx: huffman compressed differences between ADC values
+  //  0100 xxxx xxxx xxxx: start of a channel (channel number in the low bits)
+  //  0101 xxxx xxxx xxxx: end of a channel
+  //  0000 xxxx xxxx xxxx: 12 bit ADC value
+  const uint16_t kCompressedBit = 0x8000;
+  const uint16_t kWordTypeMask = 0xF000;
+  const uint16_t kChannelHeader = 0x4000;
+  const uint16_t kChannelEnd = 0x5000;
+  const uint16_t kADCWord = 0x0000;
+  const uint16_t kValueMask = 0x0FFF;
+
+  // Difference to the last ADC value for each huffman code. Codes are a
+  // number of 0's followed by a 1, read from the lowest bit up, and the
+  // number of 0's indexes this table. Zeros left over above the last code
+  // of a word are padding.
+  const int16_t kHuffmanDiffs[] = {0, -1, 1, -2, 2, -3, 3};
+  const unsigned kNHuffmanCodes = sizeof(kHuffmanDiffs) / sizeof(kHuffmanDiffs[0]);
+}
+
 // constructs a header data object from a nevis header
 // construct from a nevis header
 tpcAnalysis::HeaderData daq::SBNDTPCDecoder::Fragment2HeaderData(art::Event &event, const artdaq::Fragment &frag) {
@@ -69,7 +99,9 @@ daq::SBNDTPCDecoder::SBNDTPCDecoder(fhicl::ParameterSet const & param):
   _tag(param.get<std::string>("raw_data_label", "daq"),param.get<std::string>("fragment_type_label", "NEVISTPC")),
   _config(param),
   _last_event_number(0),
-  _last_trig_frame_number(0)
+  _last_trig_frame_number(0),
+  _n_checked_fragments(0),
+  _arena( (_config.n_threads > 0) ? _config.n_threads : tbb::task_arena::automatic)
  {
   
   // produce stuff
@@ -93,6 +125,15 @@ daq::SBNDTPCDecoder::Config::Config(fhicl::ParameterSet const & param) {
   n_mode_skip = param.get<unsigned>("n_mode_skip", 1);
   // whether to subtract pedestal
   subtract_pedestal = param.get<bool>("subtract_pedestal", false);
+  // whether to decode the ADC words directly instead of through NevisTPCFragment::decode_data
+  streaming_decode = param.get<bool>("streaming_decode", false);
+  // number of fragments (per job) to also decode through NevisTPCFragment::decode_data
+  // when streaming_decode is set, stopping the job if the digits differ
+  streaming_decode_check = param.get<unsigned>("streaming_decode_check", 10);
+  // number of threads used to decode fragments
+  // 1 == decode fragments serially
+  // 0 == use as many threads as are available
+  n_threads = param.get<int>("n_threads", 1);
 
   // nevis readout window length
   timesize = param.get<unsigned>("timesize", 1);
@@ -119,8 +160,42 @@ void daq::SBNDTPCDecoder::produce(art::Event & event)
   // storage for header info
   std::unique_ptr<std::vector<tpcAnalysis::HeaderData>> header_collection(new std::vector<tpcAnalysis::HeaderData>);
 
-  for (auto const &rawfrag: *daq_handle) {
-    process_fragment(event, rawfrag, product_collection, header_collection);
+  if (_config.produce_header) {
+    for (auto const &rawfrag: *daq_handle) {
+      // Construct HeaderData from the Nevis Header and throw it in the collection
+      header_collection->push_back(Fragment2HeaderData(event, rawfrag));
+    }
+  }
+
+  // Fragments are independent, so they can be decoded in parallel
+  const artdaq::Fragments &fragments = *daq_handle;
+  _fragment_digits.resize(fragments.size());
+  auto process_fragments = [&](const tbb::blocked_range<size_t> &range) {
+    for (size_t i = range.begin(); i < range.end(); i++) {
+      process_fragment(fragments[i], _fragment_digits[i]);
+    }
+  };
+  tbb::blocked_range<size_t> all_fragments(0, fragments.size(), 1);
+  if (_config.n_threads == 1) {
+    process_fragments(all_fragments);
+  }
+  else {
+    _arena.execute([&] { tbb::parallel_for(all_fragments, process_fragments); });
+  }
+
+  // collect the digits from each fragment
+  size_t n_digits = 0;
+  for (auto const &digits: _fragment_digits) n_digits += digits.size();
+  product_collection->reserve(n_digits);
+  for (auto &digits: _fragment_digits) {
+    std::move(digits.begin(), digits.end(), std::back_inserter(*product_collection));
+    digits.clear();
+  }
+
+  // order the output by channel
+  auto by_channel = [](const raw::RawDigit &a, const raw::RawDigit &b) { return a.Channel() < b.Channel(); };
+  if (!std::is_sorted(product_collection->begin(), product_collection->end(), by_channel)) {
+    std::sort(product_collection->begin(), product_collection->end(), by_channel);
   }
 
   event.put(std::move(product_collection));
@@ -141,57 +216,208 @@ raw::ChannelID_t daq::SBNDTPCDecoder::get_wire_id(const sbndaq::NevisTPCHeader *
   return (header->getSlot() - _config.min_slot_no) * _config.channel_per_slot + nevis_channel_id;
 }
 
-void daq::SBNDTPCDecoder::process_fragment(art::Event &event, const artdaq::Fragment &frag, 
-  std::unique_ptr<std::vector<raw::RawDigit>> &product_collection,
-  std::unique_ptr<std::vector<tpcAnalysis::HeaderData>> &header_collection) {
-
+void daq::SBNDTPCDecoder::process_fragment(const artdaq::Fragment &frag, std::vector<raw::RawDigit> &digits) {
   // convert fragment to Nevis fragment
   sbndaq::NevisTPCFragment fragment(frag);
+  ModeFinder &mode_finder = _mode_finders.local();
+
+  if (!_config.streaming_decode) {
+    decode_map(fragment, digits, mode_finder);
+    return;
+  }
+
+  decode_stream(fragment, digits, mode_finder);
+
+  // check the first fragments against the overlay's decoder
+  if (_n_checked_fragments.fetch_add(1) < _config.streaming_decode_check) {
+    std::vector<raw::RawDigit> reference;
+    decode_map(fragment, reference, mode_finder);
+    // decode_data gives the channels in order
+    std::stable_sort(digits.begin(), digits.end(),
+      [](const raw::RawDigit &a, const raw::RawDigit &b) { return a.Channel() < b.Channel(); });
+    std::string difference = compare_digits(digits, reference);
+    if (!difference.empty()) {
+      throw cet::exception("SBNDTPCDecoder") << "streaming_decode differs from NevisTPCFragment::decode_data in slot "
+        << fragment.header()->getSlot() << ": " << difference << "\n";
+    }
+  }
+}
+
+void daq::SBNDTPCDecoder::decode_map(const sbndaq::NevisTPCFragment &fragment, std::vector<raw::RawDigit> &digits,
+  ModeFinder &mode_finder) {
 
   std::unordered_map<uint16_t,sbndaq::NevisTPC_Data_t> waveform_map;
   size_t n_waveforms = fragment.decode_data(waveform_map);
   (void)n_waveforms;
 
-  if (_config.produce_header) {
-    auto header_data = Fragment2HeaderData(event, frag);
-    if (_config.produce_header || _config.produce_metadata) {
-      // Construct HeaderData from the Nevis Header and throw it in the collection
-      header_collection->push_back(header_data);
-    }
+  // go through the channels in order
+  std::vector<uint16_t> channels;
+  channels.reserve(waveform_map.size());
+  for (auto const &waveform: waveform_map) {
+    channels.push_back(waveform.first);
   }
+  std::sort(channels.begin(), channels.end());
+  digits.reserve(channels.size());
 
-  for (auto waveform: waveform_map) {
+  for (uint16_t channel: channels) {
     // ignore channels that aren't mapped to a wire
-    if (!is_mapped_channel(fragment.header(), waveform.first)) continue;
-
-    std::vector<int16_t> raw_digits_waveform;
-    raw::ChannelID_t wire_id = get_wire_id(fragment.header(), waveform.first);
-    // TODO: is this too expensive an operation?
-    for (auto digit: waveform.second) {
-      raw_digits_waveform.push_back( (int16_t) digit);
-    }  
-    // calculate the mode and set it as the pedestal
-    if (_config.baseline_calc || _config.subtract_pedestal) {
-      int16_t mode = Mode(raw_digits_waveform, _config.n_mode_skip);
-      if (_config.subtract_pedestal) {
-        for (unsigned i = 0; i < raw_digits_waveform.size(); i++) {
-          raw_digits_waveform[i] -= mode;
-        }
+    if (!is_mapped_channel(fragment.header(), channel)) continue;
+
+    const sbndaq::NevisTPC_Data_t &adcs = waveform_map[channel];
+    raw::ChannelID_t wire_id = get_wire_id(fragment.header(), channel);
+    std::vector<int16_t> raw_digits_waveform(adcs.begin(), adcs.end());
+    emplace_digit(digits, wire_id, std::move(raw_digits_waveform), mode_finder, false);
+  }
+}
+
+void daq::SBNDTPCDecoder::emplace_digit(std::vector<raw::RawDigit> &digits, raw::ChannelID_t wire_id,
+  std::vector<int16_t> &&waveform, ModeFinder &mode_finder, bool has_mode) {
+
+  size_t n_ticks = waveform.size();
+  // calculate the mode and set it as the pedestal
+  if (_config.baseline_calc || _config.subtract_pedestal) {
+    // the mode finder may have already been filled while decoding
+    int16_t mode = has_mode ? mode_finder.Get() : mode_finder.Find(waveform.data(), n_ticks, _config.n_mode_skip);
+    if (_config.subtract_pedestal) {
+      for (unsigned i = 0; i < n_ticks; i++) {
+        waveform[i] -= mode;
       }
+    }
+
+    // construct the next RawDigit object
+    digits.emplace_back(wire_id, n_ticks, std::move(waveform));
+
+    if (_config.baseline_calc) {
+      digits.back().SetPedestal(mode);
+    }
+  }
+  // just push back
+  else {
+    digits.emplace_back(wire_id, n_ticks, std::move(waveform));
+  }
+}
 
-      // construct the next RawDigit object
-      product_collection->emplace_back(wire_id, raw_digits_waveform.size(), raw_digits_waveform);
+void daq::SBNDTPCDecoder::decode_stream(const sbndaq::NevisTPCFragment &fragment, std::vector<raw::RawDigit> &digits,
+  ModeFinder &mode_finder) {
+
+  const sbndaq::NevisTPC_ADC_t* data_ptr = fragment.data();
+  // RETURN VALUE OF getADCWordCount IS OFF BY 1
+  size_t n_words = fragment.header()->getADCWordCount() + 1;
+
+  bool fill_mode = _config.baseline_calc || _config.subtract_pedestal;
+  bool in_channel = false;
+  uint16_t channel = 0;
+  std::vector<int16_t> waveform;
+  // the value the huffman differences are taken from. Only set once the
+  // channel has a value.
+  int16_t last = 0;
+  bool has_last = false;
+  unsigned mode_skip = 0;
+  // number of ticks in the last waveform, used to reserve capacity for the next one
+  size_t n_ticks_hint = 0;
+  // compressed words that could not be (fully) decoded
+  size_t n_bad_words = 0;
+
+  // add a value to the current waveform and (every n_mode_skip values) to the mode finder
+  auto push = [&](int16_t val) {
+    waveform.push_back(val);
+    if (fill_mode && mode_skip == 0) mode_finder.Add(val);
+    if (++mode_skip == _config.n_mode_skip) mode_skip = 0;
+    last = val;
+    has_last = true;
+  };
+
+  auto finish_channel = [&]() {
+    if (is_mapped_channel(fragment.header(), channel)) {
+      n_ticks_hint = waveform.size();
+      emplace_digit(digits, get_wire_id(fragment.header(), channel), std::move(waveform), mode_finder, fill_mode);
+    }
+    // throw out the values of channels that aren't mapped to a wire
+    else if (fill_mode) {
+      mode_finder.Get();
+    }
+    waveform = std::vector<int16_t>();
+    in_channel = false;
+  };
 
-      if (_config.baseline_calc) {
-        (*product_collection)[product_collection->size() - 1].SetPedestal( mode);
+  for (size_t word_ind = 0; word_ind < n_words; word_ind++) {
+    uint16_t word = data_ptr[word_ind];
+
+    if (word & kCompressedBit) {
+      // differences need a value to start from
+      if (!in_channel || !has_last) {
+        n_bad_words ++;
+        continue;
+      }
+      unsigned n_zeros = 0;
+      bool bad = false;
+      for (unsigned bit = 0; bit < 15; bit++) {
+        if (word & (1 << bit)) {
+          if (n_zeros < kNHuffmanCodes) push(last + kHuffmanDiffs[n_zeros]);
+          else bad = true;
+          n_zeros = 0;
+        }
+        else n_zeros ++;
       }
+      if (bad) n_bad_words ++;
+      continue;
     }
-    // just push back
-    else {
-      product_collection->emplace_back(wire_id, raw_digits_waveform.size(), raw_digits_waveform);
 
+    switch (word & kWordTypeMask) {
+      case kChannelHeader:
+        if (in_channel) finish_channel();
+        in_channel = true;
+        channel = word & kValueMask;
+        waveform.reserve(n_ticks_hint);
+        mode_skip = 0;
+        last = 0;
+        has_last = false;
+        break;
+      case kChannelEnd:
+        if (in_channel) finish_channel();
+        break;
+      case kADCWord:
+        if (in_channel) push(word & kValueMask);
+        break;
+      default:
+        break;
+    }
+  }
+  // data ended without a channel end word
+  if (in_channel) finish_channel();
+
+  if (n_bad_words > 0) {
+    mf::LogWarning("SBNDTPCDecoder") << n_bad_words << " compressed words could not be decoded in slot "
+      << fragment.header()->getSlot();
+  }
+}
+
+std::string daq::SBNDTPCDecoder::compare_digits(const std::vector<raw::RawDigit> &digits,
+  const std::vector<raw::RawDigit> &reference) {
+
+  std::stringstream difference;
+  if (digits.size() != reference.size()) {
+    difference << digits.size() << " digits instead of " << reference.size();
+    return difference.str();
+  }
+  for (size_t i = 0; i < digits.size(); i++) {
+    const raw::RawDigit &digit = digits[i];
+    const raw::RawDigit &ref = reference[i];
+    if (digit.Channel() != ref.Channel()) {
+      difference << "channel " << digit.Channel() << " instead of " << ref.Channel();
+    }
+    else if (digit.ADCs() != ref.ADCs()) {
+      difference << "channel " << digit.Channel() << " has " << digit.Samples() << " ADC values";
+      size_t n = std::min(digit.ADCs().size(), ref.ADCs().size());
+      size_t first = std::mismatch(digit.ADCs().begin(), digit.ADCs().begin() + n, ref.ADCs().begin()).first - digit.ADCs().begin();
+      difference << " (" << ref.Samples() << " expected), first differing at tick " << first;
+    }
+    else if (digit.GetPedestal() != ref.GetPedestal()) {
+      difference << "channel " << digit.Channel() << " has pedestal " << digit.GetPedestal() << " instead of " << ref.GetPedestal();
     }
+    if (difference.tellp() > 0) break;
   }
+  return difference.str();
 }
 
 // Computes the checksum, given a nevis tpc header
@@ -24,6 +24,7 @@
 
 #include "sbndqm/Decode/PMT/PMTDecodeData/PMTDigitizerInfo.hh"
 #include "sbndqm/Decode/Mode/Mode.hh"
+#include "sbndqm/dqmAnalysis/TPC/Snapshot.hh"
 #include "sbndaq-online/helpers/SBNMetricManager.h"
 #include "sbndaq-online/helpers/MetricConfig.h"
 #include "sbndaq-online/helpers/Waveform.h"
@@ -38,6 +39,7 @@
 #include <iomanip>
 #include <vector>
 #include <iostream>
+#include <memory>
 
 
 #include "messagefacility/MessageLogger/MessageLogger.h"
@@ -69,6 +71,10 @@ namespace sbndaq {
 
         fhicl::ParameterSet m_metric_config;
 
+        // sends the waveform snapshots from a background thread (if set)
+        std::unique_ptr<tpcAnalysis::SnapshotPublisher> m_publisher;
+        tpcAnalysis::snapshot::Snapshot m_snapshot;
+
         pmtana::PulseRecoManager pulseRecoManager;
         pmtana::PMTPulseRecoBase* threshAlg;
         pmtana::PMTPedestalBase*  pedAlg;
@@ -105,6 +111,11 @@ sbndaq::CAENV1730Streams::CAENV1730Streams(fhicl::ParameterSet const & pset)
   // Configure the redis metrics 
   sbndaq::GenerateMetricConfig( m_metric_config );
 
+  // Send the waveform snapshots from a background thread, so a slow redis doesn't hold up the event loop
+  if( pset.get<bool>("AsyncSnapshots", false) ) {
+    m_publisher.reset( new tpcAnalysis::SnapshotPublisher( m_redis_hostname, m_redis_port, pset.get<unsigned>("SnapshotQueueSize", 4096) ) );
+  }
+
   // Configure the pedestal manager
   auto const ped_alg_pset = pset.get<fhicl::ParameterSet>("PedAlgoConfig");
   std::string pedAlgName = ped_alg_pset.get< std::string >("Name");
@@ -266,6 +277,14 @@ void sbndaq::CAENV1730Streams::analyze(art::Event const & evt) {
       // Now we send a copy of the waveforms 
       double tickPeriod = 0.002; // [us] 
       std::vector<std::vector<raw::ADC_Count_t>> adcs {opdetwaveform};
+
+      if( m_publisher ) {
+        m_snapshot.SetSplitWaveform("snapshot:waveform:PMT:" + pmtId_s, adcs, { 0. }, tickPeriod);
+        m_snapshot.SetEvent(evt.run(), evt.subRun(), evt.event());
+        m_publisher->Publish(m_snapshot);
+        continue;
+      }
+
       std::vector<int> start { 0 }; // We are considreing each waveform independent for now 
 
       sbndaq::SendSplitWaveform("snapshot:waveform:PMT:" + pmtId_s, adcs, start, tickPeriod);
@@ -273,6 +292,13 @@ void sbndaq::CAENV1730Streams::analyze(art::Event const & evt) {
 
     } // for      
 
+    if( m_publisher ) {
+      tpcAnalysis::SnapshotPublisher::Stats stats = m_publisher->GetStats();
+      sbndaq::sendMetric(groupName, "snapshot_publisher", "queue_depth", (int)stats.queue_depth, level, artdaq::MetricMode::LastPoint);
+      sbndaq::sendMetric(groupName, "snapshot_publisher", "n_dropped", (int)stats.n_dropped, level, artdaq::MetricMode::LastPoint);
+      sbndaq::sendMetric(groupName, "snapshot_publisher", "flush_latency", stats.flush_latency, level, mode);
+    }
+
     if( m_unique_channels.size() < nTotalChannels ) {
 
          mf::LogError("sbndaq::CAENV1730Streams::analyze") 
@@ -33,35 +33,61 @@
 #include "art/Framework/Principal/SubRun.h" 
 #include "fhiclcpp/ParameterSet.h" 
 #include "messagefacility/MessageLogger/MessageLogger.h"  
+#include "cetlib_except/exception.h"
 #include "art_root_io/TFileService.h"
 #include "lardataobj/RawData/RawDigit.h"
 #include "lardataobj/RecoBase/Hit.h"
 #include "lardataobj/RawData/raw.h"
 #include "canvas/Persistency/Provenance/Timestamp.h"
 
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+
 #include "Analysis.hh"
 #include "ChannelData.hh"
 #include "sbndqm/Decode/TPC/HeaderData.hh"
 #include "FFT.hh"
 #include "Noise.hh"
 #include "PeakFinder.hh"
+#include "SIMD.hh"
 #include "sbndqm/Decode/Mode/Mode.hh"
 
 using namespace tpcAnalysis;
 
+namespace {
+// total capacity of a set of buffers, to keep track of when they allocate
+template<typename... Buffers>
+size_t Capacity(const Buffers&... buffers) { return (buffers.capacity() + ...); }
+} // namespace
+
 Analysis::Analysis(fhicl::ParameterSet const & p) :
   _channel_info(p.get<fhicl::ParameterSet>("channel_info")), // get the channel info
   _config(p),
   _channel_index_map(_channel_info.NChannels()),
+  _channel_digits_index(_channel_info.NChannels(), -1),
+  _waveforms(_channel_info.NChannels()),
   _per_channel_data(_channel_info.NChannels()),
   _per_channel_data_reduced((_config.reduce_data) ? _channel_info.NChannels() : 0), // setup reduced event vector if we need it
   _noise_samples(_channel_info.NChannels()),
   _header_data(std::max(_config.n_headers,0)),
   _thresholds( (_config.threshold_calc == 3) ? _channel_info.NChannels() : 0),
-  _fft_manager(  (_config.static_input_size > 0) ? _config.static_input_size: 0)
-
+  _pedestal_trackers( (_config.baseline_calc == 3 || _config.threshold_calc == 5) ? _channel_info.NChannels() : 0,
+                      PedestalTracker(_config.pedestal_tracker_decay)),
+  _fft_manager(),
+  _workspaces( (unsigned) ((_config.static_input_size > 0) ? _config.static_input_size: 0)),
+  _arena( (_config.n_threads > 0) ? _config.n_threads : tbb::task_arena::automatic)
 {
   _event_ind = 0;
+  // load up FFTW wisdom before making any plans
+  if (_config.fft_wisdom_file.size()) {
+    FFTPlanCache::Instance().SetWisdomFile(_config.fft_wisdom_file);
+  }
+  if (_config.static_input_size > 0) {
+    _fft_manager.Set(_config.static_input_size);
+  }
+  _correlation_engine.SetChannels(_config.correlation_channels);
+  _correlation_engine.SetIntersectNoise(_config.correlation_intersect_noise);
+  _coherent_noise.SetGroups(_config.coherent_noise_groups);
 }
 
 Analysis::AnalysisConfig::AnalysisConfig(const fhicl::ParameterSet &param) {
@@ -77,6 +103,8 @@ Analysis::AnalysisConfig::AnalysisConfig(const fhicl::ParameterSet &param) {
   // 1 == use gauss fitter rms
   // 2 == use raw rms
   // 3 == use rolling average of rms
+  // 4 == use robust estimate of gaussian rms (RobustThreshold)
+  // 5 == use gaussian rms tracked across events (PedestalTracker)
   threshold_calc = param.get<unsigned>("threshold_calc", 0);
   threshold_sigma = param.get<float>("threshold_sigma", 5.);
   threshold = param.get<float>("threshold", 100);
@@ -93,8 +121,21 @@ Analysis::AnalysisConfig::AnalysisConfig(const fhicl::ParameterSet &param) {
   // 0 == assume baseline is 0
   // 1 == assume baseline is in digits.GetPedestal()
   // 2 == use mode finding to get baseline
+  // 3 == use baseline tracked across events (PedestalTracker)
   baseline_calc = param.get<unsigned>("baseline_calc", 1);
 
+  // only used if baseline_calc == 3 or threshold_calc == 5
+  // weight of the past relative to each update of the tracked pedestal
+  pedestal_tracker_decay = param.get<float>("pedestal_tracker_decay", 0.9);
+  // the weight of each update grows as 1 / decay
+  if (!(pedestal_tracker_decay > 0. && pedestal_tracker_decay < 1.)) {
+    throw cet::exception("Analysis") << "pedestal_tracker_decay must be in (0, 1), got "
+      << pedestal_tracker_decay << "\n";
+  }
+  // the pedestal of each channel is updated on one of every
+  // pedestal_tracker_period events (staggered across channels)
+  pedestal_tracker_period = std::max(param.get<unsigned>("pedestal_tracker_period", 1), 1u);
+
   // whether to refine the baseline by calculating the mean
   // of all adc values
   refine_baseline = param.get<bool>("refine_baseline", false);
@@ -116,6 +157,9 @@ Analysis::AnalysisConfig::AnalysisConfig(const fhicl::ParameterSet &param) {
   // Number of input adc counts per waveform. Set to negative if unknown.
   // Setting to some positive number will speed up FFT's.
   static_input_size = param.get<int>("static_input_size", -1);
+  // File to load/save FFTW wisdom. Saves the time spent measuring FFT plans 
+  // on startup. Not used if empty.
+  fft_wisdom_file = param.get<std::string>("fft_wisdom_file", "");
   // how many headers to expect (set to negative if don't process) 
   // Expects the passed in HeaderData objects to have "index" values in [0, n_headers)
   n_headers = param.get<int>("n_headers", -1);
@@ -126,8 +170,65 @@ Analysis::AnalysisConfig::AnalysisConfig(const fhicl::ParameterSet &param) {
   reduce_data = param.get<bool>("reduce_data", false);
   timing = param.get<bool>("timing", false);
 
+  // number of threads used to process channels
+  // 1 == process channels serially
+  // 0 == use as many threads as are available
+  n_threads = param.get<int>("n_threads", 1);
+  // the ROOT gauss fitter is not thread safe
+  if (threshold_calc == 1 && n_threads != 1) {
+    std::cerr << "Warning: threshold_calc == 1 is not thread safe. Processing channels serially." << std::endl;
+    n_threads = 1;
+  }
+
   find_signal = param.get<bool>("find_signal", true);
 
+  // whether to calculate the baseline, thresholds, smoothing for peak
+  // finding and noise RMS from a single pass over each waveform
+  fused_channel_kernel = param.get<bool>("fused_channel_kernel", false);
+
+  // whether to copy the waveforms of each event into one contiguous,
+  // channel-major buffer before processing them
+  waveform_matrix = param.get<bool>("waveform_matrix", false);
+
+  // channels to include in the correlation matrix, as a list of [lo, hi) ranges
+  // (e.g. one FEMB or one plane). Empty means the first correlation_max_channels
+  // channels. The matrix (and the buffers used to build it) grows as the
+  // square of the number of channels, so at most correlation_max_channels
+  // may be selected.
+  correlation_max_channels = param.get<unsigned>("correlation_max_channels", 1024);
+  std::vector<std::vector<unsigned>> correlation_lists = param.get<std::vector<std::vector<unsigned>>>("correlation_channels", {});
+  unsigned n_correlation_channels = 0;
+  for (const std::vector<unsigned> &channel_pair: correlation_lists) {
+    correlation_channels.push_back({channel_pair[0], channel_pair[1]});
+    if (channel_pair[1] > channel_pair[0]) n_correlation_channels += channel_pair[1] - channel_pair[0];
+  }
+  if (correlation_channels.empty()) {
+    correlation_channels.push_back({0, correlation_max_channels});
+  }
+  else if (n_correlation_channels > correlation_max_channels) {
+    throw cet::exception("Analysis") << "correlation_channels selects " << n_correlation_channels
+      << " channels, more than correlation_max_channels (" << correlation_max_channels << ")\n";
+  }
+  // whether each pair in the correlation matrix only uses the ticks in the noise
+  // ranges of both channels. If false, uses each channel's own noise ranges (faster).
+  correlation_intersect_noise = param.get<bool>("correlation_intersect_noise", true);
+
+  // groups of channels read out together (e.g. ASIC's, FEMB's or boards) to
+  // sum up looking for coherent noise, as a list of [lo, hi) ranges. If
+  // coherent_noise_group_size is set instead, the channels are split up
+  // into consecutive groups of that size.
+  std::vector<std::vector<unsigned>> group_lists = param.get<std::vector<std::vector<unsigned>>>("coherent_noise_groups", {});
+  for (const std::vector<unsigned> &channel_pair: group_lists) {
+    coherent_noise_groups.push_back({channel_pair[0], channel_pair[1]});
+  }
+  unsigned group_size = param.get<unsigned>("coherent_noise_group_size", 0);
+  if (group_lists.empty() && group_size > 0) {
+    unsigned n_channels = param.get<fhicl::ParameterSet>("channel_info").get<unsigned>("n_channels", 0);
+    for (unsigned lo = 0; lo < n_channels; lo += group_size) {
+      coherent_noise_groups.push_back({lo, std::min(lo + group_size, n_channels)});
+    }
+  }
+
   // name of producer of raw::RawDigits
   //std::string producers = param.get<std::string>("producer_name");
   producers = param.get<std::vector<std::string>>("raw_digit_producers");
@@ -143,13 +244,9 @@ void Analysis::AnalyzeEvent(art::Event const & event) {
   _event_ind ++;
 
   // clear out containers from last iter
+  // (keeping their memory around for this one)
   for (unsigned i = 0; i < _channel_info.NChannels(); i++) {
-    _per_channel_data[i].waveform.clear();
-    _per_channel_data[i].fft_real.clear();
-    _per_channel_data[i].fft_imag.clear();
-    _per_channel_data[i].fft_mag.clear();
-    _per_channel_data[i].peaks.clear();
-    _per_channel_data[i] = ChannelData(i); // reset data
+    _per_channel_data[i].Reset(i);
   }
 
   // get the raw digits
@@ -170,14 +267,84 @@ void Analysis::AnalyzeEvent(art::Event const & event) {
     art::fill_ptr_vector(_raw_digits_handle, digit_handle);
   }
 
+  // Figure out which digits to process for each channel. The first non-empty
+  // digits for a channel are used.
+  std::fill(_channel_digits_index.begin(), _channel_digits_index.end(), -1);
   unsigned index = 0;
-  // calculate per channel stuff 
-  for (auto const& digits: _raw_digits_handle) {
+  for (unsigned i = 0; i < _raw_digits_handle.size(); i++) {
+    auto const& digits = _raw_digits_handle[i];
     // ignore channels over limit
     if (digits->Channel() >= _channel_info.NChannels()) continue;
     _channel_index_map[digits->Channel()] = index;
-    ProcessChannel(*digits);
     index++;
+
+    int &digits_index = _channel_digits_index[digits->Channel()];
+    if (digits_index < 0 || (_raw_digits_handle[digits_index]->NADC() == 0 && digits->NADC() != 0)) {
+      digits_index = i;
+    }
+  }
+  size_t max_ticks = 0;
+  for (unsigned channel = 0; channel < _waveforms.size(); channel++) {
+    int digits_index = _channel_digits_index[channel];
+    _waveforms[channel] = (digits_index >= 0) ? ADCView(_raw_digits_handle[digits_index]->ADCs()) : ADCView();
+    max_ticks = std::max(max_ticks, _waveforms[channel].size());
+  }
+  if (_config.waveform_matrix) {
+    _waveform_matrix.Reset(_channel_info.NChannels(), max_ticks);
+  }
+
+  // calculate per channel stuff
+  // Channels are independent here, so they can be processed in parallel
+  auto process_channels = [this](const tbb::blocked_range<unsigned> &range) {
+    ChannelWorkspace &workspace = _workspaces.local();
+    for (unsigned channel = range.begin(); channel < range.end(); channel++) {
+      if (_channel_digits_index[channel] < 0) continue;
+      // pack the waveform into its row of the matrix, and use that from now on
+      if (_config.waveform_matrix) {
+        if (_config.timing) workspace.timing.StartTime();
+        _waveform_matrix.Fill(channel, _waveforms[channel]);
+        _waveforms[channel] = _waveform_matrix.Row(channel);
+        if (_config.timing) workspace.timing.EndTime(&workspace.timing.fill_waveform);
+      }
+      ProcessChannel(*_raw_digits_handle[_channel_digits_index[channel]], workspace);
+    }
+  };
+  tbb::blocked_range<unsigned> all_channels(0, _channel_info.NChannels());
+  if (_config.n_threads == 1) {
+    process_channels(all_channels);
+  }
+  else {
+    _arena.execute([&] { tbb::parallel_for(all_channels, process_channels); });
+  }
+
+  // Fourier transform channels in batches
+  if (_config.fft_per_channel) {
+    _fft_channels.clear();
+    for (unsigned channel = 0; channel < _channel_info.NChannels(); channel++) {
+      if (!_per_channel_data[channel].empty) _fft_channels.push_back(channel);
+    }
+    unsigned n_batches = (_fft_channels.size() + BatchFFT::kDefaultBatchSize - 1) / BatchFFT::kDefaultBatchSize;
+    auto process_ffts = [this](const tbb::blocked_range<unsigned> &range) {
+      ChannelWorkspace &workspace = _workspaces.local();
+      for (unsigned batch = range.begin(); batch < range.end(); batch++) {
+        unsigned first = batch * BatchFFT::kDefaultBatchSize;
+        ProcessFFTs(first, std::min<unsigned>(first + BatchFFT::kDefaultBatchSize, _fft_channels.size()), workspace);
+      }
+    };
+    tbb::blocked_range<unsigned> all_batches(0, n_batches);
+    if (_config.n_threads == 1) {
+      process_ffts(all_batches);
+    }
+    else {
+      _arena.execute([&] { tbb::parallel_for(all_batches, process_ffts); });
+    }
+  }
+
+  // collect the timing information from each thread
+  if (_config.timing) {
+    for (ChannelWorkspace &workspace: _workspaces) {
+      _timing.Merge(workspace.timing);
+    }
   }
 
   if (_config.timing) {
@@ -199,32 +366,10 @@ void Analysis::AnalyzeEvent(art::Event const & event) {
 
   // now calculate stuff that depends on stuff between channels
 
-  // DNoise
-  for (unsigned i = 0; i < _channel_info.NChannels() - 1; i++) {
-    unsigned next_channel = i + 1; 
-
-    if (!_per_channel_data[i].empty && !_per_channel_data[next_channel].empty) {
-      unsigned raw_digits_i = _channel_index_map[i];
-      unsigned raw_digits_next_channel = _channel_index_map[next_channel];
-      float unscaled_dnoise = _noise_samples[i].DNoise(
-          _raw_digits_handle[raw_digits_i]->ADCs(), _noise_samples[next_channel], _raw_digits_handle[raw_digits_next_channel]->ADCs(), _config.n_max_noise_samples);
-      // Don't use same noise sample to scale dnoise
-      // This should probably be ok, as long as the dnoise sample is large enough
-
-      // but special case when rms is too small
-      if (_per_channel_data[i].rms > 1e-4 && _per_channel_data[next_channel].rms > 1e-4) {
-        float dnoise_scale = sqrt(_per_channel_data[i].rms * _per_channel_data[i].rms + 
-                                  _per_channel_data[next_channel].rms * _per_channel_data[next_channel].rms);
-    
-        _per_channel_data[i].next_channel_dnoise = unscaled_dnoise / dnoise_scale; 
-      }
-      else {
-        _per_channel_data[i].next_channel_dnoise = 1.;
-      }
-    }
-  }
-  // don't set last dnoise
-  _per_channel_data[_channel_info.NChannels() - 1].next_channel_dnoise = 0;
+  // DNoise and coherent noise of each group
+  _arena.execute([&] {
+    _coherent_noise.Compute(_waveforms, _noise_samples, _per_channel_data, _config.n_max_noise_samples);
+  });
 
   if (_config.timing) {
     _timing.EndTime(&_timing.coherent_noise_calc);
@@ -261,7 +406,7 @@ void Analysis::ProcessHeader(const tpcAnalysis::HeaderData &header) {
   _header_data[header.index] = header;
 }
 	      
-void Analysis::ProcessChannel(const raw::RawDigit &digits) {
+void Analysis::ProcessChannel(const raw::RawDigit &digits, ChannelWorkspace &workspace) {
   auto channel = digits.Channel();
   if (channel >= _channel_info.NChannels()) return;
 
@@ -269,83 +414,76 @@ void Analysis::ProcessChannel(const raw::RawDigit &digits) {
   if (!_per_channel_data[channel].empty) return;
 
   // handle empty events
-  if (digits.NADC() == 0) {
-    // default constructor handles empty event
-    _per_channel_data[channel] = ChannelData(channel);
-    _noise_samples[channel] = NoiseSample();
+  if (_waveforms[channel].empty()) {
+    _per_channel_data[channel].Reset(channel);
+    _noise_samples[channel].Clear();
     return;
   }
 
   // if there are ADC's, the channel isn't empty
   _per_channel_data[channel].empty = false;
  
-  // re-allocate FFT if necessary
-  if (_fft_manager.InputSize() != digits.NADC()) {
-    _fft_manager.Set(digits.NADC());
-  }
-   
   _per_channel_data[channel].channel_no = channel;
 
-  auto adc_vec = digits.ADCs();
+  // view of the ADC values, no copy
+  ADCView adc_vec = _waveforms[channel];
+
+  ChannelData &data = _per_channel_data[channel];
+  size_t capacity = 0;
   if (_config.timing) {
-    _timing.StartTime();
+    capacity = Capacity(data.waveform, data.peaks, data.noise_ranges, *_noise_samples[channel].Ranges(),
+                        *workspace.peak_finder.Peaks(), workspace.kernel.Smoothed());
   }
-  auto n_adc = digits.NADC();
-  if (_config.fill_waveforms || _config.fft_per_channel) {
-    for (unsigned i = 0; i < n_adc; i ++) {
-      int16_t adc = adc_vec[i];
-    
-      // fill up waveform
-       if (_config.fill_waveforms) {
-        _per_channel_data[channel].waveform.push_back(adc);
-      }
-
-      if (_config.fft_per_channel) {
-        // fill up fftw array
-        double *input = _fft_manager.InputAt(i);
-        *input = (double) adc;
-      }
-    }
+  if (_config.timing) {
+    workspace.timing.StartTime();
+  }
+  // fill up waveform
+  if (_config.fill_waveforms) {
+    _per_channel_data[channel].waveform.assign(adc_vec.begin(), adc_vec.end());
   }
 
   if (_config.timing) {
-    _timing.EndTime(&_timing.fill_waveform);
+    workspace.timing.EndTime(&workspace.timing.fill_waveform);
   }
   if (_config.timing) {
-    _timing.StartTime();
+    workspace.timing.StartTime();
+  }
+  // one pass over the waveform for everything but the peak finding
+  FusedChannelKernel &kernel = workspace.kernel;
+  if (_config.fused_channel_kernel) {
+    kernel.Fill(adc_vec, _config.baseline_calc == 2, _config.n_mode_skip, 
+        (_config.find_signal) ? _config.n_smoothing_samples : 1);
   }
+
+  // only take a pass over the waveform for the tracked pedestal on some events
+  if (_pedestal_trackers.size()) {
+    PedestalTracker &tracker = _pedestal_trackers[channel];
+    if (!tracker.Ready() || (_event_ind + channel) % _config.pedestal_tracker_period == 0) {
+      tracker.Update(adc_vec, _config.n_mode_skip);
+    }
+  }
+
   if (_config.baseline_calc == 0) {
     _per_channel_data[channel].baseline = 0;
   }
   else if (_config.baseline_calc == 1) {
     _per_channel_data[channel].baseline = digits.GetPedestal();
   }
-  else if (_config.baseline_calc == 2) {
-    _per_channel_data[channel].baseline = Mode(digits.ADCs(), _config.n_mode_skip);
-  }
-  if (_config.timing) {
-    _timing.EndTime(&_timing.baseline_calc);
+  else if (_config.baseline_calc == 2 && _config.fused_channel_kernel) {
+    _per_channel_data[channel].baseline = kernel.Mode();
   }
-
-  if (_config.timing) {
-    _timing.StartTime();
+  else if (_config.baseline_calc == 2) {
+    _per_channel_data[channel].baseline = Mode(adc_vec.data(), adc_vec.size(), _config.n_mode_skip);
   }
-  // calculate FFTs
-  if (_config.fft_per_channel) {
-    _fft_manager.Execute();
-    int adc_fft_size = _fft_manager.OutputSize();
-    for (int i = 0; i < adc_fft_size; i++) {
-      _per_channel_data[channel].fft_real.push_back(_fft_manager.ReOutputAt(i));
-      _per_channel_data[channel].fft_imag.push_back(_fft_manager.ImOutputAt(i));
-      _per_channel_data[channel].fft_mag.push_back(sqrt(_fft_manager.ReOutputAt(i) * _fft_manager.ReOutputAt(i) + _fft_manager.ImOutputAt(i) * _fft_manager.ImOutputAt(i)));
-    } 
+  else if (_config.baseline_calc == 3) {
+    _per_channel_data[channel].baseline = _pedestal_trackers[channel].Baseline();
   }
   if (_config.timing) {
-    _timing.EndTime(&_timing.execute_fft);
+    workspace.timing.EndTime(&workspace.timing.baseline_calc);
   }
 
   if (_config.timing) {
-    _timing.StartTime();
+    workspace.timing.StartTime();
   }
   // get thresholds 
   float threshold = _config.threshold;
@@ -356,9 +494,11 @@ void Analysis::ProcessChannel(const raw::RawDigit &digits) {
     auto thresholds = Threshold(adc_vec, _per_channel_data[channel].baseline, _config.threshold_sigma, _config.verbose);
     threshold = thresholds.Val();
   }
+  else if (_config.threshold_calc == 2 && _config.fused_channel_kernel) {
+    threshold = kernel.Sums().RMS(_per_channel_data[channel].baseline) * _config.threshold_sigma;
+  }
   else if (_config.threshold_calc == 2) {
-    NoiseSample temp({{0, (unsigned)digits.NADC()-1}}, _per_channel_data[channel].baseline);
-    float raw_rms = temp.RMS(adc_vec);
+    float raw_rms = RawRMS(adc_vec, _per_channel_data[channel].baseline);
     threshold = raw_rms * _config.threshold_sigma;
   }
   else if (_config.threshold_calc == 3) {
@@ -366,54 +506,83 @@ void Analysis::ProcessChannel(const raw::RawDigit &digits) {
     float n_sigma = _config.threshold_sigma;
     if (_config.use_planes && _channel_info.PlaneType(channel) == PeakFinder::collection) n_sigma = n_sigma * 1.5;
   
-    threshold = _thresholds[channel].Threshold(adc_vec, _per_channel_data[channel].baseline, n_sigma);
+    if (_config.fused_channel_kernel) {
+      threshold = _thresholds[channel].Threshold(kernel.Sums().RMS(_per_channel_data[channel].baseline), n_sigma);
+    }
+    else {
+      threshold = _thresholds[channel].Threshold(adc_vec, _per_channel_data[channel].baseline, n_sigma);
+    }
+  }
+  else if (_config.threshold_calc == 4) {
+    threshold = workspace.robust_threshold.Threshold(adc_vec, _per_channel_data[channel].baseline, _config.threshold_sigma);
+  }
+  else if (_config.threshold_calc == 5) {
+    threshold = _pedestal_trackers[channel].Threshold(_config.threshold_sigma);
   }
   if (_config.timing) {
-    _timing.EndTime(&_timing.calc_threshold);
+    workspace.timing.EndTime(&workspace.timing.calc_threshold);
   }
 
   _per_channel_data[channel].threshold = threshold;
 
   if (_config.timing) {
-    _timing.StartTime();
+    workspace.timing.StartTime();
   }
   // get Peaks
 
   if (_config.find_signal) {
     PeakFinder::plane_type plane = (_config.use_planes) ? _channel_info.PlaneType(channel) : PeakFinder::unspecified;
   
-    PeakFinder peaks(adc_vec, _per_channel_data[channel].baseline, threshold, 
-        _config.n_smoothing_samples, _config.n_above_threshold, plane);
+    PeakFinder &peaks = workspace.peak_finder;
+    if (_config.fused_channel_kernel) {
+      peaks.Find(adc_vec, kernel.Smoothed(), _per_channel_data[channel].baseline, threshold, 
+          _config.n_smoothing_samples, _config.n_above_threshold, plane);
+    }
+    else {
+      peaks.Find(adc_vec, _per_channel_data[channel].baseline, threshold, 
+          _config.n_smoothing_samples, _config.n_above_threshold, plane);
+    }
     _per_channel_data[channel].peaks.assign(peaks.Peaks()->begin(), peaks.Peaks()->end());
   }
 
   if (_config.timing) {
-    _timing.EndTime(&_timing.find_peaks);
+    workspace.timing.EndTime(&workspace.timing.find_peaks);
   }
 
   if (_config.timing) {
-    _timing.StartTime();
+    workspace.timing.StartTime();
   }
   // get noise samples
   if (_config.noise_range_sampling == 0) {
     // use first n_noise_samples
-    _noise_samples[channel] = NoiseSample( { { 0, _config.n_noise_samples -1 } }, _per_channel_data[channel].baseline);
+    _noise_samples[channel].Set(0, _config.n_noise_samples -1, _per_channel_data[channel].baseline);
   }
   else {
     // or use peak finding
-    _noise_samples[channel] = NoiseSample(_per_channel_data[channel].peaks, _per_channel_data[channel].baseline, digits.NADC()); 
+    _noise_samples[channel].Set(_per_channel_data[channel].peaks, _per_channel_data[channel].baseline, adc_vec.size()); 
   }
 
-  // Refine baseline values by taking the mean over the background range
-  if (_config.refine_baseline) {
-    _noise_samples[channel].ResetBaseline(adc_vec);
-    _per_channel_data[channel].baseline = _noise_samples[channel].Baseline(); 
+  if (_config.fused_channel_kernel) {
+    WaveformSums noise_sums = kernel.RangeSums(adc_vec, *_noise_samples[channel].Ranges());
+    // Refine baseline values by taking the mean over the background range
+    if (_config.refine_baseline && noise_sums.n > 0) {
+      _noise_samples[channel].SetBaseline(noise_sums.Mean());
+      _per_channel_data[channel].baseline = _noise_samples[channel].Baseline(); 
+    }
+    _per_channel_data[channel].rms = noise_sums.RMS(_per_channel_data[channel].baseline);
   }
+  else {
+    // Refine baseline values by taking the mean over the background range
+    if (_config.refine_baseline) {
+      _noise_samples[channel].ResetBaseline(adc_vec);
+      _per_channel_data[channel].baseline = _noise_samples[channel].Baseline(); 
+    }
 
-  _per_channel_data[channel].rms = _noise_samples[channel].RMS(adc_vec, _config.n_max_noise_samples);
-  _per_channel_data[channel].noise_ranges = *_noise_samples[channel].Ranges();
+    _per_channel_data[channel].rms = _noise_samples[channel].RMS(adc_vec, _config.n_max_noise_samples);
+  }
+  _per_channel_data[channel].noise_ranges.assign(_noise_samples[channel].Ranges()->begin(), _noise_samples[channel].Ranges()->end());
   if (_config.timing) {
-    _timing.EndTime(&_timing.calc_noise);
+    workspace.timing.EndTime(&workspace.timing.calc_noise);
   }
 
   // register rms if using running threshold
@@ -424,6 +593,70 @@ void Analysis::ProcessChannel(const raw::RawDigit &digits) {
   // calculate derived quantities
   _per_channel_data[channel].occupancy = _per_channel_data[channel].Occupancy();
   _per_channel_data[channel].mean_peak_height = _per_channel_data[channel].meanPeakHeight();
+
+  if (_config.timing) {
+    size_t new_capacity = Capacity(data.waveform, data.peaks, data.noise_ranges, *_noise_samples[channel].Ranges(),
+                                   *workspace.peak_finder.Peaks(), workspace.kernel.Smoothed());
+    if (new_capacity != capacity) workspace.timing.buffer_growths ++;
+  }
+}
+
+void Analysis::ProcessFFTs(unsigned first, unsigned last, ChannelWorkspace &workspace) {
+  if (_config.timing) {
+    workspace.timing.StartTime();
+  }
+  // batch up channels with the same length as the first one
+  unsigned n_ticks = _waveforms[_fft_channels[first]].size();
+  workspace.batch_fft.Set(n_ticks);
+
+  std::array<const int16_t *, BatchFFT::kDefaultBatchSize> rows;
+  std::array<unsigned, BatchFFT::kDefaultBatchSize> channels;
+  unsigned n_rows = 0;
+  for (unsigned i = first; i < last; i++) {
+    unsigned channel = _fft_channels[i];
+    ADCView waveform = _waveforms[channel];
+    if (waveform.size() == n_ticks) {
+      rows[n_rows] = waveform.data();
+      channels[n_rows] = channel;
+      n_rows ++;
+      continue;
+    }
+
+    // odd one out -- transform it on its own
+    FFTManager &fft = workspace.fft_manager;
+    fft.Set(waveform.size());
+    simd::ToDouble(waveform.data(), waveform.size(), 0, fft.Input());
+    fft.Execute();
+    ChannelData &data = _per_channel_data[channel];
+    size_t capacity = Capacity(data.fft_real, data.fft_imag, data.fft_mag);
+    const fftw_complex *output = fft.Output();
+    for (unsigned j = 0; j < fft.OutputSize(); j++) {
+      data.fft_real.push_back(output[j][0]);
+      data.fft_imag.push_back(output[j][1]);
+      data.fft_mag.push_back(sqrt(output[j][0] * output[j][0] + output[j][1] * output[j][1]));
+    }
+    if (Capacity(data.fft_real, data.fft_imag, data.fft_mag) != capacity) workspace.timing.buffer_growths ++;
+  }
+
+  workspace.batch_fft.Execute(rows.data(), n_rows);
+  unsigned fft_size = workspace.batch_fft.OutputSize();
+  for (unsigned i = 0; i < n_rows; i++) {
+    ChannelData &data = _per_channel_data[channels[i]];
+    const fftw_complex *output = workspace.batch_fft.Output(i);
+    size_t capacity = Capacity(data.fft_real, data.fft_imag, data.fft_mag);
+    data.fft_real.resize(fft_size);
+    data.fft_imag.resize(fft_size);
+    data.fft_mag.resize(fft_size);
+    if (Capacity(data.fft_real, data.fft_imag, data.fft_mag) != capacity) workspace.timing.buffer_growths ++;
+    for (unsigned j = 0; j < fft_size; j++) {
+      data.fft_real[j] = output[j][0];
+      data.fft_imag[j] = output[j][1];
+    }
+    workspace.batch_fft.Magnitude(i, data.fft_mag.data());
+  }
+  if (_config.timing) {
+    workspace.timing.EndTime(&workspace.timing.execute_fft);
+  }
 }
 
 bool Analysis::EmptyEvent() {
@@ -431,28 +664,16 @@ bool Analysis::EmptyEvent() {
 }
 
 float Analysis::Correlation(unsigned channel_i, unsigned channel_j, unsigned max_sample) {
-  unsigned digits_i = _channel_index_map[channel_i];
-  unsigned digits_j = _channel_index_map[channel_j];
-  return _noise_samples[channel_i].Correlation(_raw_digits_handle[digits_i]->ADCs(), 
-    _noise_samples[channel_j], _raw_digits_handle[digits_j]->ADCs(), max_sample);
+  return _noise_samples[channel_i].Correlation(_waveforms[channel_i], 
+    _noise_samples[channel_j], _waveforms[channel_j], max_sample);
 }
 
 std::vector<float> Analysis::CorrelationMatrix(unsigned max_sample) {
   _timing.StartTime();
-  unsigned n_channels = _channel_info.NChannels();
-  std::vector<float> ret(n_channels * n_channels, 0);
-  for (unsigned i = 0; i < n_channels; i++) {
-    for (unsigned j = 0; j <= i; j++) {
-      unsigned set = i * n_channels + j;
-      unsigned set_diag = j * n_channels + i;
-      if (i == j) ret[set] = 1.;
-      else {
-        float corr = Correlation(i, j, max_sample);
-        ret[set] = corr;
-        ret[set_diag] = corr;
-      }
-    }
-  }
+  std::vector<float> ret;
+  _arena.execute([&] {
+    ret = _correlation_engine.Compute(_waveforms, _noise_samples, max_sample);
+  });
   float delta = 0.;
   _timing.EndTime(&delta);
   std::cout << "Correlation matrix took: " << delta << " [ms]\n";
@@ -466,6 +687,19 @@ void Timing::EndTime(float *field) {
   auto now = std::chrono::high_resolution_clock::now();
   *field += std::chrono::duration<float, std::milli>(now- start).count();
 }
+void Timing::Merge(Timing &other) {
+  fill_waveform += other.fill_waveform;
+  baseline_calc += other.baseline_calc;
+  execute_fft += other.execute_fft;
+  calc_threshold += other.calc_threshold;
+  find_peaks += other.find_peaks;
+  calc_noise += other.calc_noise;
+  reduce_data += other.reduce_data;
+  coherent_noise_calc += other.coherent_noise_calc;
+  copy_headers += other.copy_headers;
+  buffer_growths += other.buffer_growths;
+  other = Timing();
+}
 void Timing::Print() {
   std::cout << "FILL WAVEFORM: " << fill_waveform << std::endl;
   std::cout << "CALC BASELINE: " << baseline_calc << std::endl;
@@ -476,6 +710,7 @@ void Timing::Print() {
   std::cout << "REDUCE DATA  : " << reduce_data << std::endl;
   std::cout << "COHERENT NOISE " << coherent_noise_calc << std::endl;
   std::cout << "COPY HEADERS : " << copy_headers << std::endl;
+  std::cout << "BUFFER GROWTHS " << buffer_growths << std::endl;
 }
 
 Analysis::ChannelInfo::ChannelInfo(const fhicl::ParameterSet &param) {
@@ -21,10 +21,18 @@
 #include "lardataobj/RawData/RawDigit.h"
 #include "lardataobj/RecoBase/Hit.h"
 
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/task_arena.h"
+
 #include "ChannelData.hh"
 #include "sbndqm/Decode/TPC/HeaderData.hh"
 #include "FFT.hh"
 #include "Noise.hh"
+#include "CorrelationMatrix.hh"
+#include "CoherentNoise.hh"
+#include "EventWaveformMatrix.hh"
+#include "ChannelKernel.hh"
+#include "PedestalTracker.hh"
 
 /*
   * Main analysis code of the online Monitoring.
@@ -36,6 +44,7 @@
 namespace tpcAnalysis {
   class Analysis;
   class Timing;
+  class ChannelWorkspace;
 }
 
 // keep track of timing information
@@ -51,6 +60,11 @@ public:
   float reduce_data;
   float coherent_noise_calc;
   float copy_headers;
+  // number of times the buffers used to process a channel grew (their
+  // summed capacity changed). A proxy for heap allocations: it does not
+  // see allocations outside of these buffers, and one growth may be several
+  // allocations. Should be 0 once the analysis has seen a few events.
+  unsigned buffer_growths;
 
   Timing():
     fill_waveform(0),
@@ -61,15 +75,32 @@ public:
     calc_noise(0),
     reduce_data(0),
     coherent_noise_calc(0),
-    copy_headers(0)
+    copy_headers(0),
+    buffer_growths(0)
   {}
   
   void StartTime();
   void EndTime(float *field);
+  // add in (and then zero) the times tracked by another Timing object
+  void Merge(Timing &other);
 
   void Print();
 };
 
+// scratch state needed to process a single channel. Each thread
+// processing channels gets its own copy.
+class tpcAnalysis::ChannelWorkspace {
+public:
+  explicit ChannelWorkspace(unsigned fft_size): fft_manager(fft_size) {}
+
+  FFTManager fft_manager;
+  BatchFFT batch_fft;
+  FusedChannelKernel kernel;
+  PeakFinder peak_finder;
+  RobustThreshold robust_threshold;
+  Timing timing;
+};
+
 
 class tpcAnalysis::Analysis {
 public:
@@ -83,6 +114,11 @@ public:
   float Correlation(unsigned channel_i, unsigned channel_j, unsigned max_sample=UINT_MAX);
   // and build the whole matrix
   std::vector<float> CorrelationMatrix(unsigned max_sample=UINT_MAX);
+  // channel of each row (and column) of the last matrix built
+  const std::vector<unsigned> &CorrelationChannels() const { return _correlation_engine.Channels(); }
+  // coherent noise of each group of channels (see coherent_noise_groups)
+  // Call after AnalyzeEvent()
+  const std::vector<CoherentNoiseEngine::Group> &CoherentNoiseGroups() const { return _coherent_noise.Groups(); }
 
   // configuration
   struct AnalysisConfig {
@@ -93,6 +129,7 @@ public:
     std::string instance;
     std::string header_producer;
     int static_input_size;
+    std::string fft_wisdom_file;
 
     int n_headers;
     float threshold;
@@ -104,16 +141,27 @@ public:
     unsigned noise_range_sampling;
     bool use_planes;
     unsigned threshold_calc;
+    float pedestal_tracker_decay;
+    unsigned pedestal_tracker_period;
     unsigned n_noise_samples;
     unsigned n_smoothing_samples;
     unsigned n_above_threshold;
     unsigned n_max_noise_samples;
     bool find_signal;
+    bool fused_channel_kernel;
+    bool waveform_matrix;
 
     bool fft_per_channel;
     bool fill_waveforms;
     bool reduce_data;
     bool timing;
+    int n_threads;
+
+    std::vector<std::array<unsigned, 2>> correlation_channels;
+    unsigned correlation_max_channels;
+    bool correlation_intersect_noise;
+
+    std::vector<std::array<unsigned, 2>> coherent_noise_groups;
 
     AnalysisConfig(const fhicl::ParameterSet &param);
     AnalysisConfig() {}
@@ -134,8 +182,10 @@ public:
   };
 
   // other functions
-  void ProcessChannel(const raw::RawDigit &digits);
+  void ProcessChannel(const raw::RawDigit &digits, ChannelWorkspace &workspace);
   void ProcessHeader(const tpcAnalysis::HeaderData &header);
+  // Fourier transform the channels in _fft_channels[first, last)
+  void ProcessFFTs(unsigned first, unsigned last, ChannelWorkspace &workspace);
 
   // if the containers filled by the analysis are ready to be processed
   bool EmptyEvent();
@@ -146,12 +196,23 @@ public:
   AnalysisConfig _config;
   // keeping track of wire id to index into stuff from Decoder
   std::vector<unsigned> _channel_index_map;
+  // index into _raw_digits_handle of the digits processed for each channel (-1 if none)
+  std::vector<int> _channel_digits_index;
+  // ADC values of the digits processed for each channel (empty if none).
+  // These point into _waveform_matrix if it is in use.
+  std::vector<ADCView> _waveforms;
+  // all of the waveforms of the event, packed into one buffer (if waveform_matrix is set)
+  EventWaveformMatrix _waveform_matrix;
+  // non-empty channels to Fourier transform this event
+  std::vector<unsigned> _fft_channels;
   // output containers of analysis code. Only use after calling ReadyToProcess()
   std::vector<tpcAnalysis::ChannelData> _per_channel_data;
   std::vector<tpcAnalysis::ReducedChannelData> _per_channel_data_reduced;
   std::vector<tpcAnalysis::NoiseSample> _noise_samples;
   std::vector<tpcAnalysis::HeaderData> _header_data;
   std::vector<RunningThreshold> _thresholds;
+  // baseline and noise of each channel tracked across events (baseline_calc == 3 or threshold_calc == 5)
+  std::vector<PedestalTracker> _pedestal_trackers;
   // raw digits container for each event
   std::vector<art::Ptr<raw::RawDigit>> _raw_digits_handle;
   FFTManager _fft_manager;
@@ -161,6 +222,16 @@ private:
   // keep track of timing data (maybe)
   tpcAnalysis::Timing _timing;
 
+  // per-thread scratch space for channel processing
+  tbb::enumerable_thread_specific<ChannelWorkspace> _workspaces;
+  // threads used to process channels
+  tbb::task_arena _arena;
+
+  // computes the correlation matrix
+  CorrelationEngine _correlation_engine;
+  // computes the DNoise and the coherent noise of each group of channels
+  CoherentNoiseEngine _coherent_noise;
+
   // header data container for each event
   art::Handle<std::vector<tpcAnalysis::HeaderData>> _header_data_handle;
 };
@@ -0,0 +1,89 @@
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+
+#include "art/Framework/Principal/Handle.h"
+#include "lardataobj/RawData/RawDigit.h"
+
+#include "Benchmark.hh"
+
+using namespace tpcAnalysis;
+
+void BenchmarkResult::Compare(double diff) {
+  n_compared ++;
+  if (diff == 0.) n_equal ++;
+  sum_diff += diff;
+  sum_diff2 += diff * diff;
+  max_diff = std::max(max_diff, std::fabs(diff));
+}
+
+void BenchmarkResult::Add(const BenchmarkResult &other) {
+  time += other.time;
+  n_compared += other.n_compared;
+  n_equal += other.n_equal;
+  n_no_reference += other.n_no_reference;
+  sum_diff += other.sum_diff;
+  sum_diff2 += other.sum_diff2;
+  max_diff = std::max(max_diff, other.max_diff);
+}
+
+void BenchmarkResult::Print(const std::string &name, unsigned n_waveforms) const {
+  double mean = n_compared ? sum_diff / n_compared : 0.;
+  double rms = n_compared ? sqrt(std::max(sum_diff2 / n_compared - mean * mean, 0.)) : 0.;
+  std::cout << name << ": " << time << " ms (" << (n_waveforms ? 1000. * time / n_waveforms : 0.) << " us per waveform)";
+  std::cout << " diff mean: " << mean << " rms: " << rms << " max |diff|: " << max_diff;
+  std::cout << " equal: " << (n_compared ? (float)n_equal / n_compared : 0.);
+  if (n_no_reference) std::cout << " no reference: " << n_no_reference;
+  std::cout << std::endl;
+}
+
+Benchmark::Benchmark(const fhicl::ParameterSet &p, const std::vector<std::string> &names):
+  _producers(p.get<std::vector<art::InputTag>>("raw_digit_producers")),
+  _n_repeat(std::max(p.get<unsigned>("n_repeat", 1), 1u)),
+  _verbose(p.get<bool>("verbose", false)),
+  _names(names),
+  _event_results(names.size()),
+  _results(names.size()),
+  _n_waveforms(0)
+{}
+
+const std::vector<ADCView> &Benchmark::Collect(const art::Event &e) {
+  _waveforms.clear();
+  for (auto const &producer: _producers) {
+    auto const &digits = *e.getValidHandle<std::vector<raw::RawDigit>>(producer);
+    for (auto const &digit: digits) {
+      if (digit.ADCs().empty()) continue;
+      _waveforms.push_back(digit.ADCs());
+    }
+  }
+  std::fill(_event_results.begin(), _event_results.end(), BenchmarkResult());
+  return _waveforms;
+}
+
+void Benchmark::EndEvent(const art::Event &e) {
+  if (_verbose) {
+    std::cout << "EVENT " << e.event() << " (" << _waveforms.size() << " waveforms)" << std::endl;
+    PrintResults(_event_results, _waveforms.size());
+  }
+  for (unsigned i = 0; i < _results.size(); i++) _results[i].Add(_event_results[i]);
+  _n_waveforms += _waveforms.size();
+}
+
+void Benchmark::Print(const std::string &title) const {
+  std::cout << title << " (" << _n_waveforms << " waveforms, timed " << _n_repeat << " times each)" << std::endl;
+  PrintResults(_results, _n_waveforms);
+}
+
+void Benchmark::PrintResults(const std::vector<BenchmarkResult> &results, unsigned n_waveforms) const {
+  size_t width = 0;
+  for (auto const &name: _names) width = std::max(width, name.size());
+  for (unsigned i = 0; i < results.size(); i++) {
+    std::stringstream name;
+    name << std::left << std::setw(width) << _names[i];
+    results[i].Print(name.str(), n_waveforms);
+  }
+}
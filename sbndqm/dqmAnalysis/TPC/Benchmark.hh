@@ -0,0 +1,85 @@
+#ifndef _sbnddaq_analysis_Benchmark
+#define _sbnddaq_analysis_Benchmark
+#include <vector>
+#include <string>
+#include <chrono>
+
+#include "canvas/Utilities/InputTag.h"
+#include "art/Framework/Principal/Event.h"
+#include "fhiclcpp/ParameterSet.h"
+
+#include "Span.hh"
+
+// Harness shared by the analyzers which benchmark algorithms against a
+// reference on the waveforms of real RawDigits (ModeBenchmark and
+// ThresholdBenchmark). It collects the waveforms of each event, times the
+// algorithms and keeps track of how far each is from the reference, per
+// event and over the whole job.
+//
+// Configuration (common to all of the benchmarks):
+//   raw_digit_producers: producers of the RawDigits
+//   n_repeat: number of times each algorithm is timed on an event
+//   verbose: whether to print the results of each event
+namespace tpcAnalysis {
+
+// speed and accuracy of one algorithm
+class BenchmarkResult {
+public:
+  float time; // ms
+  unsigned n_compared;
+  unsigned n_equal;
+  // waveforms where the reference was not usable
+  unsigned n_no_reference;
+  // difference to the reference
+  double sum_diff;
+  double sum_diff2;
+  double max_diff; // of |diff|
+
+  BenchmarkResult(): time(0.), n_compared(0), n_equal(0), n_no_reference(0), sum_diff(0.), sum_diff2(0.), max_diff(0.) {}
+  // add the difference of the algorithm to the reference on one waveform
+  void Compare(double diff);
+  void Add(const BenchmarkResult &other);
+  void Print(const std::string &name, unsigned n_waveforms) const;
+};
+
+class Benchmark {
+public:
+  // names of the algorithms which are compared
+  Benchmark(const fhicl::ParameterSet &p, const std::vector<std::string> &names);
+
+  // Collect the (non-empty) waveforms of the event and start its results
+  const std::vector<ADCView> &Collect(const art::Event &e);
+
+  // time f() (in ms), averaged over n_repeat runs
+  template<typename F>
+  float Time(const F &f) const {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (unsigned repeat = 0; repeat < _n_repeat; repeat++) f();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<float, std::milli>(end - start).count() / _n_repeat;
+  }
+
+  // results of the i-th algorithm on the current event
+  BenchmarkResult &Result(unsigned i) { return _event_results[i]; }
+
+  // print the results of the event (if verbose) and add them to the totals
+  void EndEvent(const art::Event &e);
+  // print the totals of the job
+  void Print(const std::string &title) const;
+
+private:
+  void PrintResults(const std::vector<BenchmarkResult> &results, unsigned n_waveforms) const;
+
+  std::vector<art::InputTag> _producers;
+  unsigned _n_repeat;
+  bool _verbose;
+  std::vector<std::string> _names;
+
+  std::vector<ADCView> _waveforms;
+  std::vector<BenchmarkResult> _event_results;
+  std::vector<BenchmarkResult> _results;
+  unsigned _n_waveforms;
+};
+
+} // namespace tpcAnalysis
+#endif
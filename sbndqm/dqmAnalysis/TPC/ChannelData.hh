@@ -45,6 +45,24 @@ public:
     mean_peak_height(0),
     occupancy(0)
   {}
+
+  // reset to the zero initialized state, keeping the memory of the containers
+  void Reset(unsigned channel) {
+    channel_no = channel;
+    empty = true;
+    baseline = 0;
+    rms = 0;
+    next_channel_dnoise = 0;
+    threshold = 0;
+    waveform.clear();
+    fft_real.clear();
+    fft_imag.clear();
+    fft_mag.clear();
+    peaks.clear();
+    noise_ranges.clear();
+    mean_peak_height = 0;
+    occupancy = 0;
+  }
 };
 
 class ReducedChannelData {
@@ -0,0 +1,95 @@
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <math.h>
+
+#include "ChannelKernel.hh"
+#include "SIMD.hh"
+#include "sbndqm/Decode/Mode/Mode.hh"
+
+using namespace tpcAnalysis;
+
+float WaveformSums::RMS(int16_t baseline) const {
+  // sum of (x - baseline)^2
+  int64_t ret = sum2 - 2 * (int64_t)baseline * sum + (int64_t)n * baseline * baseline;
+  return sqrt((double)ret / n);
+}
+
+void FusedChannelKernel::Fill(ADCView waveform, bool fill_mode, unsigned n_mode_skip, unsigned n_smoothing_samples) {
+  size_t n_adc = waveform.size();
+  const int16_t *adcs = waveform.data();
+
+  bool do_smoothing = n_smoothing_samples > 1 && n_adc >= n_smoothing_samples;
+  _smoothed.resize(do_smoothing ? n_adc - n_smoothing_samples + 1 : 0);
+
+  int64_t sum = 0;
+  int64_t sum2 = 0;
+  // running sum over the smoothing window
+  int window = 0;
+  unsigned mode_skip = 0;
+
+  for (size_t i = 0; i < n_adc; i++) {
+    int16_t val = adcs[i];
+    sum += val;
+    sum2 += (int32_t)val * val;
+
+    if (fill_mode && mode_skip == 0) _mode_finder.Add(val);
+    if (++mode_skip == n_mode_skip) mode_skip = 0;
+
+    if (do_smoothing) {
+      window += val;
+      if (i + 1 >= n_smoothing_samples) {
+        _smoothed[i + 1 - n_smoothing_samples] = ((double) window) / n_smoothing_samples;
+        window -= adcs[i + 1 - n_smoothing_samples];
+      }
+    }
+  }
+
+  _sums.n = n_adc;
+  _sums.sum = sum;
+  _sums.sum2 = sum2;
+
+  // find the mode and clear out the histogram for the next waveform
+  if (fill_mode) _mode = _mode_finder.Get();
+}
+
+WaveformSums FusedChannelKernel::RangeSums(ADCView waveform, const std::vector<std::array<unsigned, 2>> &ranges) const {
+  size_t n_adc = waveform.size();
+  const int16_t *adcs = waveform.data();
+
+  size_t n_in_ranges = 0;
+  for (auto &range: ranges) {
+    if (range[0] >= n_adc) break;
+    n_in_ranges += std::min((size_t)range[1] + 1, n_adc) - range[0];
+  }
+
+  WaveformSums ret;
+  // sum over the ranges directly
+  if (n_in_ranges <= n_adc / 2) {
+    for (auto &range: ranges) {
+      if (range[0] >= n_adc) break;
+      size_t n = std::min((size_t)range[1] + 1, n_adc) - range[0];
+      ret.n += n;
+      ret.sum += simd::Sum(adcs + range[0], n);
+      ret.sum2 += simd::SumSquares(adcs + range[0], n, 0);
+    }
+  }
+  // or subtract off the sum over everything outside of the ranges
+  else {
+    ret = _sums;
+    size_t start = 0;
+    auto subtract = [&](size_t lo, size_t hi) {
+      if (hi <= lo) return;
+      ret.n -= hi - lo;
+      ret.sum -= simd::Sum(adcs + lo, hi - lo);
+      ret.sum2 -= simd::SumSquares(adcs + lo, hi - lo, 0);
+    };
+    for (auto &range: ranges) {
+      if (range[0] >= n_adc) break;
+      subtract(start, range[0]);
+      start = (size_t)range[1] + 1;
+    }
+    subtract(start, n_adc);
+  }
+  return ret;
+}
@@ -0,0 +1,62 @@
+#ifndef _sbnddaq_analysis_ChannelKernel
+#define _sbnddaq_analysis_ChannelKernel
+#include <vector>
+#include <array>
+#include <cstdint>
+
+#include "Span.hh"
+#include "sbndqm/Decode/Mode/Mode.hh"
+
+// Computes the per-channel quantities used by the analysis in as few
+// passes over the waveform as possible.
+//
+// A single streaming pass fills a histogram of ADC values (for the mode),
+// the moments of the waveform (for the raw RMS) and the smoothed waveform
+// used for peak finding. The RMS over the noise ranges is then found from
+// the moments, only re-reading the part of the waveform that is cheaper to
+// sum over (the noise ranges or the peaks around them).
+namespace tpcAnalysis {
+
+// running sums over (a part of) a waveform
+class WaveformSums {
+public:
+  unsigned n;
+  int64_t sum;
+  int64_t sum2;
+
+  WaveformSums(): n(0), sum(0), sum2(0) {}
+
+  // rms about the baseline. Same as NoiseSample::RMS
+  float RMS(int16_t baseline) const;
+  // mean, rounded towards zero. Same as NoiseSample::ResetBaseline
+  int16_t Mean() const { return (int16_t)(sum / (int64_t)n); }
+};
+
+class FusedChannelKernel {
+public:
+  FusedChannelKernel(): _mode(0) {}
+
+  // Make a pass over the waveform. Fills the moments of the waveform,
+  // the mode (if fill_mode) using every n_mode_skip-th value and the
+  // smoothed waveform (if n_smoothing_samples > 1)
+  void Fill(ADCView waveform, bool fill_mode, unsigned n_mode_skip, unsigned n_smoothing_samples);
+
+  // most common ADC value
+  int16_t Mode() const { return _mode; }
+  // sums over the whole waveform
+  const WaveformSums &Sums() const { return _sums; }
+  // smoothed waveform, as calculated by PeakFinder::Smooth
+  const std::vector<int16_t> &Smoothed() const { return _smoothed; }
+
+  // sums over a set of sorted, non-overlapping ranges of the waveform passed to Fill()
+  WaveformSums RangeSums(ADCView waveform, const std::vector<std::array<unsigned, 2>> &ranges) const;
+
+private:
+  ModeFinder _mode_finder;
+  int16_t _mode;
+  WaveformSums _sums;
+  std::vector<int16_t> _smoothed;
+};
+
+} // namespace tpcAnalysis
+#endif
@@ -0,0 +1,147 @@
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <math.h>
+
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+
+#include "CoherentNoise.hh"
+#include "SIMD.hh"
+
+using namespace tpcAnalysis;
+
+void CoherentNoiseEngine::SetGroups(const std::vector<std::array<unsigned, 2>> &groups) {
+  _groups.clear();
+  for (auto &group: groups) {
+    _groups.emplace_back(group[0], group[1]);
+  }
+  std::sort(_groups.begin(), _groups.end(), [](const Group &a, const Group &b) { return a.lo < b.lo; });
+}
+
+void CoherentNoiseEngine::AddBlocks(unsigned lo, unsigned hi) {
+  for (unsigned start = lo; start < hi; start += kBlockChannels) {
+    _blocks.push_back({start, std::min(start + kBlockChannels, hi), -1});
+  }
+}
+
+void CoherentNoiseEngine::Compute(const std::vector<ADCView> &waveforms, std::vector<NoiseSample> &noise,
+                                  std::vector<ChannelData> &channel_data, unsigned max_sample) {
+  unsigned n_channels = channel_data.size();
+
+  // Split up the channels into blocks. Each group is its own block, and
+  // the DNoise of each channel is done in exactly one block.
+  _blocks.clear();
+  unsigned next = 0;
+  for (unsigned i = 0; i < _groups.size(); i++) {
+    Group &group = _groups[i];
+    unsigned lo = std::min(group.lo, n_channels);
+    unsigned hi = std::min(group.hi, n_channels);
+    AddBlocks(next, lo);
+    _blocks.push_back({std::max(next, lo), std::max(next, hi), (int)i});
+    next = std::max(next, hi);
+  }
+  AddBlocks(next, n_channels);
+
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, _blocks.size(), 1),
+    [&](const tbb::blocked_range<size_t> &range) {
+      for (size_t i = range.begin(); i != range.end(); i++) {
+        DoBlock(_blocks[i], waveforms, noise, channel_data, max_sample);
+      }
+    });
+
+  // don't set last dnoise
+  if (n_channels > 0) channel_data[n_channels - 1].next_channel_dnoise = 0;
+}
+
+void CoherentNoiseEngine::DoBlock(const Block &block, const std::vector<ADCView> &waveforms, std::vector<NoiseSample> &noise,
+                                  std::vector<ChannelData> &channel_data, unsigned max_sample) {
+  if (block.group >= 0) {
+    DoGroup(_groups[block.group], block, waveforms, noise, channel_data, max_sample);
+    return;
+  }
+  for (unsigned channel = block.lo; channel < block.hi; channel++) {
+    DNoise(channel, waveforms, noise, channel_data, max_sample);
+  }
+}
+
+void CoherentNoiseEngine::DoGroup(Group &group, const Block &block, const std::vector<ADCView> &waveforms, std::vector<NoiseSample> &noise,
+                                  std::vector<ChannelData> &channel_data, unsigned max_sample) {
+  Workspace &workspace = _workspaces.local();
+  unsigned hi = std::min<unsigned>(group.hi, channel_data.size());
+
+  // find the ticks in the noise ranges of every channel, and the length of the sum
+  group.n_channels = 0;
+  size_t n_ticks = 0;
+  for (unsigned channel = group.lo; channel < hi; channel++) {
+    if (channel_data[channel].empty || waveforms[channel].empty()) continue;
+    if (group.n_channels == 0) {
+      *workspace.joint.Ranges() = *noise[channel].Ranges();
+      n_ticks = waveforms[channel].size();
+    }
+    else {
+      noise[channel].Intersection(workspace.joint, workspace.scratch);
+      std::swap(*workspace.joint.Ranges(), *workspace.scratch.Ranges());
+      n_ticks = std::min(n_ticks, waveforms[channel].size());
+    }
+    group.n_channels ++;
+  }
+
+  // Sum the group, one row at a time. The DNoise of each channel is done
+  // along the way, while the row is still in cache.
+  group.waveform.assign(n_ticks, 0);
+  workspace.rms.clear();
+  group.n_samples = 0;
+  for (unsigned channel = group.lo; channel < hi; channel++) {
+    if (!channel_data[channel].empty && !waveforms[channel].empty()) {
+      const int16_t *row = waveforms[channel].data();
+      int16_t baseline = noise[channel].Baseline();
+      simd::AddWaveform(row, n_ticks, baseline, group.waveform.data());
+
+      int64_t sum2 = 0;
+      group.n_samples = ForEachSpan(*workspace.joint.Ranges(), n_ticks, max_sample, [&](unsigned start, unsigned n) {
+        sum2 += simd::SumSquares(row + start, n, baseline);
+      });
+      workspace.rms.push_back(sqrt((double)sum2 / group.n_samples));
+    }
+    if (channel >= block.lo && channel < block.hi) {
+      DNoise(channel, waveforms, noise, channel_data, max_sample);
+    }
+  }
+
+  // need at least two channels with some noise in common
+  if (group.n_channels < 2 || group.n_samples == 0) {
+    group.sum_rms = 0;
+    group.scaled_sum_rms = 0;
+    return;
+  }
+
+  int64_t sum2 = 0;
+  ForEachSpan(*workspace.joint.Ranges(), n_ticks, max_sample, [&](unsigned start, unsigned n) {
+    sum2 += simd::SumSquares32(group.waveform.data() + start, n);
+  });
+  group.sum_rms = sqrt((double)sum2 / group.n_samples);
+  group.scaled_sum_rms = ScaleSumRMS(group.sum_rms, workspace.rms.data(), workspace.rms.size());
+}
+
+void CoherentNoiseEngine::DNoise(unsigned channel, const std::vector<ADCView> &waveforms, std::vector<NoiseSample> &noise,
+                                 std::vector<ChannelData> &channel_data, unsigned max_sample) {
+  unsigned next_channel = channel + 1;
+  if (next_channel >= channel_data.size()) return;
+  ChannelData &data = channel_data[channel];
+  ChannelData &next_data = channel_data[next_channel];
+  if (data.empty || next_data.empty) return;
+
+  float unscaled_dnoise = noise[channel].DNoise(waveforms[channel], noise[next_channel], waveforms[next_channel], max_sample);
+  // Don't use same noise sample to scale dnoise
+  // This should probably be ok, as long as the dnoise sample is large enough
+
+  // but special case when rms is too small
+  if (data.rms > 1e-4 && next_data.rms > 1e-4) {
+    float dnoise_scale = sqrt(data.rms * data.rms + next_data.rms * next_data.rms);
+    data.next_channel_dnoise = unscaled_dnoise / dnoise_scale;
+  }
+  else {
+    data.next_channel_dnoise = 1.;
+  }
+}
@@ -0,0 +1,100 @@
+#ifndef _sbnddaq_analysis_CoherentNoise
+#define _sbnddaq_analysis_CoherentNoise
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <climits>
+
+#include "tbb/enumerable_thread_specific.h"
+
+#include "ChannelData.hh"
+#include "Noise.hh"
+#include "Span.hh"
+
+/*
+  * Computes the noise correlated between neighbouring channels.
+  *
+  * For each channel, this is the "DNoise" with the next channel. For each
+  * group of channels read out together (e.g. an ASIC, FEMB or board), it is
+  * the summed (baseline subtracted) waveform of the group and the RMS of
+  * that sum over the ticks in the noise ranges of all of its channels.
+  *
+  * The waveforms are treated as the rows of a channel-major matrix. Each
+  * group is done in a single pass over its rows, with the DNoise of each
+  * channel calculated while its row (and the next one) are in cache. Groups
+  * (and the channels outside of any group) are spread over the available
+  * threads.
+*/
+
+namespace tpcAnalysis {
+class CoherentNoiseEngine {
+public:
+  // Number of channels outside of any group handled at a time
+  static const unsigned kBlockChannels = 64;
+
+  // Coherent noise of a group of channels
+  class Group {
+  public:
+    // channels in the group, [lo, hi)
+    unsigned lo;
+    unsigned hi;
+    // number of (non-empty) channels summed
+    unsigned n_channels;
+    // number of ticks in the noise ranges of all of the channels
+    unsigned n_samples;
+    // RMS of the summed waveform over those ticks
+    float sum_rms;
+    // sum_rms scaled to be 0 for uncorrelated and 1 for fully correlated
+    // noise (see ScaleSumRMS)
+    float scaled_sum_rms;
+    // sum of the baseline subtracted waveforms
+    std::vector<int> waveform;
+
+    Group(unsigned lo=0, unsigned hi=0): lo(lo), hi(hi), n_channels(0), n_samples(0), sum_rms(0), scaled_sum_rms(0) {}
+  };
+
+  // Groups of channels, as a list of [lo, hi) ranges. Groups should not overlap.
+  void SetGroups(const std::vector<std::array<unsigned, 2>> &groups);
+
+  // Compute the DNoise of each channel (stored in next_channel_dnoise) and
+  // the coherent noise of each group. waveforms, noise and channel_data are
+  // indexed by channel. At most max_sample ticks of the noise ranges are used.
+  //
+  // Runs in parallel in the calling task arena.
+  void Compute(const std::vector<ADCView> &waveforms, std::vector<NoiseSample> &noise,
+               std::vector<ChannelData> &channel_data, unsigned max_sample=UINT_MAX);
+
+  const std::vector<Group> &Groups() const { return _groups; }
+
+private:
+  // channels handled by one task: [lo, hi), and the group they are summed into (if any)
+  class Block {
+  public:
+    unsigned lo;
+    unsigned hi;
+    int group;
+  };
+
+  // scratch space for each thread
+  class Workspace {
+  public:
+    NoiseSample joint;
+    NoiseSample scratch;
+    std::vector<float> rms;
+  };
+
+  void AddBlocks(unsigned lo, unsigned hi);
+  void DoBlock(const Block &block, const std::vector<ADCView> &waveforms, std::vector<NoiseSample> &noise,
+               std::vector<ChannelData> &channel_data, unsigned max_sample);
+  void DoGroup(Group &group, const Block &block, const std::vector<ADCView> &waveforms, std::vector<NoiseSample> &noise,
+               std::vector<ChannelData> &channel_data, unsigned max_sample);
+  static void DNoise(unsigned channel, const std::vector<ADCView> &waveforms, std::vector<NoiseSample> &noise,
+                     std::vector<ChannelData> &channel_data, unsigned max_sample);
+
+  std::vector<Group> _groups;
+  std::vector<Block> _blocks;
+  tbb::enumerable_thread_specific<Workspace> _workspaces;
+};
+
+} // namespace tpcAnalysis
+#endif
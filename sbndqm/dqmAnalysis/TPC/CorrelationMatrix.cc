@@ -0,0 +1,137 @@
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <math.h>
+
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+
+#include "CorrelationMatrix.hh"
+#include "SIMD.hh"
+
+using namespace tpcAnalysis;
+
+void CorrelationEngine::SetChannels(const std::vector<std::array<unsigned, 2>> &channel_ranges) {
+  _channel_ranges = channel_ranges;
+}
+
+std::vector<float> CorrelationEngine::Compute(const std::vector<ADCView> &waveforms,
+                                              std::vector<NoiseSample> &noise, unsigned max_sample) {
+  // figure out which channels are in the matrix
+  _channels.clear();
+  if (_channel_ranges.empty()) {
+    for (unsigned channel = 0; channel < waveforms.size(); channel++) _channels.push_back(channel);
+  }
+  else {
+    for (auto &range: _channel_ranges) {
+      for (unsigned channel = range[0]; channel < range[1] && channel < waveforms.size(); channel++) {
+        _channels.push_back(channel);
+      }
+    }
+  }
+  unsigned n_channels = _channels.size();
+
+  // size the input matrices to the last tick used by any channel
+  _n_ticks = 0;
+  for (unsigned channel: _channels) {
+    ForEachSpan(*noise[channel].Ranges(), waveforms[channel].size(), max_sample, [&](unsigned start, unsigned n) {
+      _n_ticks = std::max(_n_ticks, (size_t)start + n);
+    });
+  }
+  // pad rows out to a whole number of cache lines
+  _stride = ((_n_ticks + 15) / 16) * 16;
+
+  _x.assign(n_channels * _stride, 0);
+  _mask.assign(n_channels * _stride, 0);
+  _norm2.assign(n_channels, 0);
+  _has_data.assign(n_channels, 0);
+
+  tbb::parallel_for(tbb::blocked_range<unsigned>(0, n_channels),
+    [&](const tbb::blocked_range<unsigned> &range) {
+      for (unsigned row = range.begin(); row != range.end(); row++) {
+        unsigned channel = _channels[row];
+        FillRow(row, waveforms[channel], noise[channel], max_sample);
+      }
+    });
+
+  // compute each block in the upper triangle of the matrix
+  std::vector<float> ret(n_channels * n_channels, 0.);
+  unsigned n_blocks = (n_channels + kBlockChannels - 1) / kBlockChannels;
+  std::vector<std::array<unsigned, 2>> blocks;
+  for (unsigned i = 0; i < n_blocks; i++) {
+    for (unsigned j = i; j < n_blocks; j++) {
+      blocks.push_back({i, j});
+    }
+  }
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, blocks.size(), 1),
+    [&](const tbb::blocked_range<size_t> &range) {
+      for (size_t i = range.begin(); i != range.end(); i++) {
+        ComputeBlock(blocks[i][0], blocks[i][1], ret);
+      }
+    });
+
+  return ret;
+}
+
+void CorrelationEngine::FillRow(unsigned row, ADCView waveform, NoiseSample &noise, unsigned max_sample) {
+  if (waveform.empty()) return;
+  _has_data[row] = 1;
+
+  int16_t *x = &_x[row * _stride];
+  int16_t *mask = &_mask[row * _stride];
+  int16_t baseline = noise.Baseline();
+  ForEachSpan(*noise.Ranges(), waveform.size(), max_sample, [&](unsigned start, unsigned n) {
+    for (size_t i = start; i < start + n; i++) {
+      x[i] = waveform[i] - baseline;
+      mask[i] = -1;
+    }
+  });
+
+  // without the intersection, each row is normalized by its own sum of squares
+  if (!_intersect_noise) {
+    _norm2[row] = simd::SumSquares(x, _n_ticks, 0);
+  }
+}
+
+void CorrelationEngine::ComputeBlock(unsigned block_i, unsigned block_j, std::vector<float> &output) {
+  unsigned n_channels = _channels.size();
+  unsigned lo_i = block_i * kBlockChannels;
+  unsigned hi_i = std::min(lo_i + kBlockChannels, n_channels);
+  unsigned lo_j = block_j * kBlockChannels;
+  unsigned hi_j = std::min(lo_j + kBlockChannels, n_channels);
+
+  // per pair: sum of x_i * x_j, sum of x_i^2 over the noise ranges of j, and vice versa
+  int64_t sums[kBlockChannels][kBlockChannels][3] = {};
+
+  for (size_t tick = 0; tick < _n_ticks; tick += kBlockTicks) {
+    size_t n = std::min((size_t)kBlockTicks, _n_ticks - tick);
+    for (unsigned i = lo_i; i < hi_i; i++) {
+      if (!_has_data[i]) continue;
+      const int16_t *x_i = &_x[i * _stride + tick];
+      const int16_t *mask_i = &_mask[i * _stride + tick];
+      for (unsigned j = std::max(lo_j, i + 1); j < hi_j; j++) {
+        if (!_has_data[j]) continue;
+        const int16_t *x_j = &_x[j * _stride + tick];
+        int64_t *pair_sums = sums[i - lo_i][j - lo_j];
+        if (_intersect_noise) {
+          simd::CorrelationSums(x_i, mask_i, x_j, &_mask[j * _stride + tick], n, pair_sums);
+        }
+        else {
+          pair_sums[0] += simd::SumProducts(x_i, 0, x_j, 0, n);
+        }
+      }
+    }
+  }
+
+  // blocks don't overlap, so no locking is needed to write out
+  for (unsigned i = lo_i; i < hi_i; i++) {
+    if (block_i == block_j) output[i * n_channels + i] = 1.;
+    for (unsigned j = std::max(lo_j, i + 1); j < hi_j; j++) {
+      int64_t *pair_sums = sums[i - lo_i][j - lo_j];
+      double scaling = (_intersect_noise) ? sqrt((double)pair_sums[1] * pair_sums[2]) : sqrt((double)_norm2[i] * _norm2[j]);
+      float corr = (scaling > 0.) ? pair_sums[0] / scaling : 0.;
+      output[i * n_channels + j] = corr;
+      output[j * n_channels + i] = corr;
+    }
+  }
+}
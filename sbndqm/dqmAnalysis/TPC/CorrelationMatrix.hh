@@ -0,0 +1,77 @@
+#ifndef _sbnddaq_analysis_CorrelationMatrix
+#define _sbnddaq_analysis_CorrelationMatrix
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <climits>
+
+#include "Noise.hh"
+#include "Span.hh"
+
+/*
+  * Computes the noise correlation matrix between a set of channels.
+  *
+  * Each channel is baseline subtracted and restricted to its noise ranges
+  * once into a row of a matrix X. The correlation matrix is then built as
+  * the Gram product X * X^T, computed in cache sized blocks of channel pairs
+  * spread over the available threads.
+*/
+
+namespace tpcAnalysis {
+class CorrelationEngine {
+public:
+  // Number of channels in each block of the matrix
+  static const unsigned kBlockChannels = 32;
+  // Number of ticks processed at a time in each block
+  static const unsigned kBlockTicks = 512;
+
+  CorrelationEngine(): _intersect_noise(true) {}
+
+  // Only compute the matrix for channels in the provided [lo, hi) ranges.
+  // By default all channels are used.
+  void SetChannels(const std::vector<std::array<unsigned, 2>> &channel_ranges);
+  // If set, the correlation between each pair of channels only uses ticks
+  // inside the noise ranges of both channels. This matches
+  // NoiseSample::Correlation. Otherwise, each channel is normalized once
+  // over its own noise ranges, which is cheaper.
+  void SetIntersectNoise(bool intersect_noise) { _intersect_noise = intersect_noise; }
+
+  // Compute the correlation matrix. waveforms and noise are indexed by channel,
+  // and an empty waveform marks a channel with no data. At most max_sample
+  // samples of the noise ranges of each channel are used (as in NoiseSample).
+  // With SetIntersectNoise, each pair then uses the intersection of the
+  // samples of its two channels.
+  //
+  // Returns the row-major n x n matrix, where n is the number of selected channels.
+  // Runs in parallel in the calling task arena.
+  std::vector<float> Compute(const std::vector<ADCView> &waveforms,
+                             std::vector<NoiseSample> &noise, unsigned max_sample=UINT_MAX);
+
+  // channels in the matrix, in order
+  const std::vector<unsigned> &Channels() const { return _channels; }
+
+private:
+  // fill the rows of the input matrices for each selected channel
+  void FillRow(unsigned row, ADCView waveform, NoiseSample &noise, unsigned max_sample);
+  // compute the block of the matrix between channel blocks i and j
+  void ComputeBlock(unsigned block_i, unsigned block_j, std::vector<float> &output);
+
+  std::vector<std::array<unsigned, 2>> _channel_ranges;
+  std::vector<unsigned> _channels;
+  bool _intersect_noise;
+
+  size_t _n_ticks;
+  // row stride of the matrices below
+  size_t _stride;
+  // baseline subtracted waveforms, zero outside of the noise ranges
+  std::vector<int16_t> _x;
+  // -1 (all bits set) inside the noise ranges, 0 outside
+  std::vector<int16_t> _mask;
+  // sum of squares of each row of _x (used when not intersecting noise ranges)
+  std::vector<int64_t> _norm2;
+  // whether each row has any data
+  std::vector<char> _has_data;
+};
+
+} // namespace tpcAnalysis
+#endif
@@ -0,0 +1,35 @@
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#include "EventWaveformMatrix.hh"
+
+using namespace tpcAnalysis;
+
+EventWaveformMatrix::~EventWaveformMatrix() {
+  if (_data) ::operator delete[](_data, std::align_val_t(kAlignment));
+}
+
+void EventWaveformMatrix::Reset(unsigned n_channels, size_t n_ticks) {
+  // pad rows out to a whole number of cache lines
+  const size_t row_align = kAlignment / sizeof(int16_t);
+  _n_ticks = n_ticks;
+  _stride = ((n_ticks + row_align - 1) / row_align) * row_align;
+  _sizes.assign(n_channels, 0);
+
+  size_t size = _stride * n_channels;
+  if (size > _capacity) {
+    if (_data) ::operator delete[](_data, std::align_val_t(kAlignment));
+    _data = static_cast<int16_t *>(::operator new[](size * sizeof(int16_t), std::align_val_t(kAlignment)));
+    _capacity = size;
+  }
+}
+
+void EventWaveformMatrix::Fill(unsigned channel, ADCView waveform) {
+  size_t n = std::min(waveform.size(), _n_ticks);
+  int16_t *row = _data + channel * _stride;
+  if (n) memcpy(row, waveform.data(), n * sizeof(int16_t));
+  memset(row + n, 0, (_stride - n) * sizeof(int16_t));
+  _sizes[channel] = n;
+}
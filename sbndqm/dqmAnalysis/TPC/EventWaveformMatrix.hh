@@ -0,0 +1,66 @@
+#ifndef _sbnddaq_analysis_EventWaveformMatrix
+#define _sbnddaq_analysis_EventWaveformMatrix
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "Span.hh"
+
+/*
+  * The ADC values of every channel in an event, packed into one buffer.
+  *
+  * Each channel is a row of a channel-major int16 matrix. Rows start on a
+  * cache line and are zero padded out to a whole number of cache lines,
+  * so that the kernels working across channels (FFT's, correlations,
+  * DNoise, sums) walk through memory linearly. Row views can be passed to
+  * the code working on single waveforms (NoiseSample, PeakFinder, ...).
+  *
+  * The buffer is only re-allocated when an event needs more space than
+  * any before it.
+*/
+
+namespace tpcAnalysis {
+class EventWaveformMatrix {
+public:
+  // alignment of each row in bytes
+  static const size_t kAlignment = 64;
+
+  EventWaveformMatrix(): _data(NULL), _capacity(0), _n_ticks(0), _stride(0) {}
+  ~EventWaveformMatrix();
+
+  EventWaveformMatrix(EventWaveformMatrix const &) = delete;
+  EventWaveformMatrix & operator = (EventWaveformMatrix const &) = delete;
+
+  // Set up the matrix for n_channels rows of at most n_ticks ticks. All of
+  // the rows start out empty.
+  void Reset(unsigned n_channels, size_t n_ticks);
+
+  // Copy a waveform (truncated to NTicks()) into the row of a channel.
+  // Different rows can be filled in parallel.
+  void Fill(unsigned channel, ADCView waveform);
+
+  // view of the ADC values of a channel (empty if the row wasn't filled)
+  ADCView Row(unsigned channel) const { return ADCView(_data + channel * _stride, _sizes[channel]); }
+  // start of the row of a channel. The row is Stride() long, zero padded past its size.
+  const int16_t *RowData(unsigned channel) const { return _data + channel * _stride; }
+  size_t Size(unsigned channel) const { return _sizes[channel]; }
+  bool Empty(unsigned channel) const { return _sizes[channel] == 0; }
+
+  unsigned NChannels() const { return _sizes.size(); }
+  size_t NTicks() const { return _n_ticks; }
+  // distance between the start of each row (in ADC values)
+  size_t Stride() const { return _stride; }
+  // the whole matrix
+  const int16_t *Data() const { return _data; }
+
+private:
+  int16_t *_data;
+  size_t _capacity;
+  size_t _n_ticks;
+  size_t _stride;
+  // number of ADC values in each row
+  std::vector<size_t> _sizes;
+};
+
+} // namespace tpcAnalysis
+#endif
@@ -1,12 +1,73 @@
 #include <vector>
 #include <cassert>
 #include <iostream>
+#include <mutex>
+#include <cmath>
+#include <algorithm>
 
 #include "fftw3.h"
 
 #include "FFT.hh"
+#include "SIMD.hh"
+
+FFTPlanCache &FFTPlanCache::Instance() {
+  static FFTPlanCache cache;
+  return cache;
+}
+
+void FFTPlanCache::SetWisdomFile(const std::string &path) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (path == _wisdom_file) return;
+  _wisdom_file = path;
+  // it's fine if the file isn't there yet -- it will be written once a plan is made
+  if (!fftw_import_wisdom_from_filename(_wisdom_file.c_str())) {
+    std::cerr << "Warning: could not import FFTW wisdom from (" << _wisdom_file << ")" << std::endl;
+  }
+}
+
+fftw_plan FFTPlanCache::Get(unsigned input_size, FFTPlanCache::Direction direction, unsigned howmany) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto key = std::make_tuple(input_size, direction, howmany);
+  auto plan = _plans.find(key);
+  if (plan != _plans.end()) return plan->second;
+
+  // Plan on scratch arrays, since measuring overwrites them. FFTW aligns
+  // the allocation, so the plan is valid for any buffer from fftw_alloc_*.
+  int n = input_size;
+  int output_size = input_size/2 + 1;
+  double *real = fftw_alloc_real((size_t)n * howmany);
+  fftw_complex *complex = fftw_alloc_complex((size_t)output_size * howmany);
+  fftw_plan ret;
+  if (howmany == 1) {
+    ret = (direction == kR2C) ?
+      fftw_plan_dft_r2c_1d(n, real, complex, FFTW_MEASURE) :
+      fftw_plan_dft_c2r_1d(n, complex, real, FFTW_MEASURE);
+  }
+  else {
+    ret = (direction == kR2C) ?
+      fftw_plan_many_dft_r2c(1, &n, howmany, real, NULL, 1, n, complex, NULL, 1, output_size, FFTW_MEASURE) :
+      fftw_plan_many_dft_c2r(1, &n, howmany, complex, NULL, 1, output_size, real, NULL, 1, n, FFTW_MEASURE);
+  }
+  fftw_free(real);
+  fftw_free(complex);
+
+  _plans[key] = ret;
+
+  if (_wisdom_file.size() && !fftw_export_wisdom_to_filename(_wisdom_file.c_str())) {
+    std::cerr << "Warning: could not export FFTW wisdom to (" << _wisdom_file << ")" << std::endl;
+  }
+  return ret;
+}
+
+FFTPlanCache::~FFTPlanCache() {
+  for (auto &plan: _plans) {
+    fftw_destroy_plan(plan.second);
+  }
+}
 
 FFTManager::FFTManager(unsigned input_size) {
+  _input_size = 0;
+  _output_size = 0;
   _is_allocated = false;
   if (input_size != 0) { 
     Set(input_size);
@@ -14,6 +75,7 @@ FFTManager::FFTManager(unsigned input_size) {
 }
 
 void FFTManager::Set(unsigned input_size) {
+  if (_is_allocated && input_size == _input_size) return;
   _input_size = input_size;
   // output size of a 1d real FFT
   _output_size = input_size/2 + 1;
@@ -24,11 +86,9 @@ void FFTManager::Alloc() {
   if (_is_allocated) {
     DeAlloc();
   }
-  //unsigned flags = FFTW_ESTIMATE;
-  unsigned flags = FFTW_MEASURE;
   _input_array = fftw_alloc_real(_input_size);
   _output_array = fftw_alloc_complex(_output_size);
-  _plan = fftw_plan_dft_r2c_1d(_input_size, _input_array, _output_array, flags);
+  _plan = FFTPlanCache::Instance().Get(_input_size, FFTPlanCache::kR2C);
   _is_allocated = true;
 }
 
@@ -36,13 +96,13 @@ void FFTManager::DeAlloc() {
   if (_is_allocated) {
     fftw_free(_input_array);
     fftw_free(_output_array);
-    fftw_destroy_plan(_plan);
   }
   _is_allocated = false;
 }
 
 void FFTManager::Execute() {
-  fftw_execute(_plan);
+  // new-array execute: safe to share the plan across threads
+  fftw_execute_dft_r2c(_plan, _input_array, _output_array);
 }
 
 // get pointer to ith input
@@ -78,5 +138,167 @@ FFTManager::~FFTManager() {
   DeAlloc();
 }
 
+BatchFFT::BatchFFT(unsigned input_size, unsigned batch_size): BatchFFT() {
+  Set(input_size, batch_size);
+}
+
+void BatchFFT::Set(unsigned input_size, unsigned batch_size) {
+  if (_is_allocated && input_size == _input_size && batch_size == _batch_size) return;
+  DeAlloc();
+  _input_size = input_size;
+  _output_size = input_size/2 + 1;
+  _batch_size = batch_size;
+  _n_rows = 0;
+  _input_array = fftw_alloc_real((size_t)_input_size * _batch_size);
+  _output_array = fftw_alloc_complex((size_t)_output_size * _batch_size);
+  _plan = FFTPlanCache::Instance().Get(_input_size, FFTPlanCache::kR2C, _batch_size);
+  // rows not filled by a partial batch are still transformed, keep them sane
+  std::fill_n(_input_array, (size_t)_input_size * _batch_size, 0.);
+  _is_allocated = true;
+}
+
+void BatchFFT::DeAlloc() {
+  if (_is_allocated) {
+    fftw_free(_input_array);
+    fftw_free(_output_array);
+  }
+  _is_allocated = false;
+}
+
+void BatchFFT::Execute(const int16_t *const *rows, unsigned n_rows, const int16_t *baselines) {
+  assert(_is_allocated);
+  assert(n_rows <= _batch_size);
+  for (unsigned i = 0; i < n_rows; i++) {
+    ToInput(rows[i], baselines ? baselines[i] : 0, i);
+  }
+  // any left over rows hold stale input -- their output is just ignored
+  fftw_execute_dft_r2c(_plan, _input_array, _output_array);
+  _n_rows = n_rows;
+}
+
+void BatchFFT::Execute(const int16_t *block, size_t stride, unsigned n_rows, const int16_t *baselines) {
+  assert(_is_allocated);
+  assert(n_rows <= _batch_size);
+  for (unsigned i = 0; i < n_rows; i++) {
+    ToInput(block + i * stride, baselines ? baselines[i] : 0, i);
+  }
+  fftw_execute_dft_r2c(_plan, _input_array, _output_array);
+  _n_rows = n_rows;
+}
+
+void BatchFFT::ToInput(const int16_t *row, int16_t baseline, unsigned i_row) {
+  double *input = _input_array + (size_t)i_row * _input_size;
+  if (_window.empty()) {
+    tpcAnalysis::simd::ToDouble(row, _input_size, baseline, input);
+  }
+  else {
+    assert(_window.size() == _input_size);
+    tpcAnalysis::simd::ToDoubleWindowed(row, _input_size, baseline, _window.data(), input);
+  }
+}
+
+void BatchFFT::Magnitude(unsigned row, float *output) const {
+  const fftw_complex *out = Output(row);
+  for (unsigned j = 0; j < _output_size; j++) {
+    output[j] = std::sqrt(out[j][0] * out[j][0] + out[j][1] * out[j][1]);
+  }
+}
+
+void BatchFFT::Magnitudes(float *output, size_t output_stride) const {
+  for (unsigned i = 0; i < _n_rows; i++) {
+    Magnitude(i, output + i * output_stride);
+  }
+}
+
+void BatchFFT::Magnitudes(const int16_t *block, size_t stride, unsigned n_rows, 
+                          float *output, size_t output_stride, const int16_t *baselines) {
+  for (unsigned first = 0; first < n_rows; first += _batch_size) {
+    unsigned n_batch = std::min(_batch_size, n_rows - first);
+    Execute(block + first * stride, stride, n_batch, baselines ? baselines + first : nullptr);
+    Magnitudes(output + first * output_stride, output_stride);
+  }
+}
+
+BatchFFT::~BatchFFT() {
+  DeAlloc();
+}
+
+bool PowerSpectrum::ParseWindow(const std::string &name, Window &window) {
+  if (name == "none" || name == "rectangular") window = kRectangular;
+  else if (name == "hann") window = kHann;
+  else if (name == "hamming") window = kHamming;
+  else if (name == "blackman") window = kBlackman;
+  else return false;
+  return true;
+}
 
+void PowerSpectrum::Configure(unsigned n_channels, unsigned segment_size, Window window) {
+  assert(segment_size > 0 && segment_size % 2 == 0);
+  _n_channels = n_channels;
+  _segment_size = segment_size;
+  _power.assign((size_t)n_channels * OutputSize(), 0.);
+  _n_segments.assign(n_channels, 0);
+  _rows.clear();
+  _baselines.clear();
+  _row_channels.clear();
 
+  _fft.Set(segment_size);
+  // periodic windows, as is usual for spectral estimation
+  std::vector<double> coefficients;
+  if (window != kRectangular) {
+    coefficients.resize(segment_size);
+    for (unsigned i = 0; i < segment_size; i++) {
+      double phase = 2. * M_PI * i / segment_size;
+      if (window == kHann) coefficients[i] = 0.5 - 0.5 * cos(phase);
+      else if (window == kHamming) coefficients[i] = 0.54 - 0.46 * cos(phase);
+      else coefficients[i] = 0.42 - 0.5 * cos(phase) + 0.08 * cos(2. * phase);
+    }
+  }
+  _window_power = 1.;
+  if (coefficients.size()) {
+    _window_power = 0.;
+    for (double c: coefficients) _window_power += c * c;
+    _window_power /= segment_size;
+  }
+  _fft.SetWindow(coefficients);
+}
+
+void PowerSpectrum::Add(unsigned channel, const int16_t *waveform, size_t n, int16_t baseline) {
+  assert(channel < _n_channels);
+  // segments overlapping by half
+  for (size_t start = 0; start + _segment_size <= n; start += _segment_size / 2) {
+    _rows.push_back(waveform + start);
+    _baselines.push_back(baseline);
+    _row_channels.push_back(channel);
+    if (_rows.size() == _fft.BatchSize()) Flush();
+  }
+}
+
+void PowerSpectrum::Flush() {
+  if (_rows.empty()) return;
+  unsigned output_size = OutputSize();
+  _fft.Execute(_rows.data(), _rows.size(), _baselines.data());
+  for (unsigned i = 0; i < _rows.size(); i++) {
+    unsigned channel = _row_channels[i];
+    tpcAnalysis::simd::AddPower((const double *)_fft.Output(i), output_size, &_power[(size_t)channel * output_size]);
+    _n_segments[channel] ++;
+  }
+  _rows.clear();
+  _baselines.clear();
+  _row_channels.clear();
+}
+
+void PowerSpectrum::Spectrum(unsigned channel, float *output) const {
+  unsigned output_size = OutputSize();
+  const double *power = &_power[(size_t)channel * output_size];
+  double scale = _n_segments[channel] ? 1. / (_n_segments[channel] * _window_power) : 0.;
+  for (unsigned i = 0; i < output_size; i++) {
+    output[i] = sqrt(power[i] * scale);
+  }
+}
+
+void PowerSpectrum::Reset(unsigned channel) {
+  unsigned output_size = OutputSize();
+  std::fill_n(&_power[(size_t)channel * output_size], output_size, 0.);
+  _n_segments[channel] = 0;
+}
@@ -1,9 +1,55 @@
 #ifndef _sbnddaq_analysis_FFT
 #define _sbnddaq_analysis_FFT
 #include <vector>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <cstdint>
+#include <cstddef>
 
 #include "fftw3.h"
 
+// Process-wide cache of FFTW plans, keyed by input size, direction and
+// number of transforms per execution.
+//
+// Plans are made once (with FFTW_MEASURE) and then shared by every FFTManager.
+// Managers run them with the new-array execute functions on their own buffers,
+// which FFTW guarantees to be thread safe. Making plans is not thread safe, so
+// all planning goes through this class.
+class FFTPlanCache {
+public:
+  enum Direction { kR2C, kC2R };
+
+  // the one instance of the cache
+  static FFTPlanCache &Instance();
+
+  // Get the plan for a 1d transform of real size input_size. Makes (and
+  // caches) the plan if it does not exist yet.
+  //
+  // With howmany > 1, the plan runs howmany transforms at once on rows
+  // packed back to back (input_size reals or input_size/2+1 complex values 
+  // per row).
+  fftw_plan Get(unsigned input_size, Direction direction, unsigned howmany=1);
+
+  // Import FFTW wisdom from the file at path (if it exists) and export
+  // wisdom back to it whenever a new plan is made. Saves the time spent 
+  // measuring plans on startup.
+  void SetWisdomFile(const std::string &path);
+
+  ~FFTPlanCache();
+
+  FFTPlanCache(FFTPlanCache const &) = delete;
+  FFTPlanCache & operator = (FFTPlanCache const &) = delete;
+
+private:
+  FFTPlanCache() {}
+
+  std::mutex _mutex;
+  std::map<std::tuple<unsigned, Direction, unsigned>, fftw_plan> _plans;
+  std::string _wisdom_file;
+};
+
 // Computes the Discrete Fourier Transform of the _real_ input data.
 // Output has a size 2 *(n/2 + 1) where n is the size of the input data.
 // Returned array must be free'd with fftw_free
@@ -12,13 +58,16 @@ public:
   // Make a new FFT manager and allocate a setup for an input array of size input_size
   explicit FFTManager(unsigned input_size);
   // Make a new FFT manager and don't allocate
-  FFTManager() {}
+  FFTManager(): _input_size(0), _output_size(0), _is_allocated(false) {}
   // allocate a setup for an input array of size input_size (NOTE: is idempotent)
   void Set(unsigned input_size);
   // execute the FFT
   void Execute();
   // get a member of the input array
   double *InputAt(const int index);
+  // the whole input/output arrays (no bounds checking)
+  double *Input() { return _input_array; }
+  const fftw_complex *Output() { return _output_array; }
   // get a member of the output array
   double ReOutputAt(const int index);
   double ImOutputAt(const int index);
@@ -30,6 +79,10 @@ public:
 
   ~FFTManager();
 
+  // Buffers are owned by the manager
+  FFTManager(FFTManager const &) = delete;
+  FFTManager & operator = (FFTManager const &) = delete;
+
 protected:
   // Internal functions
   void Alloc();
@@ -40,7 +93,126 @@ protected:
   bool _is_allocated;
   fftw_complex *_output_array;
   double *_input_array;
+  // owned by the FFTPlanCache
   fftw_plan _plan;
 };
 
+// Runs the same real FFT on a batch of equal length waveforms with one
+// FFTW "many" plan, converting the int16 ADC values on the way in.
+//
+// Waveforms are passed either as a contiguous block (row i starting at
+// block + i*stride) or as a list of row pointers. Up to BatchSize() rows
+// are transformed per call to Execute(). Magnitudes() handles any number of 
+// rows by running as many batches as it needs.
+class BatchFFT {
+public:
+  // default number of waveforms transformed together
+  static const unsigned kDefaultBatchSize = 64;
+
+  BatchFFT(): _input_size(0), _output_size(0), _batch_size(0), _n_rows(0), _is_allocated(false) {}
+  explicit BatchFFT(unsigned input_size, unsigned batch_size=kDefaultBatchSize);
+  // allocate for batches of rows of input_size values (NOTE: is idempotent)
+  void Set(unsigned input_size, unsigned batch_size=kDefaultBatchSize);
+
+  // Transform n_rows <= BatchSize() waveforms. If baselines is non-null,
+  // baselines[i] is subtracted from row i first.
+  void Execute(const int16_t *const *rows, unsigned n_rows, const int16_t *baselines=nullptr);
+  void Execute(const int16_t *block, size_t stride, unsigned n_rows, const int16_t *baselines=nullptr);
+
+  // Multiply each row by window (of size InputSize()) before the transform.
+  // An empty window turns windowing off.
+  void SetWindow(const std::vector<double> &window) { _window = window; }
+
+  // complex output of row i of the last Execute()
+  const fftw_complex *Output(unsigned row) const { return _output_array + (size_t)row * _output_size; }
+  // write the magnitudes of row i of the last Execute() to output
+  void Magnitude(unsigned row, float *output) const;
+  // write the magnitudes of all rows of the last Execute(). Row i is 
+  // written to output + i*output_stride
+  void Magnitudes(float *output, size_t output_stride) const;
+
+  // Transform any number of rows of a contiguous block and write the magnitudes
+  // to the matching rows of output
+  void Magnitudes(const int16_t *block, size_t stride, unsigned n_rows, 
+                  float *output, size_t output_stride, const int16_t *baselines=nullptr);
+
+  unsigned InputSize() const { return _input_size; }
+  unsigned OutputSize() const { return _output_size; }
+  unsigned BatchSize() const { return _batch_size; }
+
+  ~BatchFFT();
+
+  BatchFFT(BatchFFT const &) = delete;
+  BatchFFT & operator = (BatchFFT const &) = delete;
+
+private:
+  void DeAlloc();
+
+  unsigned _input_size;
+  unsigned _output_size;
+  unsigned _batch_size;
+  unsigned _n_rows;
+  bool _is_allocated;
+  double *_input_array;
+  fftw_complex *_output_array;
+  // owned by the FFTPlanCache
+  fftw_plan _plan;
+  std::vector<double> _window;
+
+  void ToInput(const int16_t *row, int16_t baseline, unsigned i_row);
+};
+
+// Averages the power spectrum of each channel over events (Welch's method).
+//
+// Each waveform is cut into segments of SegmentSize() samples overlapping
+// by half, each segment is windowed and transformed (in batches) and its
+// power |X|^2 is added to the sum of the channel. The spectrum sent out is
+// the root of the mean power of the segments, corrected for the power of the
+// window, so that without a window and with one segment per waveform it is
+// the rms over events of the FFT magnitude of each event.
+class PowerSpectrum {
+public:
+  enum Window { kRectangular, kHann, kHamming, kBlackman };
+  // "none", "hann", "hamming" or "blackman". Returns false if unknown.
+  static bool ParseWindow(const std::string &name, Window &window);
+
+  PowerSpectrum(): _n_channels(0), _segment_size(0), _window_power(1.) {}
+
+  // Allocate for n_channels channels and set the segment size (which must
+  // be even) and window
+  void Configure(unsigned n_channels, unsigned segment_size, Window window);
+
+  // add the power spectrum of a waveform to the sum of channel. The
+  // waveform is batched up until Flush() (or the batch is full), so it
+  // has to stay valid until then.
+  void Add(unsigned channel, const int16_t *waveform, size_t n, int16_t baseline);
+  // transform the batched up segments
+  void Flush();
+
+  // number of segments summed in channel since it was last reset
+  unsigned NSegments(unsigned channel) const { return _n_segments[channel]; }
+  // write out the averaged spectrum of a channel, of OutputSize() values
+  // (zero if nothing was summed). Call after Flush().
+  void Spectrum(unsigned channel, float *output) const;
+  void Reset(unsigned channel);
+
+  unsigned NChannels() const { return _n_channels; }
+  unsigned SegmentSize() const { return _segment_size; }
+  unsigned OutputSize() const { return _segment_size / 2 + 1; }
+
+private:
+  unsigned _n_channels;
+  unsigned _segment_size;
+  // mean of the square of the window
+  double _window_power;
+  BatchFFT _fft;
+  // sum of the power of channel i at _power[i * OutputSize()]
+  std::vector<double> _power;
+  std::vector<unsigned> _n_segments;
+  // the batch of segments waiting to be transformed
+  std::vector<const int16_t *> _rows;
+  std::vector<int16_t> _baselines;
+  std::vector<unsigned> _row_channels;
+};
+
 #endif
@@ -0,0 +1,182 @@
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "HitClusterer.hh"
+
+using namespace tpcAnalysis;
+
+namespace {
+  // cells are indexed with an offset so that the keys of negative cells sort
+  // before positive ones
+  const int64_t kCellOffset = 1ll << 31;
+
+  uint64_t CellKey(int64_t wire_cell, int64_t sample_cell) {
+    return ((uint64_t)(wire_cell + kCellOffset) << 32) | (uint64_t)(sample_cell + kCellOffset);
+  }
+}
+
+HitClusterer::HitClusterer(float max_wire_distance, float max_sample_distance):
+  _max_wire_distance(max_wire_distance),
+  _max_sample_distance(max_sample_distance),
+  _wires(nullptr),
+  _samples(nullptr)
+{}
+
+size_t HitClusterer::Cluster(const std::vector<int> &wires, const std::vector<float> &samples) {
+  return Cluster(wires.data(), samples.data(), std::min(wires.size(), samples.size()));
+}
+
+size_t HitClusterer::Cluster(const int *wires, const float *samples, size_t n_hits) {
+  _wires = wires;
+  _samples = samples;
+
+  _parent.resize(n_hits);
+  _size.assign(n_hits, 1);
+  _cells.resize(n_hits);
+  _order.resize(n_hits);
+  for (unsigned i = 0; i < n_hits; i++) {
+    _parent[i] = i;
+    _order[i] = i;
+    int64_t wire_cell = (int64_t)std::floor(wires[i] / (double)_max_wire_distance);
+    int64_t sample_cell = (int64_t)std::floor(samples[i] / (double)_max_sample_distance);
+    _cells[i] = CellKey(wire_cell, sample_cell);
+  }
+
+  // sort the hits by wire, then by sample
+  std::sort(_order.begin(), _order.end(), [this](unsigned a, unsigned b) {
+    return _cells[a] < _cells[b] || (_cells[a] == _cells[b] && a < b);
+  });
+  _cell_keys.clear();
+  _cell_begin.clear();
+  for (size_t i = 0; i < n_hits; i++) {
+    if (i == 0 || _cells[_order[i]] != _cell_keys.back()) {
+      _cell_keys.push_back(_cells[_order[i]]);
+      _cell_begin.push_back(i);
+    }
+  }
+  _cell_begin.push_back(n_hits);
+  size_t n_cells = _cell_keys.size();
+
+  // hits in the same cell
+  _cell_joined.resize(n_cells);
+  for (size_t cell = 0; cell < n_cells; cell++) {
+    _cell_joined[cell] = JoinCell(_cell_begin[cell], _cell_begin[cell + 1]);
+  }
+
+  // the adjacent cells after each one: the next sample cell on the same
+  // wire cell, and the three sample cells around it on the next wire cell
+  const uint64_t next_wire = 1ull << 32;
+  for (size_t cell = 0; cell < n_cells; cell++) {
+    uint64_t key = _cell_keys[cell];
+    const uint64_t adjacent[] = {key + 1, key + next_wire - 1, key + next_wire, key + next_wire + 1};
+    size_t other = cell + 1;
+    for (uint64_t other_key: adjacent) {
+      other = std::lower_bound(_cell_keys.begin() + other, _cell_keys.end(), other_key) - _cell_keys.begin();
+      if (other == n_cells) break;
+      if (_cell_keys[other] == other_key) JoinCells(cell, other);
+    }
+  }
+
+  // number the clusters in the order of their first hit, which is the root
+  // of the cluster
+  _labels.resize(n_hits);
+  _clusters.clear();
+  for (unsigned i = 0; i < n_hits; i++) {
+    unsigned root = Find(i);
+    if (_size[root] < 2) {
+      _labels[i] = -1;
+      continue;
+    }
+    if (root == i) {
+      _labels[i] = _clusters.size();
+      _clusters.push_back({0, wires[i], wires[i], samples[i], samples[i]});
+    }
+    else {
+      _labels[i] = _labels[root];
+    }
+    ClusterInfo &info = _clusters[_labels[i]];
+    info.n_hits ++;
+    info.first_wire = std::min(info.first_wire, wires[i]);
+    info.last_wire = std::max(info.last_wire, wires[i]);
+    info.first_sample = std::min(info.first_sample, samples[i]);
+    info.last_sample = std::max(info.last_sample, samples[i]);
+  }
+
+  _hit_offsets.assign(_clusters.size() + 1, 0);
+  for (size_t cluster = 0; cluster < _clusters.size(); cluster++) {
+    _hit_offsets[cluster + 1] = _hit_offsets[cluster] + _clusters[cluster].n_hits;
+  }
+  _hits.resize(_hit_offsets.back());
+  // re-use the parents as the fill position of each cluster
+  std::copy(_hit_offsets.begin(), _hit_offsets.end() - 1, _parent.begin());
+  for (unsigned i = 0; i < n_hits; i++) {
+    if (_labels[i] >= 0) _hits[_parent[_labels[i]] ++] = i;
+  }
+
+  return _clusters.size();
+}
+
+unsigned HitClusterer::Find(unsigned hit) {
+  // path halving
+  while (_parent[hit] != hit) {
+    _parent[hit] = _parent[_parent[hit]];
+    hit = _parent[hit];
+  }
+  return hit;
+}
+
+void HitClusterer::Join(unsigned a, unsigned b) {
+  unsigned root_a = Find(a);
+  unsigned root_b = Find(b);
+  if (root_a == root_b) return;
+  // the root is always the first hit of the cluster
+  if (root_b < root_a) std::swap(root_a, root_b);
+  _parent[root_b] = root_a;
+  _size[root_a] += _size[root_b];
+}
+
+bool HitClusterer::Neighbours(unsigned a, unsigned b) const {
+  return std::abs(_wires[a] - _wires[b]) < _max_wire_distance
+    && std::fabs(_samples[a] - _samples[b]) < _max_sample_distance;
+}
+
+bool HitClusterer::JoinCell(size_t begin, size_t end) {
+  // the hits of a cell are all neighbours, unless rounding moved one across
+  // the edge of the cell
+  bool joined = true;
+  for (size_t i = begin + 1; i < end; i++) {
+    if (Neighbours(_order[begin], _order[i])) Join(_order[begin], _order[i]);
+    else joined = false;
+  }
+  if (joined) return true;
+
+  for (size_t i = begin + 1; i < end; i++) {
+    for (size_t j = i + 1; j < end; j++) {
+      if (Neighbours(_order[i], _order[j])) Join(_order[i], _order[j]);
+    }
+  }
+  unsigned root = Find(_order[begin]);
+  for (size_t i = begin + 1; i < end; i++) {
+    if (Find(_order[i]) != root) return false;
+  }
+  return true;
+}
+
+void HitClusterer::JoinCells(size_t a, size_t b) {
+  // if both cells are single clusters, one neighbouring pair joins them
+  bool whole = _cell_joined[a] && _cell_joined[b];
+  for (size_t i = _cell_begin[a]; i < _cell_begin[a + 1]; i++) {
+    for (size_t j = _cell_begin[b]; j < _cell_begin[b + 1]; j++) {
+      if (Find(_order[i]) == Find(_order[j])) {
+        if (whole) return;
+        continue;
+      }
+      if (Neighbours(_order[i], _order[j])) {
+        Join(_order[i], _order[j]);
+        if (whole) return;
+      }
+    }
+  }
+}
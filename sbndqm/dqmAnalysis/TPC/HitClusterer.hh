@@ -0,0 +1,88 @@
+#ifndef _sbnddaq_analysis_HitClusterer
+#define _sbnddaq_analysis_HitClusterer
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/*
+  * Groups hits on the wires of a plane into clusters.
+  *
+  * Two hits are neighbours if they are less than max_wire_distance wires
+  * and less than max_sample_distance samples apart, and a cluster is a set
+  * of hits connected through neighbours. Hits with no neighbour are not in
+  * any cluster.
+  *
+  * The hits are sorted into cells of max_wire_distance wires by
+  * max_sample_distance samples, so neighbours are always in the same or in
+  * adjacent cells. All hits in a cell are neighbours of each other, and two
+  * adjacent cells need at most one neighbouring pair to be joined, so the
+  * search is about linear in the number of hits (plus the sort). Clusters
+  * are tracked with a union-find.
+  *
+  * Clusters are numbered in the order of their first hit. The buffers are
+  * kept across calls to Cluster(), so keep one per thread and re-use it.
+*/
+
+namespace tpcAnalysis {
+class HitClusterer {
+public:
+  class ClusterInfo {
+  public:
+    unsigned n_hits;
+    int first_wire;
+    int last_wire;
+    float first_sample;
+    float last_sample;
+  };
+
+  explicit HitClusterer(float max_wire_distance=5., float max_sample_distance=150.);
+
+  // Cluster n_hits hits, the i-th on wire wires[i] at sample samples[i].
+  // Returns the number of clusters.
+  size_t Cluster(const int *wires, const float *samples, size_t n_hits);
+  size_t Cluster(const std::vector<int> &wires, const std::vector<float> &samples);
+
+  size_t NClusters() const { return _clusters.size(); }
+  // cluster of each hit, -1 for hits with no neighbour
+  const std::vector<int> &Labels() const { return _labels; }
+  const ClusterInfo &Info(size_t cluster) const { return _clusters[cluster]; }
+  // indices of the hits of a cluster, in increasing order
+  const unsigned *HitsBegin(size_t cluster) const { return _hits.data() + _hit_offsets[cluster]; }
+  const unsigned *HitsEnd(size_t cluster) const { return _hits.data() + _hit_offsets[cluster + 1]; }
+
+private:
+  unsigned Find(unsigned hit);
+  void Join(unsigned a, unsigned b);
+  bool Neighbours(unsigned a, unsigned b) const;
+  // join the hits of a cell, given as a range of _order. Returns whether
+  // they all ended up in the same cluster
+  bool JoinCell(size_t begin, size_t end);
+  // join the neighbouring hits of two cells
+  void JoinCells(size_t a, size_t b);
+
+  float _max_wire_distance;
+  float _max_sample_distance;
+
+  const int *_wires;
+  const float *_samples;
+
+  // union-find
+  std::vector<unsigned> _parent;
+  std::vector<unsigned> _size;
+
+  // cell of each hit, and the hits sorted by cell
+  std::vector<uint64_t> _cells;
+  std::vector<unsigned> _order;
+  // the occupied cells, with their first position in _order
+  std::vector<uint64_t> _cell_keys;
+  std::vector<size_t> _cell_begin;
+  std::vector<char> _cell_joined;
+
+  std::vector<int> _labels;
+  std::vector<ClusterInfo> _clusters;
+  std::vector<unsigned> _hit_offsets;
+  std::vector<unsigned> _hits;
+};
+
+} // namespace tpcAnalysis
+#endif
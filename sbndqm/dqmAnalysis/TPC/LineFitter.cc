@@ -0,0 +1,257 @@
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include "LineFitter.hh"
+
+using namespace tpcAnalysis;
+
+void LineFitter::Clear() {
+  _n_points = 0;
+  _x0 = 0.;
+  _y0 = 0.;
+  _s = _sx = _sy = _sxx = _sxy = _syy = 0.;
+}
+
+void LineFitter::Add(double x, double y, double weight) {
+  if (_n_points == 0) {
+    _x0 = x;
+    _y0 = y;
+  }
+  double dx = x - _x0;
+  double dy = y - _y0;
+  _n_points ++;
+  _s += weight;
+  _sx += weight * dx;
+  _sy += weight * dy;
+  _sxx += weight * dx * dx;
+  _sxy += weight * dx * dy;
+  _syy += weight * dy * dy;
+}
+
+void LineFitter::Remove(double x, double y, double weight) {
+  double dx = x - _x0;
+  double dy = y - _y0;
+  _n_points --;
+  _s -= weight;
+  _sx -= weight * dx;
+  _sy -= weight * dy;
+  _sxx -= weight * dx * dx;
+  _sxy -= weight * dx * dy;
+  _syy -= weight * dy * dy;
+}
+
+LineFit LineFitter::Fit() const {
+  LineFit fit;
+  fit.n_points = _n_points;
+  double det = _s * _sxx - _sx * _sx;
+  if (_n_points < 2 || !(det > 0.)) return fit;
+
+  // line relative to the reference point
+  double slope = (_s * _sxy - _sx * _sy) / det;
+  double intercept = (_sy - slope * _sx) / _s;
+
+  fit.valid = true;
+  fit.slope = slope;
+  fit.intercept = _y0 + intercept - slope * _x0;
+  fit.slope_error = std::sqrt(_s / det);
+  fit.intercept_error = std::sqrt(std::max((_sxx + 2. * _x0 * _sx + _x0 * _x0 * _s) / det, 0.));
+  fit.chi2 = std::max(_syy - 2. * intercept * _sy - 2. * slope * _sxy
+    + intercept * intercept * _s + 2. * intercept * slope * _sx + slope * slope * _sxx, 0.);
+  return fit;
+}
+
+bool tpcAnalysis::FitRejectingOutliers(const double *x, const double *y, size_t n, double max_distance,
+    LineFit &fit, std::vector<char> &used) {
+  LineFitter fitter;
+  used.assign(n, 1);
+  for (size_t i = 0; i < n; i++) fitter.Add(x[i], y[i]);
+
+  // at most one point is dropped per fit
+  for (size_t iteration = 0; iteration < n; iteration++) {
+    fit = fitter.Fit();
+    if (!fit.valid) return false;
+
+    double farthest_distance = max_distance;
+    size_t farthest = n;
+    for (size_t i = 0; i < n; i++) {
+      if (!used[i]) continue;
+      double distance = fit.Distance(x[i], y[i]);
+      if (distance > farthest_distance) {
+        farthest_distance = distance;
+        farthest = i;
+      }
+    }
+    if (farthest == n) return true;
+
+    used[farthest] = 0;
+    fitter.Remove(x[farthest], y[farthest]);
+  }
+  return false;
+}
+
+bool tpcAnalysis::FitRansac(const double *x, const double *y, size_t n, double max_distance, unsigned n_trials,
+    LineFit &fit, std::vector<char> &used) {
+  used.assign(n, 0);
+  if (n < 2) return false;
+
+  // same pairs on every call, so results are reproducible
+  std::minstd_rand engine(n);
+  std::uniform_int_distribution<size_t> pick(0, n - 1);
+
+  LineFit best;
+  size_t best_count = 0;
+  for (unsigned trial = 0; trial < n_trials; trial++) {
+    size_t a = pick(engine);
+    size_t b = pick(engine);
+    if (x[a] == x[b]) continue;
+    LineFit line;
+    line.valid = true;
+    line.slope = (y[b] - y[a]) / (x[b] - x[a]);
+    line.intercept = y[a] - line.slope * x[a];
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (line.Distance(x[i], y[i]) <= max_distance) count ++;
+    }
+    if (count > best_count) {
+      best_count = count;
+      best = line;
+    }
+  }
+  if (best_count < 2) return false;
+
+  // least squares fit to the points close to the best line, then keep the
+  // points close to that fit
+  LineFitter fitter;
+  for (size_t i = 0; i < n; i++) {
+    if (best.Distance(x[i], y[i]) <= max_distance) fitter.Add(x[i], y[i]);
+  }
+  fit = fitter.Fit();
+  if (!fit.valid) return false;
+  for (size_t i = 0; i < n; i++) {
+    used[i] = fit.Distance(x[i], y[i]) <= max_distance;
+  }
+  return true;
+}
+
+namespace {
+  // solves the 3x3 system a * x = b by gaussian elimination. Returns false if singular.
+  bool Solve3(double a[3][3], double b[3], double x[3]) {
+    for (int col = 0; col < 3; col++) {
+      int pivot = col;
+      for (int row = col + 1; row < 3; row++) {
+        if (std::fabs(a[row][col]) > std::fabs(a[pivot][col])) pivot = row;
+      }
+      if (!(std::fabs(a[pivot][col]) > 0.)) return false;
+      std::swap(a[col], a[pivot]);
+      std::swap(b[col], b[pivot]);
+      for (int row = col + 1; row < 3; row++) {
+        double f = a[row][col] / a[col][col];
+        for (int k = col; k < 3; k++) a[row][k] -= f * a[col][k];
+        b[row] -= f * b[col];
+      }
+    }
+    for (int row = 2; row >= 0; row--) {
+      double sum = b[row];
+      for (int k = row + 1; k < 3; k++) sum -= a[row][k] * x[k];
+      x[row] = sum / a[row][row];
+    }
+    return true;
+  }
+
+  // chi2 of a gaussian (constant, mean, sigma) to the bins
+  double GaussChi2(const std::vector<double> &centers, const std::vector<double> &contents, const double *par) {
+    double chi2 = 0.;
+    for (size_t i = 0; i < centers.size(); i++) {
+      double t = (centers[i] - par[1]) / par[2];
+      double d = contents[i] - par[0] * std::exp(-0.5 * t * t);
+      chi2 += d * d / contents[i];
+    }
+    return chi2;
+  }
+}
+
+bool tpcAnalysis::ResidualGaussian(const LineFit &fit, const double *x, const double *y, size_t n, double range,
+    unsigned n_bins, double &mean, double &sigma) {
+  // histogram the residuals, keeping their mean and RMS as a fallback
+  double width = 2. * range / n_bins;
+  std::vector<double> hist(n_bins, 0.);
+  double sum = 0.;
+  double sum2 = 0.;
+  size_t n_in = 0;
+  for (size_t i = 0; i < n; i++) {
+    double residual = y[i] - fit.Eval(x[i]);
+    if (!(residual >= -range && residual < range)) continue;
+    unsigned bin = std::min((unsigned)((residual + range) / width), n_bins - 1);
+    hist[bin] += 1.;
+    sum += residual;
+    sum2 += residual * residual;
+    n_in ++;
+  }
+  mean = n_in ? sum / n_in : 0.;
+  sigma = n_in ? std::sqrt(std::max(sum2 / n_in - mean * mean, 0.)) : 0.;
+
+  // fit to the non-empty bins
+  std::vector<double> centers;
+  std::vector<double> contents;
+  double max_content = 0.;
+  for (unsigned bin = 0; bin < n_bins; bin++) {
+    if (hist[bin] <= 0.) continue;
+    centers.push_back(-range + (bin + 0.5) * width);
+    contents.push_back(hist[bin]);
+    max_content = std::max(max_content, hist[bin]);
+  }
+  if (centers.size() < 3 || !(sigma > 0.)) return false;
+
+  // Levenberg-Marquardt, from the moments of the histogram
+  double par[3] = {max_content, mean, std::max(sigma, width)};
+  double chi2 = GaussChi2(centers, contents, par);
+  double lambda = 1e-3;
+  bool converged = false;
+  for (unsigned iteration = 0; iteration < 200 && !converged; iteration++) {
+    double alpha[3][3] = {{0.}};
+    double beta[3] = {0.};
+    for (size_t i = 0; i < centers.size(); i++) {
+      double t = (centers[i] - par[1]) / par[2];
+      double e = std::exp(-0.5 * t * t);
+      double d = contents[i] - par[0] * e;
+      double w = 1. / contents[i];
+      double grad[3] = {e, par[0] * e * t / par[2], par[0] * e * t * t / par[2]};
+      for (int j = 0; j < 3; j++) {
+        beta[j] += w * d * grad[j];
+        for (int k = 0; k < 3; k++) alpha[j][k] += w * grad[j] * grad[k];
+      }
+    }
+    // increase the damping until a step lowers the chi2
+    while (true) {
+      double a[3][3];
+      double b[3] = {beta[0], beta[1], beta[2]};
+      double step[3];
+      for (int j = 0; j < 3; j++) {
+        for (int k = 0; k < 3; k++) a[j][k] = alpha[j][k];
+        a[j][j] *= 1. + lambda;
+      }
+      if (!Solve3(a, b, step)) return false;
+      double trial[3] = {par[0] + step[0], par[1] + step[1], par[2] + step[2]};
+      double trial_chi2 = trial[2] != 0. ? GaussChi2(centers, contents, trial) : chi2 + 1.;
+      if (trial_chi2 <= chi2) {
+        converged = chi2 - trial_chi2 <= 1e-10 * (chi2 + 1e-10);
+        std::copy(trial, trial + 3, par);
+        chi2 = trial_chi2;
+        lambda = std::max(lambda * 0.1, 1e-12);
+        break;
+      }
+      lambda *= 10.;
+      if (lambda > 1e12) {
+        converged = true;
+        break;
+      }
+    }
+  }
+  if (!converged || !std::isfinite(par[1]) || !std::isfinite(par[2])) return false;
+
+  mean = par[1];
+  sigma = std::fabs(par[2]);
+  return true;
+}
@@ -0,0 +1,89 @@
+#ifndef _sbnddaq_analysis_LineFitter
+#define _sbnddaq_analysis_LineFitter
+#include <vector>
+#include <cstddef>
+#include <cmath>
+
+/*
+  * Closed form (weighted) least squares fits of a straight line.
+  *
+  * The fitter keeps the running sums of the points, so points can be added
+  * and removed one at a time and the line re-fit at no cost. The sums are
+  * taken relative to the first point added, which keeps them precise when
+  * the points are far from the origin.
+  *
+  * Nothing here allocates (other than the per-point flags of the robust
+  * fits, which can be re-used) or uses ROOT, so fits can run in parallel.
+*/
+
+namespace tpcAnalysis {
+
+// y = intercept + slope * x
+class LineFit {
+public:
+  bool valid;
+  size_t n_points;
+  double slope;
+  double intercept;
+  // from the weights, as 1 / sigma^2 of each point (not scaled by the chi2)
+  double slope_error;
+  double intercept_error;
+  double chi2;
+
+  LineFit(): valid(false), n_points(0), slope(0.), intercept(0.), slope_error(0.), intercept_error(0.), chi2(0.) {}
+
+  double Eval(double x) const { return intercept + slope * x; }
+  // perpendicular distance of a point to the line
+  double Distance(double x, double y) const { return std::fabs(slope * x - y + intercept) / std::sqrt(slope * slope + 1.); }
+};
+
+class LineFitter {
+public:
+  LineFitter() { Clear(); }
+
+  void Clear();
+  void Add(double x, double y, double weight=1.);
+  void Remove(double x, double y, double weight=1.);
+  size_t NPoints() const { return _n_points; }
+
+  // Not valid with less than two points on different x's
+  LineFit Fit() const;
+
+private:
+  size_t _n_points;
+  // reference point
+  double _x0;
+  double _y0;
+  // weighted sums of 1, dx, dy, dx^2, dx dy and dy^2 relative to it
+  double _s;
+  double _sx;
+  double _sy;
+  double _sxx;
+  double _sxy;
+  double _syy;
+};
+
+// Fits a line to n points with unit weights, dropping the farthest point
+// (by perpendicular distance) and re-fitting while it is more than
+// max_distance from the line. Returns whether all remaining points end up
+// within max_distance; used[i] tells whether point i is kept.
+bool FitRejectingOutliers(const double *x, const double *y, size_t n, double max_distance,
+  LineFit &fit, std::vector<char> &used);
+
+// RANSAC alternative: the line through the pair of points with the most
+// points within max_distance (out of n_trials random pairs, with a fixed
+// seed), re-fit to those points. Returns false if no line was found.
+bool FitRansac(const double *x, const double *y, size_t n, double max_distance, unsigned n_trials,
+  LineFit &fit, std::vector<char> &used);
+
+// Mean and sigma of a gaussian fit to the histogram of the residuals
+// y - fit.Eval(x) in n_bins bins over [-range, range). As with
+// TH1::Fit("gaus"), the fit is a least squares one to the non-empty bins,
+// with sqrt(content) errors, so it follows the core of the distribution
+// rather than its tails. Returns false if the fit fails, in which case mean
+// and sigma are the mean and RMS of the residuals in range.
+bool ResidualGaussian(const LineFit &fit, const double *x, const double *y, size_t n, double range,
+  unsigned n_bins, double &mean, double &sigma);
+
+} // namespace tpcAnalysis
+#endif
@@ -0,0 +1,99 @@
+#include <vector>
+#include <string>
+
+#include "art/Framework/Core/EDAnalyzer.h"
+#include "art/Framework/Core/ModuleMacros.h"
+
+#include "art/Framework/Principal/Event.h"
+
+#include "sbndqm/Decode/Mode/Mode.hh"
+#include "Benchmark.hh"
+
+/*
+ * Compares the speed and accuracy of the mode finding algorithms on the
+ * waveforms of real RawDigits:
+ *  - FREQUENT: the approximate algorithm (ModeFrequent)
+ *  - EXACT: one histogram per waveform (ModeFinder::Find)
+ *  - BATCHED: all waveforms of an event at once
+ * The exact mode is taken as the reference, differences are in ADC counts.
+*/
+
+namespace tpcAnalysis {
+  class ModeBenchmark;
+}
+
+class tpcAnalysis::ModeBenchmark : public art::EDAnalyzer {
+public:
+  explicit ModeBenchmark(fhicl::ParameterSet const & p);
+
+  // Plugins should not be copied or assigned.
+  ModeBenchmark(ModeBenchmark const &) = delete;
+  ModeBenchmark(ModeBenchmark &&) = delete;
+  ModeBenchmark & operator = (ModeBenchmark const &) = delete;
+  ModeBenchmark & operator = (ModeBenchmark &&) = delete;
+
+  void analyze(art::Event const & e) override;
+  void endJob() override;
+
+private:
+  enum Algorithm { kFrequent, kExact, kBatched };
+
+  Benchmark _benchmark;
+  unsigned _n_mode_skip;
+
+  ModeFinder _finder;
+  std::vector<const int16_t *> _data;
+  std::vector<size_t> _n_data;
+  std::vector<int16_t> _exact;
+  std::vector<int16_t> _frequent;
+  std::vector<int16_t> _batched;
+};
+
+tpcAnalysis::ModeBenchmark::ModeBenchmark(fhicl::ParameterSet const & p):
+  art::EDAnalyzer::EDAnalyzer(p),
+  _benchmark(p, {"FREQUENT", "EXACT", "BATCHED"}),
+  _n_mode_skip(p.get<unsigned>("n_mode_skip", 1))
+{}
+
+void tpcAnalysis::ModeBenchmark::analyze(art::Event const & e) {
+  const std::vector<ADCView> &waveforms = _benchmark.Collect(e);
+  unsigned n_waveforms = waveforms.size();
+  // the batched mode finding takes the waveforms as separate arrays
+  _data.resize(n_waveforms);
+  _n_data.resize(n_waveforms);
+  for (unsigned i = 0; i < n_waveforms; i++) {
+    _data[i] = waveforms[i].data();
+    _n_data[i] = waveforms[i].size();
+  }
+  _exact.resize(n_waveforms);
+  _frequent.resize(n_waveforms);
+  _batched.resize(n_waveforms);
+
+  _benchmark.Result(kFrequent).time = _benchmark.Time([&]() {
+    for (unsigned i = 0; i < n_waveforms; i++) {
+      _frequent[i] = ModeFrequent(_data[i], _n_data[i], _n_mode_skip);
+    }
+  });
+  _benchmark.Result(kExact).time = _benchmark.Time([&]() {
+    for (unsigned i = 0; i < n_waveforms; i++) {
+      _exact[i] = _finder.Find(_data[i], _n_data[i], _n_mode_skip);
+    }
+  });
+  _benchmark.Result(kBatched).time = _benchmark.Time([&]() {
+    _finder.Find(_data.data(), _n_data.data(), n_waveforms, _batched.data(), _n_mode_skip);
+  });
+
+  for (unsigned i = 0; i < n_waveforms; i++) {
+    _benchmark.Result(kFrequent).Compare(_frequent[i] - _exact[i]);
+    _benchmark.Result(kExact).Compare(0);
+    _benchmark.Result(kBatched).Compare(_batched[i] - _exact[i]);
+  }
+
+  _benchmark.EndEvent(e);
+}
+
+void tpcAnalysis::ModeBenchmark::endJob() {
+  _benchmark.Print("MODE BENCHMARK (n_mode_skip: " + std::to_string(_n_mode_skip) + ")");
+}
+
+DEFINE_ART_MODULE(tpcAnalysis::ModeBenchmark)
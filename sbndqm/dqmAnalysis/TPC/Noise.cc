@@ -1,15 +1,63 @@
 #include <vector>
 #include <array>
+#include <algorithm>
+#include <climits>
 #include <numeric>
 #include <math.h> 
 #include <stdlib.h>
 #include <iostream>
 
 #include "Noise.hh"
+#include "SIMD.hh"
 
 using namespace tpcAnalysis;
 
-NoiseSample::NoiseSample(std::vector<PeakFinder::Peak>& peaks, int16_t baseline, unsigned wvfm_size) {
+namespace {
+// Calls f(lo, hi) for each (inclusive) range in the intersection of two sorted lists of ranges
+template<typename F>
+void ForEachIntersection(const std::vector<std::array<unsigned,2>> &me, const std::vector<std::array<unsigned,2>> &other, F f) {
+  unsigned self_ind = 0;
+  unsigned other_ind = 0;
+  while (self_ind < me.size() && other_ind < other.size()) {
+    // determine if there is a valid intersection
+    bool is_intersection = (me[self_ind][1] >= other[other_ind][0]) &&
+                           (me[self_ind][0] <= other[other_ind][1]);
+    if (is_intersection) {
+      f(std::max(me[self_ind][0], other[other_ind][0]), std::min(me[self_ind][1], other[other_ind][1]));
+    }
+
+    // determine which ind to incl
+    if (me[self_ind][1] < other[other_ind][1]) self_ind ++;
+    else other_ind ++;
+  }
+}
+
+// Same as ForEachSpan, over the intersection of two lists of ranges
+template<typename F>
+unsigned ForEachJointSpan(const std::vector<std::array<unsigned,2>> &me, const std::vector<std::array<unsigned,2>> &other, unsigned max_sample, F f) {
+  unsigned n_samples = 0;
+  ForEachIntersection(me, other, [&](unsigned lo, unsigned hi) {
+    if (n_samples >= max_sample) return;
+    unsigned n = std::min(hi - lo + 1, max_sample - n_samples);
+    f(lo, n);
+    n_samples += n;
+  });
+  return n_samples;
+}
+} // namespace
+
+NoiseSample::NoiseSample(const std::vector<PeakFinder::Peak>& peaks, int16_t baseline, unsigned wvfm_size) {
+  Set(peaks, baseline, wvfm_size);
+}
+
+void NoiseSample::Set(unsigned lo, unsigned hi, int16_t baseline) {
+  _ranges.clear();
+  _ranges.push_back({lo, hi});
+  _baseline = baseline;
+}
+
+void NoiseSample::Set(const std::vector<PeakFinder::Peak>& peaks, int16_t baseline, unsigned wvfm_size) {
+  _ranges.clear();
   // we assume here that the vector of peaks are "sorted"
   // that peak[i].start_loose <= peak[i+1].start_loose and
   // that peak[i].end_loose <= peak[i+1].end_loose
@@ -29,154 +77,123 @@ NoiseSample::NoiseSample(std::vector<PeakFinder::Peak>& peaks, int16_t baseline,
   _baseline = baseline;
 }
 
-float NoiseSample::CalcRMS(const std::vector<int16_t> &wvfm_self, std::vector<std::array<unsigned,2>> &ranges, int16_t baseline, unsigned max_sample) {
-  unsigned n_samples = 0;
-  double ret = 0;
+float NoiseSample::CalcRMS(ADCView wvfm_self, std::vector<std::array<unsigned,2>> &ranges, int16_t baseline, unsigned max_sample) {
+  int64_t ret = 0;
   // iterate over the regions w/out signal
-  for (auto &range: ranges) {
-    for (unsigned i = range[0]; i <= range[1]; i++) {
-      n_samples ++;
-      ret += (wvfm_self[i] - baseline) * (wvfm_self[i] - baseline);
-
-      if (n_samples == max_sample) {
-        return sqrt((double)ret / n_samples);
-      }
-    }
-  }
+  unsigned n_samples = ForEachSpan(ranges, max_sample, [&](unsigned start, unsigned n) {
+    ret += simd::SumSquares(wvfm_self.data() + start, n, baseline);
+  });
 
   return sqrt((double)ret / n_samples);
 }
 
 NoiseSample NoiseSample::DoIntersection(NoiseSample &me, NoiseSample &other, int16_t baseline) {
-  std::vector<std::array<unsigned, 2>> ranges;
-  unsigned self_ind = 0;
-  unsigned other_ind = 0;
-  while (self_ind < me._ranges.size() && other_ind < other._ranges.size()) {
-    // determine if there is a valid intersection
-    bool is_intersection = (me._ranges[self_ind][1] >= other._ranges[other_ind][0]) &&
-                           (me._ranges[self_ind][0] <= other._ranges[other_ind][1]);
-    if (is_intersection) {
-      unsigned intersection_lo = std::max(me._ranges[self_ind][0], other._ranges[other_ind][0]);
-      unsigned intersection_hi = std::min(me._ranges[self_ind][1], other._ranges[other_ind][1]);
-      ranges.emplace_back( std::array<unsigned,2>{intersection_lo, intersection_hi} );
-    }
-
-    // determine which ind to incl
-    if (me._ranges[self_ind][1] < other._ranges[other_ind][1]) self_ind ++;
-    else other_ind ++;
-
-  }
+  NoiseSample ret({}, baseline);
+  me.Intersection(other, ret);
+  return ret;
+}
 
-  return NoiseSample(ranges, baseline);
+void NoiseSample::Intersection(const NoiseSample &other, NoiseSample &output) const {
+  output._ranges.clear();
+  ForEachIntersection(_ranges, other._ranges, [&](unsigned lo, unsigned hi) {
+    output._ranges.emplace_back( std::array<unsigned,2>{lo, hi} );
+  });
 }
 
-float NoiseSample::Covariance(const std::vector<int16_t> &wvfm_self, NoiseSample &other, const std::vector<int16_t> &wvfm_other, unsigned max_sample) {
-  NoiseSample joint = Intersection(other);
-  unsigned n_samples = 0;
-  int ret = 0;
+float NoiseSample::Covariance(ADCView wvfm_self, NoiseSample &other, ADCView wvfm_other, unsigned max_sample) {
+  int64_t ret = 0;
   // iterate over the regions w/out signal
-  for (auto &range: joint._ranges) {
-    for (unsigned i = range[0]; i <= range[1]; i++) {
-      n_samples ++;
-      ret += (wvfm_self[i] - _baseline) * (wvfm_other[i] - other._baseline);
-      if (n_samples == max_sample) {
-        return ((float)ret) / n_samples;
-      }
-    }
-  }
+  unsigned n_samples = ForEachJointSpan(_ranges, other._ranges, max_sample, [&](unsigned start, unsigned n) {
+    ret += simd::SumProducts(wvfm_self.data() + start, _baseline, wvfm_other.data() + start, other._baseline, n);
+  });
   return ((float)ret) / n_samples;
 }
 
-float NoiseSample::Correlation(const std::vector<int16_t> &wvfm_self, NoiseSample &other, const std::vector<int16_t> &wvfm_other, unsigned max_sample) {
-  NoiseSample joint = Intersection(other);
-  float scaling = CalcRMS(wvfm_self, joint._ranges, _baseline, max_sample) * CalcRMS(wvfm_other, joint._ranges, other._baseline, max_sample);
-  return Covariance(wvfm_self, other, wvfm_other, max_sample) / scaling;
+float NoiseSample::Correlation(ADCView wvfm_self, NoiseSample &other, ADCView wvfm_other, unsigned max_sample) {
+  // covariance and the rms of each waveform over the joint sample, in one go
+  int64_t covariance = 0;
+  int64_t self_sum2 = 0;
+  int64_t other_sum2 = 0;
+  unsigned n_samples = ForEachJointSpan(_ranges, other._ranges, max_sample, [&](unsigned start, unsigned n) {
+    covariance += simd::SumProducts(wvfm_self.data() + start, _baseline, wvfm_other.data() + start, other._baseline, n);
+    self_sum2 += simd::SumSquares(wvfm_self.data() + start, n, _baseline);
+    other_sum2 += simd::SumSquares(wvfm_other.data() + start, n, other._baseline);
+  });
+  float scaling = (float)sqrt((double)self_sum2 / n_samples) * (float)sqrt((double)other_sum2 / n_samples);
+  return (((float)covariance) / n_samples) / scaling;
 }
 
-float NoiseSample::SumRMS(const std::vector<int16_t> &wvfm_self, NoiseSample &other, const std::vector<int16_t> &wvfm_other, unsigned max_sample) {
-  NoiseSample joint = Intersection(other);
-  unsigned n_samples = 0;
-  int ret = 0;
+float NoiseSample::SumRMS(ADCView wvfm_self, NoiseSample &other, ADCView wvfm_other, unsigned max_sample) {
+  int64_t ret = 0;
   // iterate over the regions w/out signal
-  for (auto &range: joint._ranges) {
-    for (unsigned i = range[0]; i <= range[1]; i++) {
-      n_samples ++;
-      int16_t val = wvfm_self[i] - _baseline + wvfm_other[i] - other._baseline;
-      ret += val * val;
-      if (n_samples == max_sample) {
-        return sqrt(((float)ret) / n_samples);
-      }
-    }
-  }
+  unsigned n_samples = ForEachJointSpan(_ranges, other._ranges, max_sample, [&](unsigned start, unsigned n) {
+    ret += simd::SumSquaresOfSum(wvfm_self.data() + start, _baseline, wvfm_other.data() + start, other._baseline, n);
+  });
   return sqrt(((float)ret) / n_samples);
 }
 
-float NoiseSample::ScaledSumRMS(std::vector<NoiseSample *>& noises, std::vector<const std::vector<int16_t> *>& waveforms, unsigned max_sample) {
+float NoiseSample::ScaledSumRMS(std::vector<NoiseSample *>& noises, std::vector<ADCView>& waveforms, unsigned max_sample) {
   // calculate the joint noise sample over all n samples
   // n must be >= 2
   NoiseSample joint = DoIntersection(*noises[0], *noises[1]);
+  NoiseSample scratch;
   for (unsigned i = 2; i < noises.size(); i++) {
-    joint = DoIntersection(joint, *noises[i]);
+    joint.Intersection(*noises[i], scratch);
+    std::swap(joint._ranges, scratch._ranges);
   }
 
-  unsigned n_samples = 0;
-  int ret = 0;
-  // iterate over the regions w/out signal
-  for (auto &range: joint._ranges) {
-    for (unsigned i = range[0]; i <= range[1]; i++) {
-      n_samples ++;
-      int sample = 0;
-      for (unsigned wvfm_ind = 0; wvfm_ind < noises.size(); wvfm_ind++) {
-        sample += (*waveforms[wvfm_ind])[i] - noises[wvfm_ind]->_baseline;
-      }
-      ret += sample * sample;
-      if (n_samples == max_sample) break;
-    }
-    if (n_samples == max_sample) break;
+  std::vector<int16_t> baselines(noises.size());
+  for (unsigned wvfm_ind = 0; wvfm_ind < noises.size(); wvfm_ind++) {
+    baselines[wvfm_ind] = noises[wvfm_ind]->_baseline;
   }
-  float sum_rms = ((float)ret) / n_samples; 
+  std::vector<int> sum;
+  SumWaveforms(sum, waveforms, baselines);
+
+  int64_t ret = 0;
+  // iterate over the regions w/out signal
+  unsigned n_samples = ForEachSpan(joint._ranges, max_sample, [&](unsigned start, unsigned n) {
+    ret += simd::SumSquares32(sum.data() + start, n);
+  });
+  float sum_rms = sqrt((double)ret / n_samples);
 
-  float rms_all = 0;
+  std::vector<float> rms(noises.size());
   for (unsigned wvfm_ind = 0; wvfm_ind < noises.size(); wvfm_ind++) {
-    rms_all += CalcRMS(*waveforms[wvfm_ind], joint._ranges, noises[wvfm_ind]->_baseline, max_sample);
+    rms[wvfm_ind] = CalcRMS(waveforms[wvfm_ind], joint._ranges, noises[wvfm_ind]->_baseline, max_sample);
   }
-  // send uncorrelated sum-rms value to 0
-  float scale_sub = rms_all * sqrt((float) noises.size());
-  // and send fully correlated sum-rms value to 1
-  float scale_div = rms_all * noises.size() - scale_sub;
+  return ScaleSumRMS(sum_rms, rms.data(), rms.size());
+}
+
+float tpcAnalysis::ScaleSumRMS(float sum_rms, const float *rms, unsigned n) {
+  float rms_sum = 0;
+  float rms2_sum = 0;
+  for (unsigned i = 0; i < n; i++) {
+    rms_sum += rms[i];
+    rms2_sum += rms[i] * rms[i];
+  }
+  // send uncorrelated sum-rms value (sqrt of the sum of the variances) to 0
+  float scale_sub = sqrt(rms2_sum);
+  // and send fully correlated sum-rms value (the sum of the rms's) to 1
+  float scale_div = rms_sum - scale_sub;
+  if (scale_div <= 0.) return 0.;
 
   return (sum_rms - scale_sub) / scale_div; 
 }
 
-float NoiseSample::DNoise(const std::vector<int16_t> &wvfm_self, NoiseSample &other, const std::vector<int16_t> &wvfm_other, unsigned max_sample) {
-  NoiseSample joint = Intersection(other);
-
-  unsigned n_samples = 0;
-  int noise = 0;
+float NoiseSample::DNoise(ADCView wvfm_self, NoiseSample &other, ADCView wvfm_other, unsigned max_sample) {
+  int64_t noise = 0;
   // iterate over the regions w/out signal
-  for (auto &range: joint._ranges) {
-    for (unsigned i = range[0]; i <= range[1]; i ++) {
-      n_samples ++;
-      int16_t val = (wvfm_self[i] - _baseline) - (wvfm_other[i] - other._baseline);
-      noise += val * val;
-      if (n_samples == max_sample) {
-        return sqrt(((float) noise) / n_samples);
-      }
-    }
-  }
+  unsigned n_samples = ForEachJointSpan(_ranges, other._ranges, max_sample, [&](unsigned start, unsigned n) {
+    noise += simd::SumSquaresOfDifference(wvfm_self.data() + start, _baseline, wvfm_other.data() + start, other._baseline, n);
+  });
   return sqrt(((float) noise) / n_samples);
 }
 
 // calculated the mean of all adc values in noise ranges, and sets that as baseline
-void NoiseSample::ResetBaseline(const std::vector<int16_t> &wvfm_self) {
-  int total = 0;
-  int n_values = 0;
-  for (auto &range: _ranges) {
-    for (unsigned i = range[0]; i <= range[1]; i++) {
-      total += wvfm_self[i];
-      n_values ++;
-    }
-  }
+void NoiseSample::ResetBaseline(ADCView wvfm_self) {
+  int64_t total = 0;
+  unsigned n_values = ForEachSpan(_ranges, UINT_MAX, [&](unsigned start, unsigned n) {
+    total += simd::Sum(wvfm_self.data() + start, n);
+  });
   // Don't crash if there are no values in the noise range, even though this would 
   // obviously be a very bad thing. It's more important to persit to maintain analysis.
   if (n_values == 0) return;
@@ -184,20 +201,21 @@ void NoiseSample::ResetBaseline(const std::vector<int16_t> &wvfm_self) {
   _baseline = total / n_values;
 }
 
+float tpcAnalysis::RawRMS(ADCView waveform, int16_t baseline) {
+  // same as NoiseSample::RMS over the whole waveform
+  int64_t ret = simd::SumSquares(waveform.data(), waveform.size(), baseline);
+  return sqrt((double)ret / waveform.size());
+}
+
 // sum a group of waveforms looking for e.g. coherent noise
-// assumes output is of size output_size
-void SumWaveforms(std::vector<int> &output, std::vector<const std::vector<int16_t>*>& waveforms, std::vector<int16_t> &baselines) {
-  size_t output_size = waveforms[0]->size();
-
-  for (size_t adc_ind = 0; adc_ind < output_size; adc_ind++) {
-    // make space
-    output.push_back(0);
-    // sum
-    for (size_t waveform_ind = 0; waveform_ind < waveforms.size(); waveform_ind++) {
-      output[adc_ind] += (*waveforms[waveform_ind])[adc_ind] - baselines[waveform_ind];
-    } 
+void tpcAnalysis::SumWaveforms(std::vector<int> &output, const std::vector<ADCView>& waveforms, const std::vector<int16_t> &baselines) {
+  size_t output_size = waveforms[0].size();
+  output.assign(output_size, 0);
+
+  // one waveform at a time, so each is only read once
+  static_assert(sizeof(int) == sizeof(int32_t), "summed waveforms are stored as int32_t");
+  for (size_t waveform_ind = 0; waveform_ind < waveforms.size(); waveform_ind++) {
+    simd::AddWaveform(waveforms[waveform_ind].data(), std::min(output_size, waveforms[waveform_ind].size()),
+                      baselines[waveform_ind], (int32_t *)output.data());
   }
 }
-
-
-
@@ -2,52 +2,95 @@
 #define _sbnddaq_analysis_Noise
 #include <vector>
 #include <array>
+#include <algorithm>
+#include <cstdint>
 
 #include "PeakFinder.hh"
+#include "Span.hh"
 
 // keeps track of which regions of a waveform are suitable for noise calculations (i.e. don't contain signal)
 namespace tpcAnalysis {
 class NoiseSample {
 public:
   // construct sample from peaks (signals)
-  NoiseSample(std::vector<PeakFinder::Peak>& peaks, int16_t baseline, unsigned wvfm_size);
+  NoiseSample(const std::vector<PeakFinder::Peak>& peaks, int16_t baseline, unsigned wvfm_size);
   // construct from a list of ranges that don't have signal
   NoiseSample(std::vector<std::array<unsigned, 2>> ranges, int16_t baseline): _ranges(ranges), _baseline(baseline) {}
   // zero initialize
   NoiseSample(): _baseline(0) {}
 
+  // Re-fill the sample in place, re-using the memory for the ranges
+  void Set(const std::vector<PeakFinder::Peak>& peaks, int16_t baseline, unsigned wvfm_size);
+  void Set(unsigned lo, unsigned hi, int16_t baseline);
+  void Clear() { _ranges.clear(); _baseline = 0; }
+
   // calculate the intersect of ranges with another sample
   NoiseSample Intersection(NoiseSample &other) { return DoIntersection(*this, other, _baseline); }
+  // same, filling output (and re-using its memory). Keeps the baseline of output.
+  void Intersection(const NoiseSample &other, NoiseSample &output) const;
 
-  float RMS(const std::vector<int16_t> &wvfm_self, unsigned max_sample=UINT_MAX) { return CalcRMS(wvfm_self, _ranges, _baseline); } 
+  float RMS(ADCView wvfm_self, unsigned max_sample=UINT_MAX) { return CalcRMS(wvfm_self, _ranges, _baseline); } 
 
   // Functions for quantifying coherent noise:
-  float Covariance(const std::vector<int16_t> &wvfm_self, NoiseSample &other, const std::vector<int16_t> &wvfm_other, unsigned max_sample=UINT_MAX);
-  float Correlation(const std::vector<int16_t> &wvfm_self, NoiseSample &other, const std::vector<int16_t> &wvfm_other, unsigned max_sample=UINT_MAX);
+  // (these work over the intersection of the two samples without allocating it)
+  float Covariance(ADCView wvfm_self, NoiseSample &other, ADCView wvfm_other, unsigned max_sample=UINT_MAX);
+  float Correlation(ADCView wvfm_self, NoiseSample &other, ADCView wvfm_other, unsigned max_sample=UINT_MAX);
   // the "Sum RMS" of a sample with another sample
-  float SumRMS(const std::vector<int16_t> &wvfm_self, NoiseSample &other, const std::vector<int16_t> &wvfm_other, unsigned max_sample=UINT_MAX);
+  float SumRMS(ADCView wvfm_self, NoiseSample &other, ADCView wvfm_other, unsigned max_sample=UINT_MAX);
   // the "Sum RMS" of n samples
-  static float ScaledSumRMS(std::vector<NoiseSample *>& other, std::vector<const std::vector<int16_t> *>& wvfm_other, unsigned max_sample=UINT_MAX);
+  static float ScaledSumRMS(std::vector<NoiseSample *>& other, std::vector<ADCView>& wvfm_other, unsigned max_sample=UINT_MAX);
   // "DNoise" with another sample
-  float DNoise(const std::vector<int16_t> &wvfm_self, NoiseSample &other, const std::vector<int16_t> &wvfm_other, unsigned max_sample=UINT_MAX);
+  float DNoise(ADCView wvfm_self, NoiseSample &other, ADCView wvfm_other, unsigned max_sample=UINT_MAX);
 
   // re-calculate the baseline as taking the mean of all values in the noise ranges
-  void ResetBaseline(const std::vector<int16_t> &wvfm_self);
+  void ResetBaseline(ADCView wvfm_self);
 
   // get access to the ranges
   std::vector<std::array<unsigned, 2>> *Ranges() { return &_ranges; }
   // getter for the baseline
   int16_t Baseline() { return _baseline; }
+  void SetBaseline(int16_t baseline) { _baseline = baseline; }
 private:
-  static float CalcRMS(const std::vector<int16_t> &wvfm_self, std::vector<std::array<unsigned,2>> &ranges, int16_t baseline, unsigned max_sample=UINT_MAX);
+  static float CalcRMS(ADCView wvfm_self, std::vector<std::array<unsigned,2>> &ranges, int16_t baseline, unsigned max_sample=UINT_MAX);
   static NoiseSample DoIntersection(NoiseSample &me, NoiseSample &other, int16_t baseline=0.);
 
   std::vector<std::array<unsigned, 2>> _ranges;
   int16_t _baseline;
 };
 
-// helper function to sum a group of waveforms looking for e.g. coherent noise
-void SumWaveforms(std::vector<int> &output, std::vector<const std::vector<int16_t>*>& waveforms, std::vector<int16_t>& baselines);
+// gets the RMS from a waveform including any present signal
+float RawRMS(ADCView waveform, int16_t baseline);
+
+// helper function to sum a group of waveforms looking for e.g. coherent noise.
+// output is resized to the size of the first waveform.
+void SumWaveforms(std::vector<int> &output, const std::vector<ADCView>& waveforms, const std::vector<int16_t>& baselines);
+
+// Scales the RMS of the sum of a group of waveforms to be 0 when their noise
+// is uncorrelated and 1 when it is fully correlated, given the RMS of each
+// waveform (over the same samples)
+float ScaleSumRMS(float sum_rms, const float *rms, unsigned n);
+
+// Calls f(start, n) for each contiguous piece of a (sorted) list of noise
+// ranges inside of the first n_ticks ticks, truncated so that at most
+// max_sample samples are visited in total. Returns the number of samples visited.
+template<typename F>
+unsigned ForEachSpan(const std::vector<std::array<unsigned,2>> &ranges, size_t n_ticks, unsigned max_sample, F f) {
+  unsigned n_samples = 0;
+  for (auto &range: ranges) {
+    if (n_samples >= max_sample || range[0] >= n_ticks) break;
+    unsigned hi = std::min<size_t>(range[1], n_ticks - 1);
+    unsigned n = std::min(hi - range[0] + 1, max_sample - n_samples);
+    f(range[0], n);
+    n_samples += n;
+  }
+  return n_samples;
+}
+
+// same, for ranges known to be inside of the waveform
+template<typename F>
+unsigned ForEachSpan(const std::vector<std::array<unsigned,2>> &ranges, unsigned max_sample, F f) {
+  return ForEachSpan(ranges, SIZE_MAX, max_sample, f);
+}
 
 } // namespace tpcAnalysis
 #endif
@@ -1,5 +1,10 @@
 #include <vector>
 #include <chrono>
+#include <string>
+#include <memory>
+#include <iostream>
+#include <stdio.h>
+#include <algorithm>
 
 #include "TROOT.h"
 #include "TTree.h"
@@ -17,6 +22,8 @@
 #include "ChannelData.hh"
 #include "sbndqm/Decode/TPC/HeaderData.hh"
 #include "Analysis.hh"
+#include "Snapshot.hh"
+#include "FFT.hh"
 
 #include "sbndaq-online/helpers/SBNMetricManager.h"
 #include "sbndaq-online/helpers/MetricConfig.h"
@@ -30,14 +37,253 @@
 
 namespace tpcAnalysis {
   class OnlineAnalysis;
+  class MetricBatch;
+}
+
+// Collects the per-channel metrics of an event in columns (one value per
+// channel for each metric) and sends them out all at once.
+//
+// The metric names and channel instance strings are made once, up front,
+// so no strings are built per metric. Metrics are either passed on to the
+// metric manager, or written straight to redis in a single pipelined
+// round-trip.
+//
+// When writing to redis, the batch does what the metric manager would do
+// with the mode of each metric: the values of each channel are combined
+// over a reporting interval and only the result is written.
+class tpcAnalysis::MetricBatch {
+public:
+  MetricBatch(): _report_interval(0.) {}
+
+  // Add a metric to the batch. Returns the index used to fill it.
+  // Integer metrics are sent as integers.
+  unsigned AddMetric(const std::string &name, artdaq::MetricMode mode, bool is_int=false);
+  void Setup(const std::string &group, const std::string &prefix, unsigned n_channels, unsigned stream_length,
+    double report_interval);
+
+  // start collecting a new event
+  void Clear();
+  // add a channel to the event. Every metric should then be filled for it.
+  void AddChannel(unsigned channel);
+  // set a metric for the last channel added
+  void Fill(unsigned metric, float value) { _columns[metric].back() = value; }
+
+  // send through sbndaq::sendMetric
+  void Send();
+  // Add the event to the reporting interval and, once the interval is
+  // over, send the result straight to redis. Returns false if redis
+  // failed, after which the context should not be used again.
+  bool Send(redisContext *context);
+
+private:
+  // values of each channel of a metric over the reporting interval
+  class Interval {
+  public:
+    std::vector<double> values;
+    std::vector<unsigned> counts;
+  };
+
+  const std::string &Instance(unsigned channel);
+  // append an argument to the buffer of redis arguments, returning its offset
+  size_t Append(const char *str, size_t len);
+  // add the event to the values of the reporting interval
+  void Accumulate();
+  // format the value of a metric over the interval. Returns the length.
+  int Format(unsigned metric, unsigned channel, double seconds, char *buffer, size_t size) const;
+
+  std::string _group;
+  std::string _stream_length_str;
+  std::vector<std::string> _names;
+  std::vector<artdaq::MetricMode> _modes;
+  std::vector<bool> _is_int;
+  std::vector<std::string> _instances;
+
+  // columnar buffer: channel of each row and a column of values for each metric
+  std::vector<unsigned> _channels;
+  std::vector<std::vector<float>> _columns;
+
+  // values of each metric over the reporting interval (for redis)
+  double _report_interval;
+  std::chrono::steady_clock::time_point _interval_start;
+  std::vector<Interval> _intervals;
+
+  // buffers for the redis commands
+  std::vector<char> _arg_buffer;
+  std::vector<size_t> _arg_offsets;
+  std::vector<size_t> _arg_lengths;
+};
+
+unsigned tpcAnalysis::MetricBatch::AddMetric(const std::string &name, artdaq::MetricMode mode, bool is_int) {
+  _names.push_back(name);
+  _modes.push_back(mode);
+  _is_int.push_back(is_int);
+  _columns.emplace_back();
+  _intervals.emplace_back();
+  return _names.size() - 1;
+}
+
+void tpcAnalysis::MetricBatch::Setup(const std::string &group, const std::string &prefix, unsigned n_channels, unsigned stream_length,
+    double report_interval) {
+  _group = group;
+  for (std::string &name: _names) name = prefix + name;
+  for (unsigned channel = 0; channel < n_channels; channel++) Instance(channel);
+  _stream_length_str = std::to_string(stream_length);
+  _report_interval = report_interval;
+  _interval_start = std::chrono::steady_clock::now();
+}
+
+const std::string &tpcAnalysis::MetricBatch::Instance(unsigned channel) {
+  while (_instances.size() <= channel) _instances.push_back(std::to_string(_instances.size()));
+  return _instances[channel];
+}
+
+void tpcAnalysis::MetricBatch::Clear() {
+  _channels.clear();
+  for (auto &column: _columns) column.clear();
+}
+
+void tpcAnalysis::MetricBatch::AddChannel(unsigned channel) {
+  _channels.push_back(channel);
+  for (auto &column: _columns) column.push_back(0.);
+}
+
+void tpcAnalysis::MetricBatch::Send() {
+  int level = 0;
+  for (unsigned metric = 0; metric < _names.size(); metric++) {
+    const std::vector<float> &column = _columns[metric];
+    for (unsigned row = 0; row < _channels.size(); row++) {
+      if (_is_int[metric]) {
+        sbndaq::sendMetric(_group, Instance(_channels[row]), _names[metric], (int)column[row], level, _modes[metric]);
+      }
+      else {
+        sbndaq::sendMetric(_group, Instance(_channels[row]), _names[metric], column[row], level, _modes[metric]);
+      }
+    }
+  }
+}
+
+void tpcAnalysis::MetricBatch::Accumulate() {
+  for (unsigned metric = 0; metric < _names.size(); metric++) {
+    const std::vector<float> &column = _columns[metric];
+    Interval &interval = _intervals[metric];
+    artdaq::MetricMode mode = _modes[metric];
+    for (unsigned row = 0; row < _channels.size(); row++) {
+      unsigned channel = _channels[row];
+      if (channel >= interval.values.size()) {
+        interval.values.resize(channel + 1, 0.);
+        interval.counts.resize(channel + 1, 0);
+      }
+      double value = column[row];
+      double &current = interval.values[channel];
+      unsigned &count = interval.counts[channel];
+      if (count == 0 || mode == artdaq::MetricMode::LastPoint) current = value;
+      else if (mode == artdaq::MetricMode::Minimum) current = std::min(current, value);
+      else if (mode == artdaq::MetricMode::Maximum) current = std::max(current, value);
+      // Accumulate, Average and Rate
+      else current += value;
+      count ++;
+    }
+  }
+}
+
+int tpcAnalysis::MetricBatch::Format(unsigned metric, unsigned channel, double seconds, char *buffer, size_t size) const {
+  const Interval &interval = _intervals[metric];
+  double value = interval.values[channel];
+  artdaq::MetricMode mode = _modes[metric];
+  if (mode == artdaq::MetricMode::Average) {
+    return snprintf(buffer, size, "%.7g", value / interval.counts[channel]);
+  }
+  if (mode == artdaq::MetricMode::Rate) {
+    return snprintf(buffer, size, "%.7g", seconds > 0. ? value / seconds : 0.);
+  }
+  if (_is_int[metric]) {
+    return snprintf(buffer, size, "%lld", (long long)value);
+  }
+  return snprintf(buffer, size, "%.7g", value);
+}
+
+size_t tpcAnalysis::MetricBatch::Append(const char *str, size_t len) {
+  size_t offset = _arg_buffer.size();
+  _arg_buffer.insert(_arg_buffer.end(), str, str + len);
+  _arg_offsets.push_back(offset);
+  _arg_lengths.push_back(len);
+  return offset;
+}
+
+bool tpcAnalysis::MetricBatch::Send(redisContext *context) {
+  Accumulate();
+  auto now = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(now - _interval_start).count();
+  if (seconds < _report_interval) return true;
+  _interval_start = now;
+
+  // each metric goes to a stream named "group:instance:name":
+  // XADD <key> MAXLEN ~ <stream_length> * dat <value>
+  static const char *kXAdd = "XADD";
+  static const char *kMaxLen = "MAXLEN";
+  static const char *kApprox = "~";
+  static const char *kAutoID = "*";
+  static const char *kField = "dat";
+  static const unsigned kNArgs = 8;
+
+  _arg_buffer.clear();
+  _arg_offsets.clear();
+  _arg_lengths.clear();
+  char value_str[32];
+  // lay out all of the keys and values first (the buffer may move as it grows)
+  for (unsigned metric = 0; metric < _names.size(); metric++) {
+    const std::string &name = _names[metric];
+    Interval &interval = _intervals[metric];
+    for (unsigned channel = 0; channel < interval.counts.size(); channel++) {
+      if (interval.counts[channel] == 0) continue;
+      const std::string &instance = Instance(channel);
+      size_t key = Append(_group.data(), _group.size());
+      _arg_buffer.push_back(':');
+      _arg_buffer.insert(_arg_buffer.end(), instance.begin(), instance.end());
+      _arg_buffer.push_back(':');
+      _arg_buffer.insert(_arg_buffer.end(), name.begin(), name.end());
+      _arg_lengths.back() = _arg_buffer.size() - key;
+
+      int len = Format(metric, channel, seconds, value_str, sizeof(value_str));
+      Append(value_str, len);
+      interval.counts[channel] = 0;
+    }
+  }
+
+  // then queue up every command
+  unsigned n_commands = _arg_offsets.size() / 2;
+  const char *argv[kNArgs] = {kXAdd, NULL, kMaxLen, kApprox, _stream_length_str.c_str(), kAutoID, kField, NULL};
+  size_t argv_lengths[kNArgs] = {4, 0, 6, 1, _stream_length_str.size(), 1, 3, 0};
+  for (unsigned i = 0; i < n_commands; i++) {
+    argv[1] = &_arg_buffer[_arg_offsets[2*i]];
+    argv_lengths[1] = _arg_lengths[2*i];
+    argv[7] = &_arg_buffer[_arg_offsets[2*i + 1]];
+    argv_lengths[7] = _arg_lengths[2*i + 1];
+    redisAppendCommandArgv(context, kNArgs, argv, argv_lengths);
+  }
+
+  // and wait for all the replies. The commands are written out on the first read.
+  for (unsigned i = 0; i < n_commands; i++) {
+    void *reply = NULL;
+    if (redisGetReply(context, &reply) != REDIS_OK) {
+      // the rest of the replies are lost with the connection
+      std::cerr << "Warning: failed to send metrics to redis: " << context->errstr << std::endl;
+      return false;
+    }
+    if (((redisReply *)reply)->type == REDIS_REPLY_ERROR) {
+      std::cerr << "Warning: redis error on metric: " << ((redisReply *)reply)->str << std::endl;
+    }
+    freeReplyObject(reply);
+  }
+  return true;
 }
 
 
 class tpcAnalysis::OnlineAnalysis : public art::EDAnalyzer {
 public:
   explicit OnlineAnalysis(fhicl::ParameterSet const & p);
-  // The compiler-generated destructor is fine for non-base
-  // classes without bare pointers or other resource use.
+  // closes the connection used for the pipelined metrics
+  ~OnlineAnalysis();
 
   // Plugins should not be copied or assigned.
   OnlineAnalysis(OnlineAnalysis const &) = delete;
@@ -52,7 +298,15 @@ private:
   void SendWaveforms(const art::Event &e);
   void SendFFTs(const art::Event &e);
   void SendTimeAvgFFTs(const art::Event &e);
+  void SendAvgPowerSpectra(const art::Event &e);
   void SendCorrelationMatrix(const art::Event &e);
+  void SendGroupWaveforms(const art::Event &e);
+  void SendCoherentNoiseMetrics();
+  // hand _snapshot to the publishing thread
+  void PublishSnapshot(const art::Event &e);
+  void SendPublisherMetrics();
+  // send the per-channel metrics straight to redis, reconnecting if needed
+  void SendPipelinedMetrics();
 
   tpcAnalysis::Analysis _analysis;
   double _tick_period;
@@ -66,11 +320,36 @@ private:
   bool _send_dnoise;
   bool _send_peakheight;
   bool _send_occupancy;
+  bool _send_coherent_noise;
   int _n_evt_fft_avg;
   bool _send_metrics;
   int _wait_period;
   int _last_time;
   bool _send_sbnd_metrics;
+  bool _pipelined_metrics;
+
+  // per-channel metrics of each event
+  tpcAnalysis::MetricBatch _metrics;
+  unsigned _rms_metric;
+  unsigned _baseline_metric;
+  unsigned _dnoise_metric;
+  unsigned _peakheight_metric;
+  unsigned _occupancy_metric;
+  unsigned _femb_metric;
+  unsigned _asic_metric;
+  unsigned _chan_metric;
+  unsigned _channel_no_metric;
+  // connection for sending the metrics straight to redis
+  redisContext *_metric_redis;
+  std::string _redis_hostname;
+  int _redis_port;
+  // instance of the metrics of each coherent noise group
+  std::vector<std::string> _group_instances;
+  std::vector<float> _group_waveform_buffer;
+
+  // sends the snapshots from a background thread (if set)
+  std::unique_ptr<tpcAnalysis::SnapshotPublisher> _publisher;
+  tpcAnalysis::snapshot::Snapshot _snapshot;
 
   std::string fMetricPrefix;
   std::string fFFTName;
@@ -81,6 +360,17 @@ private:
   std::string fCorrelationMatrixName;
   unsigned fNCorrelationMatrixSamples;
 
+  // averaged power spectra, sent for a different 1/n_evt_fft_avg of the channels each event
+  bool _avg_power_spectrum;
+  PowerSpectrum::Window fAvgFFTWindow;
+  unsigned fAvgFFTSegmentSize;
+  PowerSpectrum fPowerSpectrum;
+  // sum of the waveforms of each channel and the number summed
+  std::vector<std::vector<float>> fAvgWvfSums;
+  std::vector<unsigned> fAvgWvfCounts;
+  std::vector<float> fAvgSpectrumBuffer;
+  std::vector<float> fAvgWvfBuffer;
+
   // fields used to compute time averaged FFT's
   class {
   public:
@@ -121,6 +411,16 @@ tpcAnalysis::OnlineAnalysis::OnlineAnalysis(fhicl::ParameterSet const & p):
 
   fAvgFFTData.first = true;
 
+  // whether to average the power spectrum of each event instead of the FFT of the averaged waveform
+  _avg_power_spectrum = p.get<bool>("avg_power_spectrum", false);
+  std::string avg_fft_window = p.get<std::string>("avg_fft_window", "none");
+  if (!PowerSpectrum::ParseWindow(avg_fft_window, fAvgFFTWindow)) {
+    std::cerr << "Warning: unknown avg_fft_window (" << avg_fft_window << "), using none" << std::endl;
+    fAvgFFTWindow = PowerSpectrum::kRectangular;
+  }
+  // segment size for Welch's method. 0 means the whole waveform
+  fAvgFFTSegmentSize = p.get<unsigned>("avg_fft_segment_size", 0);
+
   fMetricPrefix = p.get<std::string>("metric_prefix", "");
   fFFTName = p.get<std::string>("fft_name", "fft");
   fGroupName = p.get<std::string>("group_name", "tpc_channel");
@@ -137,6 +437,39 @@ tpcAnalysis::OnlineAnalysis::OnlineAnalysis(fhicl::ParameterSet const & p):
   _send_dnoise = p.get<bool>("send_dnoise", true);
   _send_peakheight = p.get<bool>("send_peakheight", true);
   _send_occupancy = p.get<bool>("send_occupancy", true);
+  // whether to send the coherent noise of each group of channels (see coherent_noise_groups)
+  _send_coherent_noise = p.get<bool>("send_coherent_noise", false);
+  for (auto const &group: _analysis.CoherentNoiseGroups()) {
+    _group_instances.push_back("group_" + std::to_string(group.lo) + "_" + std::to_string(group.hi));
+  }
+
+  // make the names of every metric up front
+  artdaq::MetricMode mode = artdaq::MetricMode::Average;
+  if (_send_rms) _rms_metric = _metrics.AddMetric("rms", mode);
+  if (_send_baseline) _baseline_metric = _metrics.AddMetric("baseline", mode);
+  if (_send_dnoise) _dnoise_metric = _metrics.AddMetric("next_channel_dnoise", mode);
+  if (_send_peakheight) _peakheight_metric = _metrics.AddMetric("mean_peak_height", mode);
+  if (_send_occupancy) _occupancy_metric = _metrics.AddMetric("occupancy", mode);
+  if (_send_sbnd_metrics) {
+    _femb_metric = _metrics.AddMetric("baseline_femb", artdaq::MetricMode::LastPoint, true);
+    _asic_metric = _metrics.AddMetric("baseline_asic", artdaq::MetricMode::LastPoint, true);
+    _chan_metric = _metrics.AddMetric("baseline_chan", artdaq::MetricMode::LastPoint, true);
+    _channel_no_metric = _metrics.AddMetric("baseline_channel_no", artdaq::MetricMode::LastPoint, true);
+  }
+  _metrics.Setup(fGroupName, fMetricPrefix, _analysis._channel_info.NChannels(), p.get<unsigned>("metric_stream_length", 1000),
+                 p.get<double>("metric_report_interval", 15. /* s */));
+
+  // whether to send metrics straight to redis instead of through the metric manager
+  _pipelined_metrics = p.get<bool>("pipelined_metrics", false);
+  _redis_hostname = p.get<std::string>("redis_hostname", "localhost");
+  _redis_port = p.get<int>("redis_port", 6379);
+  _metric_redis = NULL;
+
+  // whether to send the snapshots from a background thread, so a slow redis doesn't hold up the event loop
+  if (p.get<bool>("async_snapshots", false)) {
+    _publisher.reset(new tpcAnalysis::SnapshotPublisher(p.get<std::string>("redis_hostname", "localhost"), p.get<int>("redis_port", 6379),
+                                                        p.get<unsigned>("snapshot_queue_size", 4096)));
+  }
 
   event_ind = 0;
 }
@@ -162,6 +495,8 @@ void tpcAnalysis::OnlineAnalysis::analyze(art::Event const & e) {
   if (_send_sparse_waveforms) SendSparseWaveforms(e);
  
   if (_send_waveforms && event_ind % _n_evt_send_rawdata == 0) SendWaveforms(e);
+
+  if (_send_waveforms && _send_coherent_noise && event_ind % _n_evt_send_rawdata == 0) SendGroupWaveforms(e);
   
   if (_send_ffts && event_ind % _n_evt_send_rawdata == 0) SendFFTs(e);
 
@@ -169,77 +504,156 @@ void tpcAnalysis::OnlineAnalysis::analyze(art::Event const & e) {
 
   // Save metrics
   if (_send_metrics) {
-    int level = 0;
-    artdaq::MetricMode mode = artdaq::MetricMode::Average;
-    // send the metrics
+    _metrics.Clear();
     for (auto const &channel_data: _analysis._per_channel_data) {
-      float value;
-      std::string instance = std::to_string(channel_data.channel_no);
-
       // don't send empty metrics
       if (channel_data.empty) continue;
-      
-      value = channel_data.rms;
-      if (_send_rms)
-        sbndaq::sendMetric(fGroupName, instance, fMetricPrefix + "rms", value, level, mode);
-
-      value = channel_data.baseline;
-      if (_send_baseline)
-        sbndaq::sendMetric(fGroupName, instance, fMetricPrefix + "baseline", value, level, mode);
 
-      value = channel_data.next_channel_dnoise;
-      if (_send_dnoise)
-        sbndaq::sendMetric(fGroupName, instance, fMetricPrefix + "next_channel_dnoise", value, level, mode);
+      _metrics.AddChannel(channel_data.channel_no);
 
-      value = channel_data.mean_peak_height;
-      if (_send_peakheight)
-        sbndaq::sendMetric(fGroupName, instance, fMetricPrefix + "mean_peak_height", value, level, mode);
-
-      value = channel_data.occupancy;
-      if (_send_occupancy)
-        sbndaq::sendMetric(fGroupName, instance, fMetricPrefix + "occupancy", value, level, mode);
+      if (_send_rms) _metrics.Fill(_rms_metric, channel_data.rms);
+      if (_send_baseline) _metrics.Fill(_baseline_metric, channel_data.baseline);
+      if (_send_dnoise) _metrics.Fill(_dnoise_metric, channel_data.next_channel_dnoise);
+      if (_send_peakheight) _metrics.Fill(_peakheight_metric, channel_data.mean_peak_height);
+      if (_send_occupancy) _metrics.Fill(_occupancy_metric, channel_data.occupancy);
 
       if (_send_sbnd_metrics) {
 	// compute the encoded femb/asic/channel #'s from the baseline
 	int femb = (channel_data.baseline >> 8) & 0xF;
-	sbndaq::sendMetric(fGroupName, instance, fMetricPrefix + "baseline_femb", femb, level, artdaq::MetricMode::LastPoint);
+	_metrics.Fill(_femb_metric, femb);
 	
 	int asic = (channel_data.baseline >> 4) & 0xF;
-	sbndaq::sendMetric(fGroupName, instance, fMetricPrefix + "baseline_asic", asic, level, artdaq::MetricMode::LastPoint);
+	_metrics.Fill(_asic_metric, asic);
 	
 	int chan = channel_data.baseline & 0xF;
-	sbndaq::sendMetric(fGroupName, instance, fMetricPrefix + "baseline_chan", chan, level, artdaq::MetricMode::LastPoint);
+	_metrics.Fill(_chan_metric, chan);
         
         int ch_offset = 0;
         if (chan <= 7) ch_offset = 7 - chan;
         else ch_offset = 8 + 15  - chan;
         int channel_number = 128*femb + 16*asic + ch_offset; 
 
-        sbndaq::sendMetric(fGroupName, instance, fMetricPrefix + "baseline_channel_no", channel_number, level, artdaq::MetricMode::LastPoint);
+        _metrics.Fill(_channel_no_metric, channel_number);
 
       }
 
     }
+
+    // send the metrics
+    if (_pipelined_metrics) SendPipelinedMetrics();
+    else _metrics.Send();
+
+    if (_publisher) SendPublisherMetrics();
+
+    if (_send_coherent_noise) SendCoherentNoiseMetrics();
+  }
+}
+
+tpcAnalysis::OnlineAnalysis::~OnlineAnalysis() {
+  if (_metric_redis) redisFree(_metric_redis);
+}
+
+void tpcAnalysis::OnlineAnalysis::SendPipelinedMetrics() {
+  // (re)connect: a context that failed is never used again
+  if (!_metric_redis) {
+    _metric_redis = sbndaq::Connect2Redis(_redis_hostname, _redis_port);
+    if (_metric_redis && _metric_redis->err) {
+      std::cerr << "Warning: failed to connect to redis for metrics: " << _metric_redis->errstr << std::endl;
+      redisFree(_metric_redis);
+      _metric_redis = NULL;
+    }
+    if (!_metric_redis) return;
+  }
+  if (!_metrics.Send(_metric_redis)) {
+    redisFree(_metric_redis);
+    _metric_redis = NULL;
   }
 }
 
+void tpcAnalysis::OnlineAnalysis::PublishSnapshot(const art::Event &e) {
+  _snapshot.SetEvent(e.run(), e.subRun(), e.event());
+  _publisher->Publish(_snapshot);
+}
+
+void tpcAnalysis::OnlineAnalysis::SendPublisherMetrics() {
+  int level = 3;
+  tpcAnalysis::SnapshotPublisher::Stats stats = _publisher->GetStats();
+  std::string instance = "snapshot_publisher";
+  sbndaq::sendMetric(fGroupName, instance, "queue_depth", (int)stats.queue_depth, level, artdaq::MetricMode::LastPoint);
+  sbndaq::sendMetric(fGroupName, instance, "n_dropped", (int)stats.n_dropped, level, artdaq::MetricMode::LastPoint);
+  sbndaq::sendMetric(fGroupName, instance, "n_coalesced", (int)stats.n_coalesced, level, artdaq::MetricMode::LastPoint);
+  sbndaq::sendMetric(fGroupName, instance, "n_failed", (int)stats.n_failed, level, artdaq::MetricMode::LastPoint);
+  sbndaq::sendMetric(fGroupName, instance, "flush_latency", stats.flush_latency, level, artdaq::MetricMode::Average);
+}
+
 void tpcAnalysis::OnlineAnalysis::SendCorrelationMatrix(const art::Event &e) {
   std::vector<float> matrix = _analysis.CorrelationMatrix(fNCorrelationMatrixSamples);
+  // channel of each row/column, so a subset of the channels can be mapped back
+  // (as floats, which hold any channel number exactly)
+  const std::vector<unsigned> &channels = _analysis.CorrelationChannels();
+  std::vector<float> channel_list(channels.begin(), channels.end());
   std::string redis_key = "snapshot:" + fCorrelationMatrixName;
+  std::string channels_key = redis_key + ":channels";
+  if (_publisher) {
+    _snapshot.SetFloats(redis_key, matrix.data(), matrix.size(), 1., false);
+    PublishSnapshot(e);
+    _snapshot.SetFloats(channels_key, channel_list.data(), channel_list.size(), 1., false);
+    PublishSnapshot(e);
+    return;
+  }
   sbndaq::SendWaveform(redis_key, matrix);
   sbndaq::SendEventMeta(redis_key, e);
+  sbndaq::SendWaveform(channels_key, channel_list);
+  sbndaq::SendEventMeta(channels_key, e);
 }
 
 void tpcAnalysis::OnlineAnalysis::SendWaveforms(const art::Event &e) {
   for (auto const& digits: _analysis._raw_digits_handle) {
     const std::vector<int16_t> &adcs = digits->ADCs();
      std::string redis_key = "snapshot:" + fWaveformName + ":wire:" + std::to_string(digits->Channel());
+     if (_publisher) {
+       _snapshot.SetWaveform(redis_key, adcs.data(), adcs.size(), _tick_period, snapshot::kRaw);
+       PublishSnapshot(e);
+       continue;
+     }
      sbndaq::SendWaveform(redis_key, adcs, _tick_period /* tick period in us */);
      sbndaq::SendEventMeta(redis_key, e); 
   }
 }
 
+void tpcAnalysis::OnlineAnalysis::SendGroupWaveforms(const art::Event &e) {
+  auto const &groups = _analysis.CoherentNoiseGroups();
+  for (unsigned i = 0; i < groups.size(); i++) {
+    if (groups[i].n_channels == 0) continue;
+    // the sum can overflow an int16_t, so it is sent as floats
+    _group_waveform_buffer.assign(groups[i].waveform.begin(), groups[i].waveform.end());
+    std::string redis_key = "snapshot:" + fWaveformName + ":" + _group_instances[i];
+    if (_publisher) {
+      _snapshot.SetFloats(redis_key, _group_waveform_buffer.data(), _group_waveform_buffer.size(), _tick_period, false);
+      PublishSnapshot(e);
+      continue;
+    }
+    sbndaq::SendWaveform(redis_key, _group_waveform_buffer, _tick_period);
+    sbndaq::SendEventMeta(redis_key, e);
+  }
+}
+
+void tpcAnalysis::OnlineAnalysis::SendCoherentNoiseMetrics() {
+  int level = 3;
+  auto const &groups = _analysis.CoherentNoiseGroups();
+  for (unsigned i = 0; i < groups.size(); i++) {
+    // need at least two channels with noise in common
+    if (groups[i].n_channels < 2 || groups[i].n_samples == 0) continue;
+    sbndaq::sendMetric(fGroupName, _group_instances[i], fMetricPrefix + "sum_rms", groups[i].sum_rms, level, artdaq::MetricMode::Average);
+    sbndaq::sendMetric(fGroupName, _group_instances[i], fMetricPrefix + "scaled_sum_rms", groups[i].scaled_sum_rms, level, artdaq::MetricMode::Average);
+  }
+}
+
 void tpcAnalysis::OnlineAnalysis::SendTimeAvgFFTs(const art::Event &e) {
+  if (_avg_power_spectrum) {
+    SendAvgPowerSpectra(e);
+    return;
+  }
 
   // first time setup -- set the size of each waveform
   if (fAvgFFTData.first) {
@@ -280,10 +694,17 @@ void tpcAnalysis::OnlineAnalysis::SendTimeAvgFFTs(const art::Event &e) {
 
       // send it out
       std::string redis_key = "snapshot:" + fAvgFFTName + ":wire:" + std::to_string(i);
+      std::string redis_key_wvf = "snapshot:" + fAvgWvfName + ":wire:" + std::to_string(i);
+      if (_publisher) {
+        _snapshot.SetFloats(redis_key, fft.data(), fft.size(), 1./_tick_period, false);
+        PublishSnapshot(e);
+        _snapshot.SetFloats(redis_key_wvf, fAvgFFTData.waveforms[i].data(), fAvgFFTData.waveforms[i].size(), _tick_period, false);
+        PublishSnapshot(e);
+        continue;
+      }
       sbndaq::SendWaveform(redis_key, fft, 1./_tick_period /* tick freq. in MHz */);
       sbndaq::SendEventMeta(redis_key, e); 
 
-      std::string redis_key_wvf = "snapshot:" + fAvgWvfName + ":wire:" + std::to_string(i);
       sbndaq::SendWaveform(redis_key_wvf, fAvgFFTData.waveforms[i], _tick_period); 
       sbndaq::SendEventMeta(redis_key_wvf, e);
     }
@@ -304,10 +725,81 @@ void tpcAnalysis::OnlineAnalysis::SendTimeAvgFFTs(const art::Event &e) {
 
 }
 
+void tpcAnalysis::OnlineAnalysis::SendAvgPowerSpectra(const art::Event &e) {
+  unsigned n_channels = _analysis._channel_info.NChannels();
+  // first time setup
+  if (fPowerSpectrum.NChannels() == 0) {
+    if (_analysis._raw_digits_handle.empty()) return;
+    unsigned n_ticks = _analysis._raw_digits_handle[0]->NADC();
+    unsigned segment_size = fAvgFFTSegmentSize ? std::min(fAvgFFTSegmentSize, n_ticks) : n_ticks;
+    segment_size -= segment_size % 2;
+    if (segment_size == 0) return;
+    fPowerSpectrum.Configure(n_channels, segment_size, fAvgFFTWindow);
+    fAvgWvfSums.assign(n_channels, std::vector<float>(n_ticks, 0.));
+    fAvgWvfCounts.assign(n_channels, 0);
+    fAvgSpectrumBuffer.resize(fPowerSpectrum.OutputSize());
+    fAvgWvfBuffer.resize(n_ticks);
+  }
+
+  // add this event to the sums
+  // (in channel order, so rows of the waveform matrix are read in order)
+  for (unsigned channel = 0; channel < n_channels; channel++) {
+    ADCView adcs = _analysis._waveforms[channel];
+    if (adcs.empty()) continue;
+    int16_t baseline = 0;
+    if (!_analysis._per_channel_data[channel].empty) {
+      baseline = _analysis._per_channel_data[channel].baseline;
+    }
+    fPowerSpectrum.Add(channel, adcs.data(), adcs.size(), baseline);
+
+    std::vector<float> &sum = fAvgWvfSums[channel];
+    size_t n = std::min(sum.size(), adcs.size());
+    for (size_t i = 0; i < n; i++) sum[i] += adcs[i];
+    fAvgWvfCounts[channel] ++;
+  }
+  fPowerSpectrum.Flush();
+
+  // Send out a different set of channels each event, each with the
+  // last n_evt_fft_avg events, so that sending doesn't all land on one event
+  for (unsigned channel = event_ind % _n_evt_fft_avg; channel < n_channels; channel += _n_evt_fft_avg) {
+    if (fAvgWvfCounts[channel] == 0) continue;
+
+    fPowerSpectrum.Spectrum(channel, fAvgSpectrumBuffer.data());
+    std::vector<float> &sum = fAvgWvfSums[channel];
+    for (size_t i = 0; i < sum.size(); i++) {
+      fAvgWvfBuffer[i] = sum[i] / fAvgWvfCounts[channel];
+    }
+
+    std::string redis_key = "snapshot:" + fAvgFFTName + ":wire:" + std::to_string(channel);
+    std::string redis_key_wvf = "snapshot:" + fAvgWvfName + ":wire:" + std::to_string(channel);
+    if (_publisher) {
+      _snapshot.SetFloats(redis_key, fAvgSpectrumBuffer.data(), fAvgSpectrumBuffer.size(), 1./_tick_period, false);
+      PublishSnapshot(e);
+      _snapshot.SetFloats(redis_key_wvf, fAvgWvfBuffer.data(), fAvgWvfBuffer.size(), _tick_period, false);
+      PublishSnapshot(e);
+    }
+    else {
+      sbndaq::SendWaveform(redis_key, fAvgSpectrumBuffer, 1./_tick_period /* tick freq. in MHz */);
+      sbndaq::SendEventMeta(redis_key, e);
+      sbndaq::SendWaveform(redis_key_wvf, fAvgWvfBuffer, _tick_period);
+      sbndaq::SendEventMeta(redis_key_wvf, e);
+    }
+
+    fPowerSpectrum.Reset(channel);
+    std::fill(sum.begin(), sum.end(), 0.);
+    fAvgWvfCounts[channel] = 0;
+  }
+}
+
 void tpcAnalysis::OnlineAnalysis::SendFFTs(const art::Event &e) {
   for (const ChannelData &chan: _analysis._per_channel_data) {
     if (chan.fft_mag.size()) {
       std::string redis_key = "snapshot:"+ fFFTName + ":wire:" + std::to_string(chan.channel_no);
+      if (_publisher) {
+        _snapshot.SetFloats(redis_key, chan.fft_mag.data(), chan.fft_mag.size(), 1./_tick_period, false);
+        PublishSnapshot(e);
+        continue;
+      }
       sbndaq::SendWaveform(redis_key, chan.fft_mag, 1./_tick_period /* tick freq. in MHz */);
       sbndaq::SendEventMeta(redis_key, e); 
     }
@@ -324,6 +816,11 @@ void tpcAnalysis::OnlineAnalysis::SendSparseWaveforms(const art::Event &e) {
     // empty channel -- jsut reset the waveform and continue
     if (data.empty) {
       std::string key = "snapshot:sparse_waveform:wire:" + std::to_string(channel);
+      if (_publisher) {
+        _snapshot.SetSplitWaveform(key, sparse_waveforms, offsets, _tick_period);
+        PublishSnapshot(e);
+        continue;
+      }
       sbndaq::SendSplitWaveform(key, sparse_waveforms, offsets, _tick_period);
       sbndaq::SendEventMeta(key, e); 
       continue;
@@ -359,6 +856,11 @@ void tpcAnalysis::OnlineAnalysis::SendSparseWaveforms(const art::Event &e) {
       }
     }
     std::string key = "snapshot:sparse_waveform:wire:" + std::to_string(data.channel_no);
+    if (_publisher) {
+      _snapshot.SetSplitWaveform(key, sparse_waveforms, offsets, _tick_period);
+      PublishSnapshot(e);
+      continue;
+    }
     sbndaq::SendSplitWaveform(key, sparse_waveforms, offsets, _tick_period); 
     sbndaq::SendEventMeta(key, e); 
   } 
@@ -14,6 +14,7 @@
 #include "PeakFinder.hh"
 #include "Noise.hh"
 #include "Analysis.hh"
+#include "SIMD.hh"
 
 using namespace tpcAnalysis;
 
@@ -25,6 +26,28 @@ inline bool doMatchPeaks(PeakFinder::plane_type plane) {
   return plane == PeakFinder::induction;
 }
 
+// The ADC values [lo, hi] that are neither above baseline + threshold nor
+// (if looking for down peaks) below baseline - threshold. For an integer x,
+// x > t is x > floor(t) and x < t is x < ceil(t), so this picks out the same
+// samples as the float comparisons in FindPeaks(). Returns false if the band
+// doesn't fit in 16 bits (i.e. every sample is past the threshold).
+bool thresholdBand(int16_t baseline, float threshold, bool down_peaks, int16_t &lo, int16_t &hi) {
+  float up = baseline + threshold;
+  float down = baseline - threshold;
+  lo = INT16_MIN;
+  hi = INT16_MAX;
+  // a nan threshold never compares true
+  if (std::isnan(threshold)) return true;
+
+  if (up < INT16_MIN) return false;
+  if (up < INT16_MAX) hi = std::floor(up);
+  if (down_peaks) {
+    if (down > INT16_MAX) return false;
+    if (down > INT16_MIN) lo = std::ceil(down);
+  }
+  return true;
+}
+
 PeakFinder::PeakFinder(const std::vector<art::Ptr<recob::Hit> > &hits) {
   //Creates peak objects used for the gettting the channel info by using the hits found using RawHitFinder.                                
   for(std::vector<art::Ptr<recob::Hit> >::const_iterator hit_iter=hits.begin(); hit_iter!=hits.end(); ++hit_iter){
@@ -45,24 +68,65 @@ PeakFinder::PeakFinder(const std::vector<art::Ptr<recob::Hit> > &hits) {
 
 }
 
-PeakFinder::PeakFinder(std::vector<int16_t> &inp_waveform, int16_t baseline, float threshold, unsigned n_smoothing_samples, unsigned n_above_threshold, plane_type plane ) {
+PeakFinder::PeakFinder(ADCView inp_waveform, int16_t baseline, float threshold, unsigned n_smoothing_samples, unsigned n_above_threshold, plane_type plane ) {
+  Find(inp_waveform, baseline, threshold, n_smoothing_samples, n_above_threshold, plane);
+}
+
+PeakFinder::PeakFinder(ADCView inp_waveform, ADCView smoothed_waveform, int16_t baseline, float threshold, unsigned n_smoothing_samples, unsigned n_above_threshold, plane_type plane ) {
+  Find(inp_waveform, smoothed_waveform, baseline, threshold, n_smoothing_samples, n_above_threshold, plane);
+}
+
+void PeakFinder::Find(ADCView inp_waveform, int16_t baseline, float threshold, unsigned n_smoothing_samples, unsigned n_above_threshold, plane_type plane ) {
   // number of smoothing samples must be odd to make sense
   assert(n_smoothing_samples % 2 == 1);
 
   // smooth out input waveform if need be
   if (n_smoothing_samples > 1) {
-    unsigned smoothing_per_direction = n_smoothing_samples / 2;
-    for (unsigned i = smoothing_per_direction; i < inp_waveform.size() - smoothing_per_direction; i++) {
-      unsigned begin = i - smoothing_per_direction;
-      unsigned end = i + smoothing_per_direction + 1;
-      int16_t average = std::accumulate(inp_waveform.begin() + begin, inp_waveform.begin() + end, 0.0) / n_smoothing_samples;
-      
-      _smoothed_waveform.push_back(average); 
-    } 
+    Smooth(inp_waveform, n_smoothing_samples, _smoothed_waveform);
   }
 
   // use the smoothed waveform or the passed in waveform
-  std::vector<int16_t> *waveform = (n_smoothing_samples > 1) ? &_smoothed_waveform : &inp_waveform;
+  ADCView waveform = (n_smoothing_samples > 1) ? ADCView(_smoothed_waveform) : inp_waveform;
+  FindPeaks(inp_waveform, waveform, baseline, threshold, n_smoothing_samples, n_above_threshold, plane);
+}
+
+void PeakFinder::Find(ADCView inp_waveform, ADCView smoothed_waveform, int16_t baseline, float threshold, unsigned n_smoothing_samples, unsigned n_above_threshold, plane_type plane ) {
+  assert(n_smoothing_samples % 2 == 1);
+  ADCView waveform = (n_smoothing_samples > 1) ? smoothed_waveform : inp_waveform;
+  FindPeaks(inp_waveform, waveform, baseline, threshold, n_smoothing_samples, n_above_threshold, plane);
+}
+
+void PeakFinder::Smooth(ADCView waveform, unsigned n_smoothing_samples, std::vector<int16_t> &smoothed) {
+  if (waveform.size() < n_smoothing_samples) {
+    smoothed.clear();
+    return;
+  }
+  smoothed.resize(waveform.size() + 1 - n_smoothing_samples);
+  // keep a running sum over the window. Integer division truncates towards
+  // zero, same as converting the average as a double.
+  const int n = n_smoothing_samples;
+  int sum = 0;
+  for (int i = 0; i < n - 1; i++) sum += waveform[i];
+  for (unsigned i = n - 1; i < waveform.size(); i++) {
+    sum += waveform[i];
+    smoothed[i + 1 - n] = sum / n;
+    sum -= waveform[i + 1 - n];
+  }
+}
+
+unsigned PeakFinder::NextOutside(unsigned i, unsigned n) const {
+  size_t word_index = i / 64;
+  uint64_t word = _outside[word_index] & (~(uint64_t)0 << (i % 64));
+  while (word == 0) {
+    if (++word_index == _outside.size()) return n;
+    word = _outside[word_index];
+  }
+  return std::min(word_index * 64 + __builtin_ctzll(word), (size_t)n);
+}
+
+void PeakFinder::FindPeaks(ADCView inp_waveform, ADCView waveform, int16_t baseline, float threshold, 
+    unsigned n_smoothing_samples, unsigned n_above_threshold, plane_type plane) {
+  _peaks.clear();
 
   // iterate through smoothed samples
   bool inside_peak = false;
@@ -72,8 +136,29 @@ PeakFinder::PeakFinder(std::vector<int16_t> &inp_waveform, int16_t baseline, flo
   // keep track of how many points above threshold
   unsigned n_points = 0;
 
-  for (unsigned i = 0; i < waveform->size(); i++) {
-    int16_t dat = (*waveform)[i];
+  // mark the samples past the threshold up front. Outside of a peak, the
+  // samples in between only reset the count of points above threshold, so
+  // the loop can jump right over them.
+  unsigned n = waveform.size();
+  _outside.resize((n + 63) / 64);
+  int16_t lo, hi;
+  if (thresholdBand(baseline, threshold, fitDownPeak(plane), lo, hi)) {
+    simd::OutsideBand(waveform.data(), n, lo, hi, _outside.data());
+  }
+  else {
+    std::fill(_outside.begin(), _outside.end(), ~(uint64_t)0);
+  }
+
+  for (unsigned i = 0; i < n; i++) {
+    if (!inside_peak) {
+      unsigned next = NextOutside(i, n);
+      if (next != i) {
+        n_points = 0;
+        i = next;
+        if (i == n) break;
+      }
+    }
+    int16_t dat = waveform[i];
     // detect a new peak, or continue on the current one
 
     // up-peak
@@ -137,8 +222,8 @@ PeakFinder::PeakFinder(std::vector<int16_t> &inp_waveform, int16_t baseline, flo
     // process it and set up the next one
     else if (inside_peak) {
       inside_peak = false;
-      peak = FinishPeak(peak, waveform, n_smoothing_samples, baseline, up_peak, i);
-      _peaks.emplace_back(peak);
+      FinishPeak(peak, waveform, n_smoothing_samples, baseline, up_peak, i);
+      _peaks.push_back(peak);
       peak = PeakFinder::Peak();
     }
     else { 
@@ -149,8 +234,8 @@ PeakFinder::PeakFinder(std::vector<int16_t> &inp_waveform, int16_t baseline, flo
   }
   // finish peak if we're inside one at the end
   if (inside_peak) {
-    peak = FinishPeak(peak, waveform, n_smoothing_samples, baseline, up_peak, waveform->size()-1);
-    _peaks.emplace_back(peak);
+    FinishPeak(peak, waveform, n_smoothing_samples, baseline, up_peak, waveform.size()-1);
+    _peaks.push_back(peak);
   }
 
   // match peaks
@@ -161,14 +246,14 @@ PeakFinder::PeakFinder(std::vector<int16_t> &inp_waveform, int16_t baseline, flo
 }
 
 
-PeakFinder::Peak PeakFinder::FinishPeak(PeakFinder::Peak peak, std::vector<int16_t> *waveform, unsigned n_smoothing_samples, int16_t baseline, bool up_peak, unsigned index) {
+void PeakFinder::FinishPeak(PeakFinder::Peak &peak, ADCView waveform, unsigned n_smoothing_samples, int16_t baseline, bool up_peak, unsigned index) {
   peak.end_tight = index;
   // find the upper and lower bounds to determine the max width
   peak.start_loose = peak.start_tight;
   unsigned n_at_baseline = 0;
   while (peak.start_loose > 0) {
-    if ((up_peak && (*waveform)[peak.start_loose] <= baseline) ||
-       (!up_peak && (*waveform)[peak.start_loose] >= baseline)) {
+    if ((up_peak && waveform[peak.start_loose] <= baseline) ||
+       (!up_peak && waveform[peak.start_loose] >= baseline)) {
 
       n_at_baseline ++;
     }
@@ -185,9 +270,9 @@ PeakFinder::Peak PeakFinder::FinishPeak(PeakFinder::Peak peak, std::vector<int16
   // now find upper bound on end
   peak.end_loose = peak.end_tight;
   n_at_baseline = 0;
-  while (peak.end_loose < waveform->size()-1) {
-    if ((up_peak && (*waveform)[peak.end_loose] <= baseline) ||
-       (!up_peak && (*waveform)[peak.end_loose] >= baseline)) {
+  while (peak.end_loose < waveform.size()-1) {
+    if ((up_peak && waveform[peak.end_loose] <= baseline) ||
+       (!up_peak && waveform[peak.end_loose] >= baseline)) {
       n_at_baseline ++;
     }
     if (n_at_baseline > 2) {
@@ -196,13 +281,13 @@ PeakFinder::Peak PeakFinder::FinishPeak(PeakFinder::Peak peak, std::vector<int16
     peak.end_loose ++;
   }
   // set end_loose such that it isn't under the influence of any points inside peak
-  peak.end_loose = std::min(peak.end_loose + n_smoothing_samples/2, (unsigned)waveform->size()-1);
-  return peak;
+  peak.end_loose = std::min(peak.end_loose + n_smoothing_samples/2, (unsigned)waveform.size()-1);
 }
 
 // match up peak - down peak pairs for induction planes
 void PeakFinder::matchPeaks(unsigned match_range) {
-  std::vector<PeakFinder::Peak> pruned_peaks;
+  // prune the peaks in place: pairs are only ever written at or before where they are read
+  unsigned n_pruned = 0;
 
   bool last_was_up_peak = false;
   for (unsigned i = 0; i < _peaks.size(); i++) {
@@ -212,14 +297,14 @@ void PeakFinder::matchPeaks(unsigned match_range) {
       if ((i > 0) &&
           ((_peaks[i].start_loose < _peaks[i-1].end_loose) ||
            (_peaks[i].start_loose - _peaks[i-1].end_loose < match_range))) {
-        pruned_peaks.push_back(_peaks[i-1]);
-        pruned_peaks.push_back(_peaks[i]);
+        _peaks[n_pruned++] = _peaks[i-1];
+        _peaks[n_pruned++] = _peaks[i];
       }
     }
     last_was_up_peak = _peaks[i].is_up;
   }
   // set the peaks to the pruned version
-  _peaks = pruned_peaks;
+  _peaks.resize(n_pruned);
 }
 
 // Print for debugging purposes
@@ -239,7 +324,7 @@ std::string PeakFinder::Peak::Print() const {
 
 
 // Calculate the threshold by fitting a gaussian to a histogram of ADC values from the waveform
-Threshold::Threshold(std::vector<int16_t> &waveform, int16_t baseline, float n_sigma, bool verbose) {
+Threshold::Threshold(ADCView waveform, int16_t baseline, float n_sigma, bool verbose) {
   int16_t min = *std::min_element(waveform.begin(), waveform.end());
   int16_t max = *std::max_element(waveform.begin(), waveform.end());
   size_t length = waveform.size();
@@ -274,20 +359,149 @@ Threshold::Threshold(std::vector<int16_t> &waveform, int16_t baseline, float n_s
   _threshold = baseline + n_sigma*fit.GetParameter(2);
 }
 
+namespace {
+// fraction of the variance of a gaussian left after cutting it off at +/- c sigma
+double TruncatedVariance(double c) {
+  double phi = exp(-0.5 * c * c) / sqrt(2. * M_PI);
+  return 1. - 2. * c * phi / erf(c / M_SQRT2);
+}
+
+// derivative of TruncatedVariance() with respect to c
+double TruncatedVarianceDerivative(double c) {
+  double phi = exp(-0.5 * c * c) / sqrt(2. * M_PI);
+  double p = erf(c / M_SQRT2);
+  return -(2. * phi * (1. - c * c) / p - 4. * c * phi * phi / (p * p));
+}
+} // namespace
+
+namespace {
+// moments of the values with bin centers in [lo, hi] (relative to the center
+// of the histogram). Returns the half-width of the bins included.
+template<typename T>
+float WindowMoments(const T *hist, int filled_lo, int filled_hi, int center, float lo, float hi, double &mean, double &variance) {
+  int first = std::max(filled_lo, (int)std::ceil(lo) + center);
+  int last = std::min(filled_hi, (int)std::floor(hi) + center);
+  double n = 0, sum = 0, sum2 = 0;
+  for (int bin = first; bin <= last; bin++) {
+    double x = bin - center;
+    n += hist[bin];
+    sum += hist[bin] * x;
+    sum2 += hist[bin] * x * x;
+  }
+  if (n == 0) {
+    mean = 0;
+    variance = 0;
+    return 0;
+  }
+  mean = sum / n;
+  variance = sum2 / n - mean * mean;
+  // each bin covers +/- 0.5 around its value
+  return 0.5 * (last - first + 1);
+}
+} // namespace
+
+template<typename T>
+float tpcAnalysis::RobustSigma(const T *hist, int lo, int hi, int center, double n_below, double n_total, float &mean) {
+  mean = 0.;
+  if (n_total <= 0.) return 0.;
+
+  // quartiles, interpolating inside of each bin
+  std::array<double, 3> quantiles {{0.25, 0.5, 0.75}};
+  std::array<double, 3> values {{(double)-center, (double)-center, (double)-center}};
+  double cumulative = n_below;
+  unsigned i_quantile = 0;
+  for (int bin = lo; bin <= hi && i_quantile < quantiles.size(); bin++) {
+    double count = hist[bin];
+    while (i_quantile < quantiles.size() && cumulative + count >= quantiles[i_quantile] * n_total) {
+      values[i_quantile] = (bin - center) - 0.5 + (quantiles[i_quantile] * n_total - cumulative) / count;
+      i_quantile ++;
+    }
+    cumulative += count;
+  }
+  for (; i_quantile < quantiles.size(); i_quantile++) values[i_quantile] = center;
+
+  double median = values[1];
+  double sigma = (values[2] - values[0]) / 1.34898;
+
+  // refine from the variance inside of the window around the median. The
+  // window is set from the last estimate, so go around twice.
+  for (unsigned pass = 0; pass < 2 && sigma > 0.; pass++) {
+    double window = std::max(RobustThreshold::kWindow * sigma, 1.5);
+    double window_mean, variance;
+    double half_width = WindowMoments(hist, lo, hi, center, median - window, median + window, window_mean, variance);
+    mean = window_mean;
+    // remove the variance added by rounding to whole ADC counts (Sheppard's correction)
+    variance -= 1. / 12.;
+    if (variance <= 0. || half_width <= 0.) {
+      sigma = 0.;
+      break;
+    }
+    // solve sigma^2 * TruncatedVariance(half_width / sigma) == variance
+    sigma = sqrt(variance / TruncatedVariance(half_width / sigma));
+    for (unsigned i = 0; i < 4; i++) {
+      double c = half_width / sigma;
+      double f = sigma * sigma * TruncatedVariance(c) - variance;
+      double df = 2. * sigma * TruncatedVariance(c) - half_width * TruncatedVarianceDerivative(c);
+      if (df <= 0.) break;
+      double step = f / df;
+      sigma -= step;
+      if (sigma <= 0. || std::isnan(sigma)) {
+        sigma = sqrt(variance);
+        break;
+      }
+      if (fabs(step) < 1e-4 * sigma) break;
+    }
+  }
+  return sigma;
+}
+
+template float tpcAnalysis::RobustSigma<unsigned>(const unsigned *, int, int, int, double, double, float &);
+template float tpcAnalysis::RobustSigma<float>(const float *, int, int, int, double, double, float &);
+
+float RobustThreshold::Sigma(ADCView waveform, int16_t baseline) {
+  _mean = 0.;
+  if (waveform.empty()) return 0.;
+
+  // histogram the values around the baseline
+  unsigned n_below = 0;
+  int lo = 2 * kHalfRange;
+  int hi = -1;
+  for (int16_t dat: waveform) {
+    int bin = (int)dat - baseline + kHalfRange;
+    if (bin < 0) n_below ++;
+    else if (bin < 2 * kHalfRange) {
+      _hist[bin] ++;
+      lo = std::min(lo, bin);
+      hi = std::max(hi, bin);
+    }
+  }
+
+  float sigma = RobustSigma(_hist.data(), lo, hi, kHalfRange, n_below, waveform.size(), _mean);
+
+  // clear the part of the histogram that was used
+  if (hi >= lo) std::fill(_hist.begin() + lo, _hist.begin() + hi + 1, 0);
+
+  return sigma;
+}
+
 // gets the RMS from a wavefrom including any present signal 
 // i.e. will always overestimate the "true" RMS unless no signal is present
-float rawRMS(std::vector<int16_t> &waveform, int16_t baseline) {
-  NoiseSample temp({{0, (unsigned)waveform.size() -1}}, baseline);
-  return temp.RMS(waveform);
+float rawRMS(ADCView waveform, int16_t baseline) {
+  return RawRMS(waveform, baseline);
 }
 
 // get the threshold from a running average of rms values
-float RunningThreshold::Threshold(std::vector<int16_t> &waveform, int16_t baseline, float n_sigma) {
+float RunningThreshold::Threshold(ADCView waveform, int16_t baseline, float n_sigma) {
+  // only calculate the raw RMS if it will be used
+  return Threshold((_n_past_rms == 0) ? rawRMS(waveform, baseline) : 0., n_sigma);
+}
+
+float RunningThreshold::Threshold(float raw_rms, float n_sigma) {
   // if there's no history, just use the raw RMS
   if (_n_past_rms == 0) {
     // 2x penalty since rawRMS will overestimate the true RMS
     // edit: no penalty for now
-    return rawRMS(waveform, baseline) * n_sigma;
+    return raw_rms * n_sigma;
   }
   else {
     float rms = 0;
@@ -4,10 +4,13 @@
 #include <array>
 #include <string>
 #include <float.h>
+#include <cstdint>
 
 #include "canvas/Persistency/Common/Ptr.h"
 #include "lardataobj/RecoBase/Hit.h"
 
+#include "Span.hh"
+
 namespace tpcAnalysis {
 // Reinventing the wheel: search for a bunch of peaks in a set of data
 // 
@@ -47,14 +50,37 @@ public:
   explicit PeakFinder(const std::vector<art::Ptr<recob::Hit> > &hits);
 
   // generate list of peaks by providing waveform -- does hitfinding internally
-  PeakFinder(std::vector<int16_t> &waveform, int16_t baseline, float threshold, 
+  PeakFinder(ADCView waveform, int16_t baseline, float threshold, 
+      unsigned n_smoothing_samples=1, unsigned n_above_threshold=0, plane_type plane=unspecified);
+  // same, but with the smoothed waveform already calculated (see Smooth())
+  PeakFinder(ADCView waveform, ADCView smoothed_waveform, int16_t baseline, float threshold, 
+      unsigned n_smoothing_samples=1, unsigned n_above_threshold=0, plane_type plane=unspecified);
+  // empty, to be filled by Find()
+  PeakFinder() {}
+
+  // Re-do the peak finding on a new waveform. Re-uses the memory from
+  // the last call, so it doesn't allocate once the buffers are large enough.
+  void Find(ADCView waveform, int16_t baseline, float threshold, 
       unsigned n_smoothing_samples=1, unsigned n_above_threshold=0, plane_type plane=unspecified);
+  void Find(ADCView waveform, ADCView smoothed_waveform, int16_t baseline, float threshold, 
+      unsigned n_smoothing_samples=1, unsigned n_above_threshold=0, plane_type plane=unspecified);
+
   inline std::vector<Peak> *Peaks() { return &_peaks; }
+
+  // the smoothed waveform used in peak finding: the average of each window of
+  // n_smoothing_samples, starting at the first full window
+  static void Smooth(ADCView waveform, unsigned n_smoothing_samples, std::vector<int16_t> &smoothed);
 private:
-  Peak FinishPeak(Peak peak, std::vector<int16_t> *waveform, unsigned n_smoothing_samples, int16_t baseline, bool up_peak, unsigned index);
+  void FindPeaks(ADCView inp_waveform, ADCView waveform, int16_t baseline, float threshold,
+      unsigned n_smoothing_samples, unsigned n_above_threshold, plane_type plane);
+  void FinishPeak(Peak &peak, ADCView waveform, unsigned n_smoothing_samples, int16_t baseline, bool up_peak, unsigned index);
   void matchPeaks(unsigned match_range);
+  // index of the first sample at or after i marked in _outside (n if none)
+  unsigned NextOutside(unsigned i, unsigned n) const;
   std::vector<int16_t> _smoothed_waveform;
   std::vector<Peak> _peaks;
+  // bitmap of the samples past the threshold (see simd::OutsideBand)
+  std::vector<uint64_t> _outside;
 };
 
 // Classes for different types of threshold calculation
@@ -62,19 +88,59 @@ private:
 // gets threshold from gaussian fit to histogram of ADC values
 class Threshold {
 public:
-  Threshold(std::vector<int16_t> &waveform, int16_t baseline, float n_sigma=5., bool verbose=true);
+  Threshold(ADCView waveform, int16_t baseline, float n_sigma=5., bool verbose=true);
 
   inline float Val() { return _threshold; }
 private:
   float _threshold;
 };
 
+// Gets threshold from a robust estimate of the gaussian noise of the
+// waveform, without ROOT (a fast, thread safe stand-in for Threshold):
+//  - the ADC values near the baseline are histogrammed
+//  - a first sigma is found from the interquartile range
+//  - it is refined from the variance of the values within kWindow sigma
+//    of the median, corrected for the tails of the gaussian cut off by the
+//    window (solved with a few Newton iterations)
+// Signal far out in the tails has little effect. The histogram is re-used
+// between waveforms, so keep one per thread.
+class RobustThreshold {
+public:
+  // ADC values within this many counts of the baseline are histogrammed
+  static const int kHalfRange = 1024;
+  // half width of the window used to refine sigma, in units of sigma
+  static constexpr float kWindow = 3.;
+
+  RobustThreshold(): _hist(2 * kHalfRange, 0), _mean(0.) {}
+
+  // threshold above the baseline
+  float Threshold(ADCView waveform, int16_t baseline, float n_sigma=5.) { return n_sigma * Sigma(waveform, baseline); }
+  // the estimated gaussian sigma of the noise
+  float Sigma(ADCView waveform, int16_t baseline);
+  // mean of the noise relative to the baseline from the last call to Sigma()
+  float Mean() const { return _mean; }
+
+private:
+  std::vector<unsigned> _hist;
+  float _mean;
+};
+
+// The estimate of RobustThreshold from a histogram of ADC values, where bin b
+// holds the values equal to (b - center). Only bins [lo, hi] are filled,
+// n_below values fell under the first bin and n_total values were counted
+// in all (including any above the last bin). Also sets mean to the mean of
+// the noise relative to the center. Defined for unsigned and float counts.
+template<typename T>
+float RobustSigma(const T *hist, int lo, int hi, int center, double n_below, double n_total, float &mean);
+
 // gets threshold from running average of rms values
 class RunningThreshold {
 public:
   RunningThreshold(): _rms_ind(0), _n_past_rms(0) { std::fill(_past_rms.begin(), _past_rms.end(), 0); }
 
-  float Threshold(std::vector<int16_t> &waveform, int16_t baseline, float n_sigma=5.);
+  float Threshold(ADCView waveform, int16_t baseline, float n_sigma=5.);
+  // same, with the raw rms of the waveform already calculated
+  float Threshold(float raw_rms, float n_sigma=5.);
   void AddRMS(float rms);
 
 private:
@@ -0,0 +1,112 @@
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+#include "PedestalTracker.hh"
+#include "PeakFinder.hh"
+#include "sbndqm/Decode/Mode/Mode.hh"
+
+using namespace tpcAnalysis;
+
+PedestalTracker::PedestalTracker(float decay):
+  _decay(decay),
+  _hist(2 * kHalfRange, 0.),
+  _center(0),
+  _weight(1.),
+  _below(0.),
+  _total(0.),
+  _n_updates(0),
+  _baseline(0),
+  _sigma(0.)
+{}
+
+void PedestalTracker::Update(ADCView waveform, unsigned n_skip_samples) {
+  if (waveform.empty()) return;
+  if (n_skip_samples == 0) n_skip_samples = 1;
+
+  if (_n_updates == 0) {
+    _center = Mode(waveform.data(), waveform.size(), n_skip_samples);
+  }
+  else {
+    _weight /= _decay;
+  }
+  if (_weight > kMaxWeight) {
+    for (float &count: _hist) count /= _weight;
+    _below /= _weight;
+    _total /= _weight;
+    _weight = 1.;
+  }
+
+  unsigned n_outside;
+  unsigned n_values = Fill(waveform, n_skip_samples, n_outside);
+  // the pedestal jumped out of the histogram: start over around the new one
+  if (2 * n_outside > n_values) {
+    std::fill(_hist.begin(), _hist.end(), 0.);
+    _below = 0.;
+    _total = 0.;
+    _weight = 1.;
+    _center = Mode(waveform.data(), waveform.size(), n_skip_samples);
+    n_values = Fill(waveform, n_skip_samples, n_outside);
+  }
+  _total += (double)n_values * _weight;
+  _n_updates ++;
+
+  Estimate();
+  // follow the pedestal if it drifts towards the edge of the histogram
+  if (abs(_baseline - _center) > kHalfRange / 4) {
+    Recenter(_baseline);
+    Estimate();
+  }
+}
+
+unsigned PedestalTracker::Fill(ADCView waveform, unsigned n_skip_samples, unsigned &n_outside) {
+  unsigned n_values = 0;
+  unsigned n_below = 0;
+  unsigned n_above = 0;
+  for (size_t i = 0; i < waveform.size(); i += n_skip_samples) {
+    int bin = (int)waveform[i] - _center + kHalfRange;
+    if (bin < 0) n_below ++;
+    else if (bin < 2 * kHalfRange) _hist[bin] += _weight;
+    else n_above ++;
+    n_values ++;
+  }
+  _below += (double)n_below * _weight;
+  n_outside = n_below + n_above;
+  return n_values;
+}
+
+void PedestalTracker::Recenter(int16_t center) {
+  int shift = (int)center - _center;
+  int n_bins = 2 * kHalfRange;
+  if (shift > 0) {
+    // the lowest bins fall under the histogram
+    int n_out = std::min(shift, n_bins);
+    for (int bin = 0; bin < n_out; bin++) _below += _hist[bin];
+    std::copy(_hist.begin() + n_out, _hist.end(), _hist.begin());
+    std::fill(_hist.end() - n_out, _hist.end(), 0.);
+  }
+  else if (shift < 0) {
+    // the highest bins go over it (they are still counted in the total)
+    int n_out = std::min(-shift, n_bins);
+    std::copy_backward(_hist.begin(), _hist.end() - n_out, _hist.end());
+    std::fill(_hist.begin(), _hist.begin() + n_out, 0.);
+  }
+  _center = center;
+}
+
+void PedestalTracker::Estimate() {
+  int lo = 0;
+  int hi = 2 * kHalfRange - 1;
+  while (lo <= hi && _hist[lo] == 0.) lo ++;
+  while (hi >= lo && _hist[hi] == 0.) hi --;
+
+  // mode, ties going to the lowest value
+  int mode = lo;
+  for (int bin = lo; bin <= hi; bin++) {
+    if (_hist[bin] > _hist[mode]) mode = bin;
+  }
+  _baseline = (hi >= lo) ? _center + mode - kHalfRange : _center;
+
+  float mean;
+  _sigma = RobustSigma(_hist.data(), lo, hi, kHalfRange, _below, _total, mean);
+}
@@ -0,0 +1,76 @@
+#ifndef _sbnddaq_analysis_PedestalTracker
+#define _sbnddaq_analysis_PedestalTracker
+#include <vector>
+#include <cstdint>
+
+#include "Span.hh"
+
+/*
+  * Tracks the pedestal and noise of a channel across events.
+  *
+  * Keeps an exponentially decayed histogram of the ADC values of the channel
+  * around its pedestal. Each update scales down the weight of everything
+  * added before by the decay, so the tracker follows about the last
+  * 1 / (1 - decay) updates. The baseline is the mode of the histogram and
+  * the noise sigma is the robust estimate of RobustThreshold (see
+  * RobustSigma()), both found once per update, so reading them costs
+  * nothing. Waveforms only need to be added on some events.
+  *
+  * Rather than scaling down the whole histogram on each update, the weight
+  * of new values is scaled up (and the histogram is re-normalized once in a
+  * while). The histogram is re-centered if the pedestal drifts away from
+  * its center, and started over if most of a waveform falls outside of it.
+  *
+  * Keep one per channel. Different trackers can be updated in parallel.
+*/
+
+namespace tpcAnalysis {
+class PedestalTracker {
+public:
+  // ADC values within this many counts of the center of the histogram are tracked
+  static const int kHalfRange = 128;
+  // re-normalize the histogram once the weight of new values passes this
+  static constexpr float kMaxWeight = 1e6;
+
+  explicit PedestalTracker(float decay=0.9);
+
+  // Add every n_skip_samples-th ADC value of a waveform
+  void Update(ADCView waveform, unsigned n_skip_samples=1);
+
+  // whether any waveform has been added
+  bool Ready() const { return _n_updates > 0; }
+  unsigned NUpdates() const { return _n_updates; }
+
+  // the pedestal (mode of the histogram)
+  int16_t Baseline() const { return _baseline; }
+  // the estimated gaussian sigma of the noise
+  float Sigma() const { return _sigma; }
+  // threshold above the baseline
+  float Threshold(float n_sigma=5.) const { return n_sigma * _sigma; }
+
+private:
+  // add the values of a waveform to the histogram. Returns the number of
+  // values, and sets n_outside to the number that didn't fit in the histogram.
+  unsigned Fill(ADCView waveform, unsigned n_skip_samples, unsigned &n_outside);
+  // move the center of the histogram, keeping the values that still fit
+  void Recenter(int16_t center);
+  // find the baseline and sigma from the histogram
+  void Estimate();
+
+  float _decay;
+  std::vector<float> _hist;
+  // ADC value of bin kHalfRange
+  int16_t _center;
+  // weight of a value added now
+  float _weight;
+  // weight of the values under the histogram, and of all values
+  double _below;
+  double _total;
+  unsigned _n_updates;
+
+  int16_t _baseline;
+  float _sigma;
+};
+
+} // namespace tpcAnalysis
+#endif
@@ -0,0 +1,64 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "PurityHitFinder.hh"
+#include "SIMD.hh"
+
+using namespace tpcAnalysis;
+
+PurityHitFinder::PurityHitFinder(unsigned edge, unsigned half_window,
+    unsigned sideband_begin, unsigned sideband_end, float n_sigma):
+  _edge(edge),
+  _half_window(std::max(half_window, 1u)),
+  _sideband_begin(sideband_begin),
+  _sideband_end(sideband_end),
+  _n_sigma(n_sigma)
+{}
+
+bool PurityHitFinder::Find(ADCView adcs, float pedestal, PurityHitCandidate &candidate) const {
+  size_t n = adcs.size();
+  if (n <= 2 * (size_t)_edge + 1) return false;
+
+  // first highest sample in (edge, n - edge)
+  const int16_t *begin = adcs.data() + _edge + 1;
+  const int16_t *end = adcs.data() + n - _edge;
+  int16_t max = simd::Max(begin, end - begin);
+  if (!(max - pedestal > 0.)) return false;
+  size_t sample = std::find(begin, end, max) - adcs.data();
+
+  // the side-bands and the window have to fit in the waveform
+  size_t reach = std::max(_sideband_end, _half_window);
+  if (sample < reach || sample + reach > n) return false;
+
+  candidate.sample = sample;
+  candidate.height = max - pedestal;
+
+  size_t n_sideband = _sideband_end - _sideband_begin;
+  int64_t before = simd::Sum(adcs.data() + sample - _sideband_end, n_sideband);
+  int64_t after = simd::Sum(adcs.data() + sample + _sideband_begin, n_sideband);
+  candidate.baseline_before = (double)before / n_sideband - pedestal;
+  candidate.baseline_after = (double)after / n_sideband - pedestal;
+  float local_baseline = (candidate.baseline_after + candidate.baseline_before) * 0.5;
+
+  // window of samples less than half_window away from the maximum
+  size_t window_begin = sample + 1 - _half_window;
+  size_t n_window = 2 * _half_window - 1;
+  int64_t window_sum = simd::Sum(adcs.data() + window_begin, n_window);
+  candidate.area = window_sum - n_window * ((double)pedestal + local_baseline);
+
+  // RMS of the rest. The sums are exact, relative to the rounded pedestal.
+  int16_t base = (int16_t)std::lround(pedestal);
+  int64_t n_out = n - n_window;
+  int64_t sum = simd::Sum(adcs.data(), n) - window_sum - n_out * base;
+  int64_t sum2 = simd::SumSquares(adcs.data(), n, base) - simd::SumSquares(adcs.data() + window_begin, n_window, base);
+  int64_t n_var = n_out * sum2 - sum * sum;
+  candidate.rms = n_out ? std::sqrt((double)n_var) / n_out : 0.;
+
+  return true;
+}
+
+bool PurityHitFinder::Selected(const PurityHitCandidate &candidate) const {
+  return candidate.height > _n_sigma * candidate.rms
+    && std::fabs(candidate.baseline_after - candidate.baseline_before) < candidate.rms;
+}
@@ -0,0 +1,63 @@
+#ifndef _sbnddaq_analysis_PurityHitFinder
+#define _sbnddaq_analysis_PurityHitFinder
+#include <cstddef>
+
+#include "Span.hh"
+
+/*
+  * Finds the hit candidate of a collection wire for the purity measurement.
+  *
+  * The candidate is the highest sample of the waveform (away from its
+  * edges). Its area is summed in a window around it, above the local
+  * baseline given by the mean of two side-bands before and after the
+  * window. The noise is the RMS of the samples outside of the window.
+  *
+  * Everything comes out of integer sums over the ADC values (see SIMD.hh),
+  * so there is no per-waveform allocation and it is safe to call from
+  * different threads.
+*/
+
+namespace tpcAnalysis {
+
+// Features of the hit candidate of one waveform. ADC values are relative to
+// the pedestal.
+class PurityHitCandidate {
+public:
+  // sample and height of the maximum
+  unsigned sample;
+  float height;
+  // mean of the side-bands before and after the maximum
+  float baseline_before;
+  float baseline_after;
+  // sum over the window around the maximum, above the mean of the side-bands
+  float area;
+  // RMS of the samples outside of the window
+  float rms;
+};
+
+class PurityHitFinder {
+public:
+  // Defaults are those of the original ICARUS purity analysis:
+  // the maximum is searched more than edge samples from the ends of the
+  // waveform, the area is summed over samples less than half_window from
+  // the maximum, and the side-bands are the samples [sideband_begin,
+  // sideband_end) away from the maximum on each side.
+  explicit PurityHitFinder(unsigned edge=150, unsigned half_window=30,
+    unsigned sideband_begin=50, unsigned sideband_end=150, float n_sigma=5.);
+
+  // Find the candidate of a waveform. Returns false if the waveform has no
+  // sample above the pedestal (or is too short to have a candidate).
+  bool Find(ADCView adcs, float pedestal, PurityHitCandidate &candidate) const;
+  // Whether a candidate is a hit: n_sigma above the noise on a flat baseline
+  bool Selected(const PurityHitCandidate &candidate) const;
+
+private:
+  unsigned _edge;
+  unsigned _half_window;
+  unsigned _sideband_begin;
+  unsigned _sideband_end;
+  float _n_sigma;
+};
+
+} // namespace tpcAnalysis
+#endif
@@ -0,0 +1,716 @@
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
+#include "SIMD.hh"
+
+using namespace tpcAnalysis;
+
+namespace {
+
+// ---------------------------------------------------------------- scalar
+
+void ToDoubleScalar(const int16_t *in, size_t n, int16_t baseline, double *out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = (double)(in[i] - baseline);
+  }
+}
+
+void ToFloatScalar(const int16_t *in, size_t n, int16_t baseline, float *out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = (float)(in[i] - baseline);
+  }
+}
+
+int64_t SumScalar(const int16_t *a, size_t n) {
+  int64_t ret = 0;
+  for (size_t i = 0; i < n; i++) ret += a[i];
+  return ret;
+}
+
+int64_t SumSquaresScalar(const int16_t *a, size_t n, int16_t base) {
+  int64_t ret = 0;
+  for (size_t i = 0; i < n; i++) {
+    int16_t d = a[i] - base;
+    ret += (int32_t)d * d;
+  }
+  return ret;
+}
+
+int64_t SumProductsScalar(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n) {
+  int64_t ret = 0;
+  for (size_t i = 0; i < n; i++) {
+    int16_t da = a[i] - base_a;
+    int16_t db = b[i] - base_b;
+    ret += (int32_t)da * db;
+  }
+  return ret;
+}
+
+int64_t SumSquaresOfSumScalar(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n) {
+  int64_t ret = 0;
+  for (size_t i = 0; i < n; i++) {
+    int16_t d = (int16_t)(a[i] - base_a) + (int16_t)(b[i] - base_b);
+    ret += (int32_t)d * d;
+  }
+  return ret;
+}
+
+int64_t SumSquaresOfDifferenceScalar(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n) {
+  int64_t ret = 0;
+  for (size_t i = 0; i < n; i++) {
+    int16_t d = (int16_t)(a[i] - base_a) - (int16_t)(b[i] - base_b);
+    ret += (int32_t)d * d;
+  }
+  return ret;
+}
+
+void CorrelationSumsScalar(const int16_t *a, const int16_t *mask_a, const int16_t *b, const int16_t *mask_b, size_t n, int64_t sums[3]) {
+  int64_t ab = 0, aa = 0, bb = 0;
+  for (size_t i = 0; i < n; i++) {
+    ab += (int32_t)a[i] * b[i];
+    aa += (int32_t)a[i] * (int16_t)(a[i] & mask_b[i]);
+    bb += (int32_t)b[i] * (int16_t)(b[i] & mask_a[i]);
+  }
+  sums[0] += ab;
+  sums[1] += aa;
+  sums[2] += bb;
+}
+
+void ToDoubleWindowedScalar(const int16_t *in, size_t n, int16_t baseline, const double *window, double *out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = (double)(in[i] - baseline) * window[i];
+  }
+}
+
+void AddPowerScalar(const double *in, size_t n, double *out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] += in[2*i] * in[2*i] + in[2*i+1] * in[2*i+1];
+  }
+}
+
+void AddWaveformScalar(const int16_t *in, size_t n, int16_t baseline, int32_t *out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] += (int16_t)(in[i] - baseline);
+  }
+}
+
+int64_t SumSquares32Scalar(const int32_t *a, size_t n) {
+  int64_t ret = 0;
+  for (size_t i = 0; i < n; i++) ret += (int64_t)a[i] * a[i];
+  return ret;
+}
+
+void OutsideBandScalar(const int16_t *a, size_t n, int16_t lo, int16_t hi, uint64_t *bits) {
+  for (size_t w = 0; w < (n + 63) / 64; w++) bits[w] = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (a[i] < lo || a[i] > hi) bits[i / 64] |= (uint64_t)1 << (i % 64);
+  }
+}
+
+int16_t MaxScalar(const int16_t *a, size_t n) {
+  int16_t ret = std::numeric_limits<int16_t>::min();
+  for (size_t i = 0; i < n; i++) {
+    if (a[i] > ret) ret = a[i];
+  }
+  return ret;
+}
+
+#ifdef SIMD_X86
+// ---------------------------------------------------------------- SSE2
+
+// sign extend the low/high 4 int16's of v into int32's
+inline __m128i Lo16To32(__m128i v) { return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16); }
+inline __m128i Hi16To32(__m128i v) { return _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16); }
+
+void ToDoubleSSE2(const int16_t *in, size_t n, int16_t baseline, double *out) {
+  const __m128i base = _mm_set1_epi32(baseline);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128i lo = _mm_sub_epi32(Lo16To32(v), base);
+    __m128i hi = _mm_sub_epi32(Hi16To32(v), base);
+    _mm_storeu_pd(out + i,     _mm_cvtepi32_pd(lo));
+    _mm_storeu_pd(out + i + 2, _mm_cvtepi32_pd(_mm_shuffle_epi32(lo, 0xEE)));
+    _mm_storeu_pd(out + i + 4, _mm_cvtepi32_pd(hi));
+    _mm_storeu_pd(out + i + 6, _mm_cvtepi32_pd(_mm_shuffle_epi32(hi, 0xEE)));
+  }
+  ToDoubleScalar(in + i, n - i, baseline, out + i);
+}
+
+void ToFloatSSE2(const int16_t *in, size_t n, int16_t baseline, float *out) {
+  const __m128i base = _mm_set1_epi32(baseline);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+    _mm_storeu_ps(out + i,     _mm_cvtepi32_ps(_mm_sub_epi32(Lo16To32(v), base)));
+    _mm_storeu_ps(out + i + 4, _mm_cvtepi32_ps(_mm_sub_epi32(Hi16To32(v), base)));
+  }
+  ToFloatScalar(in + i, n - i, baseline, out + i);
+}
+
+// add the 4 int32's in v, sign extended, to the 2 int64's in acc
+inline __m128i Accumulate64(__m128i acc, __m128i v) {
+  __m128i sign = _mm_srai_epi32(v, 31);
+  acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, sign));
+  return _mm_add_epi64(acc, _mm_unpackhi_epi32(v, sign));
+}
+
+inline int64_t Total64(__m128i acc) {
+  alignas(16) int64_t lanes[2];
+  _mm_store_si128((__m128i *)lanes, acc);
+  return lanes[0] + lanes[1];
+}
+
+int64_t SumSSE2(const int16_t *a, size_t n) {
+  const __m128i ones = _mm_set1_epi16(1);
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+    acc = Accumulate64(acc, _mm_madd_epi16(v, ones));
+  }
+  return Total64(acc) + SumScalar(a + i, n - i);
+}
+
+int64_t SumSquaresSSE2(const int16_t *a, size_t n, int16_t base) {
+  const __m128i vbase = _mm_set1_epi16(base);
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i d = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(a + i)), vbase);
+    acc = Accumulate64(acc, _mm_madd_epi16(d, d));
+  }
+  return Total64(acc) + SumSquaresScalar(a + i, n - i, base);
+}
+
+int64_t SumProductsSSE2(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n) {
+  const __m128i vbase_a = _mm_set1_epi16(base_a);
+  const __m128i vbase_b = _mm_set1_epi16(base_b);
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i da = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(a + i)), vbase_a);
+    __m128i db = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(b + i)), vbase_b);
+    acc = Accumulate64(acc, _mm_madd_epi16(da, db));
+  }
+  return Total64(acc) + SumProductsScalar(a + i, base_a, b + i, base_b, n - i);
+}
+
+int64_t SumSquaresOfSumSSE2(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n) {
+  const __m128i vbase_a = _mm_set1_epi16(base_a);
+  const __m128i vbase_b = _mm_set1_epi16(base_b);
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i da = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(a + i)), vbase_a);
+    __m128i db = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(b + i)), vbase_b);
+    __m128i d = _mm_add_epi16(da, db);
+    acc = Accumulate64(acc, _mm_madd_epi16(d, d));
+  }
+  return Total64(acc) + SumSquaresOfSumScalar(a + i, base_a, b + i, base_b, n - i);
+}
+
+int64_t SumSquaresOfDifferenceSSE2(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n) {
+  const __m128i vbase_a = _mm_set1_epi16(base_a);
+  const __m128i vbase_b = _mm_set1_epi16(base_b);
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i da = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(a + i)), vbase_a);
+    __m128i db = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(b + i)), vbase_b);
+    __m128i d = _mm_sub_epi16(da, db);
+    acc = Accumulate64(acc, _mm_madd_epi16(d, d));
+  }
+  return Total64(acc) + SumSquaresOfDifferenceScalar(a + i, base_a, b + i, base_b, n - i);
+}
+
+void CorrelationSumsSSE2(const int16_t *a, const int16_t *mask_a, const int16_t *b, const int16_t *mask_b, size_t n, int64_t sums[3]) {
+  __m128i ab = _mm_setzero_si128();
+  __m128i aa = _mm_setzero_si128();
+  __m128i bb = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    __m128i ma = _mm_loadu_si128((const __m128i *)(mask_a + i));
+    __m128i mb = _mm_loadu_si128((const __m128i *)(mask_b + i));
+    ab = Accumulate64(ab, _mm_madd_epi16(va, vb));
+    aa = Accumulate64(aa, _mm_madd_epi16(va, _mm_and_si128(va, mb)));
+    bb = Accumulate64(bb, _mm_madd_epi16(vb, _mm_and_si128(vb, ma)));
+  }
+  sums[0] += Total64(ab);
+  sums[1] += Total64(aa);
+  sums[2] += Total64(bb);
+  CorrelationSumsScalar(a + i, mask_a + i, b + i, mask_b + i, n - i, sums);
+}
+
+void ToDoubleWindowedSSE2(const int16_t *in, size_t n, int16_t baseline, const double *window, double *out) {
+  const __m128i base = _mm_set1_epi32(baseline);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128i lo = _mm_sub_epi32(Lo16To32(v), base);
+    __m128i hi = _mm_sub_epi32(Hi16To32(v), base);
+    _mm_storeu_pd(out + i,     _mm_mul_pd(_mm_cvtepi32_pd(lo), _mm_loadu_pd(window + i)));
+    _mm_storeu_pd(out + i + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(lo, 0xEE)), _mm_loadu_pd(window + i + 2)));
+    _mm_storeu_pd(out + i + 4, _mm_mul_pd(_mm_cvtepi32_pd(hi), _mm_loadu_pd(window + i + 4)));
+    _mm_storeu_pd(out + i + 6, _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(hi, 0xEE)), _mm_loadu_pd(window + i + 6)));
+  }
+  ToDoubleWindowedScalar(in + i, n - i, baseline, window + i, out + i);
+}
+
+void AddPowerSSE2(const double *in, size_t n, double *out) {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    // (re, im) of two values
+    __m128d a = _mm_loadu_pd(in + 2*i);
+    __m128d b = _mm_loadu_pd(in + 2*i + 2);
+    a = _mm_mul_pd(a, a);
+    b = _mm_mul_pd(b, b);
+    __m128d power = _mm_add_pd(_mm_unpacklo_pd(a, b), _mm_unpackhi_pd(a, b));
+    _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(out + i), power));
+  }
+  AddPowerScalar(in + 2*i, n - i, out + i);
+}
+
+void AddWaveformSSE2(const int16_t *in, size_t n, int16_t baseline, int32_t *out) {
+  const __m128i vbase = _mm_set1_epi16(baseline);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i d = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(in + i)), vbase);
+    __m128i *o = (__m128i *)(out + i);
+    _mm_storeu_si128(o,     _mm_add_epi32(_mm_loadu_si128(o),     Lo16To32(d)));
+    _mm_storeu_si128(o + 1, _mm_add_epi32(_mm_loadu_si128(o + 1), Hi16To32(d)));
+  }
+  AddWaveformScalar(in + i, n - i, baseline, out + i);
+}
+
+int64_t SumSquares32SSE2(const int32_t *a, size_t n) {
+  // SSE2 only has an unsigned 32 x 32 -> 64 bit multiply, so square |a[i]|
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i sign = _mm_srai_epi32(v, 31);
+    v = _mm_sub_epi32(_mm_xor_si128(v, sign), sign);
+    acc = _mm_add_epi64(acc, _mm_mul_epu32(v, v));
+    v = _mm_srli_epi64(v, 32);
+    acc = _mm_add_epi64(acc, _mm_mul_epu32(v, v));
+  }
+  return Total64(acc) + SumSquares32Scalar(a + i, n - i);
+}
+
+// mask (all bits set) of the values outside of [lo, hi]
+inline __m128i OutsideSSE2(__m128i v, __m128i lo, __m128i hi) {
+  return _mm_or_si128(_mm_cmplt_epi16(v, lo), _mm_cmpgt_epi16(v, hi));
+}
+
+void OutsideBandSSE2(const int16_t *a, size_t n, int16_t lo, int16_t hi, uint64_t *bits) {
+  const __m128i vlo = _mm_set1_epi16(lo);
+  const __m128i vhi = _mm_set1_epi16(hi);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    uint64_t word = 0;
+    for (unsigned j = 0; j < 64; j += 16) {
+      __m128i m0 = OutsideSSE2(_mm_loadu_si128((const __m128i *)(a + i + j)), vlo, vhi);
+      __m128i m1 = OutsideSSE2(_mm_loadu_si128((const __m128i *)(a + i + j + 8)), vlo, vhi);
+      // one byte per value, in order
+      word |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_packs_epi16(m0, m1)) << j;
+    }
+    bits[i / 64] = word;
+  }
+  OutsideBandScalar(a + i, n - i, lo, hi, bits + i / 64);
+}
+
+// largest of the 8 int16's in v
+inline int16_t Max16(__m128i v) {
+  v = _mm_max_epi16(v, _mm_shuffle_epi32(v, 0x4E));
+  v = _mm_max_epi16(v, _mm_shuffle_epi32(v, 0xB1));
+  v = _mm_max_epi16(v, _mm_shufflelo_epi16(v, 0xB1));
+  return (int16_t)_mm_cvtsi128_si32(v);
+}
+
+int16_t MaxSSE2(const int16_t *a, size_t n) {
+  __m128i acc = _mm_set1_epi16(std::numeric_limits<int16_t>::min());
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc = _mm_max_epi16(acc, _mm_loadu_si128((const __m128i *)(a + i)));
+  }
+  int16_t tail = MaxScalar(a + i, n - i);
+  int16_t ret = Max16(acc);
+  return tail > ret ? tail : ret;
+}
+
+// ---------------------------------------------------------------- AVX2
+
+__attribute__((target("avx2")))
+void ToDoubleAVX2(const int16_t *in, size_t n, int16_t baseline, double *out) {
+  const __m256i base = _mm256_set1_epi32(baseline);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_sub_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i))), base);
+    _mm256_storeu_pd(out + i,     _mm256_cvtepi32_pd(_mm256_castsi256_si128(v)));
+    _mm256_storeu_pd(out + i + 4, _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)));
+  }
+  ToDoubleScalar(in + i, n - i, baseline, out + i);
+}
+
+__attribute__((target("avx2")))
+void ToFloatAVX2(const int16_t *in, size_t n, int16_t baseline, float *out) {
+  const __m256i base = _mm256_set1_epi32(baseline);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_sub_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i))), base);
+    _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(v));
+  }
+  ToFloatScalar(in + i, n - i, baseline, out + i);
+}
+
+// add the 8 int32's in v, sign extended, to the 4 int64's in acc
+__attribute__((target("avx2")))
+inline __m256i Accumulate64AVX2(__m256i acc, __m256i v) {
+  acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+  return _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+}
+
+__attribute__((target("avx2")))
+inline int64_t Total64AVX2(__m256i acc) {
+  alignas(32) int64_t lanes[4];
+  _mm256_store_si256((__m256i *)lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2")))
+int64_t SumAVX2(const int16_t *a, size_t n) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+    acc = Accumulate64AVX2(acc, _mm256_madd_epi16(v, ones));
+  }
+  return Total64AVX2(acc) + SumScalar(a + i, n - i);
+}
+
+__attribute__((target("avx2")))
+int64_t SumSquaresAVX2(const int16_t *a, size_t n, int16_t base) {
+  const __m256i vbase = _mm256_set1_epi16(base);
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i d = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(a + i)), vbase);
+    acc = Accumulate64AVX2(acc, _mm256_madd_epi16(d, d));
+  }
+  return Total64AVX2(acc) + SumSquaresScalar(a + i, n - i, base);
+}
+
+__attribute__((target("avx2")))
+int64_t SumProductsAVX2(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n) {
+  const __m256i vbase_a = _mm256_set1_epi16(base_a);
+  const __m256i vbase_b = _mm256_set1_epi16(base_b);
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i da = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(a + i)), vbase_a);
+    __m256i db = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(b + i)), vbase_b);
+    acc = Accumulate64AVX2(acc, _mm256_madd_epi16(da, db));
+  }
+  return Total64AVX2(acc) + SumProductsScalar(a + i, base_a, b + i, base_b, n - i);
+}
+
+__attribute__((target("avx2")))
+int64_t SumSquaresOfSumAVX2(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n) {
+  const __m256i vbase_a = _mm256_set1_epi16(base_a);
+  const __m256i vbase_b = _mm256_set1_epi16(base_b);
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i da = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(a + i)), vbase_a);
+    __m256i db = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(b + i)), vbase_b);
+    __m256i d = _mm256_add_epi16(da, db);
+    acc = Accumulate64AVX2(acc, _mm256_madd_epi16(d, d));
+  }
+  return Total64AVX2(acc) + SumSquaresOfSumScalar(a + i, base_a, b + i, base_b, n - i);
+}
+
+__attribute__((target("avx2")))
+int64_t SumSquaresOfDifferenceAVX2(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n) {
+  const __m256i vbase_a = _mm256_set1_epi16(base_a);
+  const __m256i vbase_b = _mm256_set1_epi16(base_b);
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i da = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(a + i)), vbase_a);
+    __m256i db = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(b + i)), vbase_b);
+    __m256i d = _mm256_sub_epi16(da, db);
+    acc = Accumulate64AVX2(acc, _mm256_madd_epi16(d, d));
+  }
+  return Total64AVX2(acc) + SumSquaresOfDifferenceScalar(a + i, base_a, b + i, base_b, n - i);
+}
+
+__attribute__((target("avx2")))
+void CorrelationSumsAVX2(const int16_t *a, const int16_t *mask_a, const int16_t *b, const int16_t *mask_b, size_t n, int64_t sums[3]) {
+  __m256i ab = _mm256_setzero_si256();
+  __m256i aa = _mm256_setzero_si256();
+  __m256i bb = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    __m256i ma = _mm256_loadu_si256((const __m256i *)(mask_a + i));
+    __m256i mb = _mm256_loadu_si256((const __m256i *)(mask_b + i));
+    ab = Accumulate64AVX2(ab, _mm256_madd_epi16(va, vb));
+    aa = Accumulate64AVX2(aa, _mm256_madd_epi16(va, _mm256_and_si256(va, mb)));
+    bb = Accumulate64AVX2(bb, _mm256_madd_epi16(vb, _mm256_and_si256(vb, ma)));
+  }
+  sums[0] += Total64AVX2(ab);
+  sums[1] += Total64AVX2(aa);
+  sums[2] += Total64AVX2(bb);
+  CorrelationSumsScalar(a + i, mask_a + i, b + i, mask_b + i, n - i, sums);
+}
+
+__attribute__((target("avx2")))
+void ToDoubleWindowedAVX2(const int16_t *in, size_t n, int16_t baseline, const double *window, double *out) {
+  const __m256i base = _mm256_set1_epi32(baseline);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_sub_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i))), base);
+    _mm256_storeu_pd(out + i,     _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(v)), _mm256_loadu_pd(window + i)));
+    _mm256_storeu_pd(out + i + 4, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)), _mm256_loadu_pd(window + i + 4)));
+  }
+  ToDoubleWindowedScalar(in + i, n - i, baseline, window + i, out + i);
+}
+
+__attribute__((target("avx2")))
+void AddPowerAVX2(const double *in, size_t n, double *out) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    // (re, im) of four values
+    __m256d a = _mm256_loadu_pd(in + 2*i);
+    __m256d b = _mm256_loadu_pd(in + 2*i + 4);
+    a = _mm256_mul_pd(a, a);
+    b = _mm256_mul_pd(b, b);
+    // power of values (0, 2, 1, 3) -- put them back in order
+    __m256d power = _mm256_permute4x64_pd(_mm256_hadd_pd(a, b), 0xD8);
+    _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(out + i), power));
+  }
+  AddPowerScalar(in + 2*i, n - i, out + i);
+}
+
+__attribute__((target("avx2")))
+void AddWaveformAVX2(const int16_t *in, size_t n, int16_t baseline, int32_t *out) {
+  const __m128i vbase = _mm_set1_epi16(baseline);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i d = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(in + i)), vbase);
+    __m256i *o = (__m256i *)(out + i);
+    _mm256_storeu_si256(o, _mm256_add_epi32(_mm256_loadu_si256(o), _mm256_cvtepi16_epi32(d)));
+  }
+  AddWaveformScalar(in + i, n - i, baseline, out + i);
+}
+
+__attribute__((target("avx2")))
+int64_t SumSquares32AVX2(const int32_t *a, size_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+    // signed products of the even, then the odd lanes
+    acc = _mm256_add_epi64(acc, _mm256_mul_epi32(v, v));
+    v = _mm256_srli_epi64(v, 32);
+    acc = _mm256_add_epi64(acc, _mm256_mul_epi32(v, v));
+  }
+  return Total64AVX2(acc) + SumSquares32Scalar(a + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline __m256i OutsideAVX2(__m256i v, __m256i lo, __m256i hi) {
+  return _mm256_or_si256(_mm256_cmpgt_epi16(lo, v), _mm256_cmpgt_epi16(v, hi));
+}
+
+__attribute__((target("avx2")))
+void OutsideBandAVX2(const int16_t *a, size_t n, int16_t lo, int16_t hi, uint64_t *bits) {
+  const __m256i vlo = _mm256_set1_epi16(lo);
+  const __m256i vhi = _mm256_set1_epi16(hi);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    uint64_t word = 0;
+    for (unsigned j = 0; j < 64; j += 32) {
+      __m256i m0 = OutsideAVX2(_mm256_loadu_si256((const __m256i *)(a + i + j)), vlo, vhi);
+      __m256i m1 = OutsideAVX2(_mm256_loadu_si256((const __m256i *)(a + i + j + 16)), vlo, vhi);
+      // packing works within each 128 bit lane -- put the bytes back in order
+      __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(m0, m1), 0xD8);
+      word |= (uint64_t)(uint32_t)_mm256_movemask_epi8(packed) << j;
+    }
+    bits[i / 64] = word;
+  }
+  OutsideBandScalar(a + i, n - i, lo, hi, bits + i / 64);
+}
+
+__attribute__((target("avx2")))
+int16_t MaxAVX2(const int16_t *a, size_t n) {
+  __m256i acc = _mm256_set1_epi16(std::numeric_limits<int16_t>::min());
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    acc = _mm256_max_epi16(acc, _mm256_loadu_si256((const __m256i *)(a + i)));
+  }
+  __m128i half = _mm_max_epi16(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  int16_t tail = MaxScalar(a + i, n - i);
+  int16_t ret = Max16(half);
+  return tail > ret ? tail : ret;
+}
+#endif
+
+// table of kernels for the instruction set in use
+struct Kernels {
+  simd::InstructionSet isa;
+  void (*to_double)(const int16_t *, size_t, int16_t, double *);
+  void (*to_float)(const int16_t *, size_t, int16_t, float *);
+  int64_t (*sum)(const int16_t *, size_t);
+  int64_t (*sum_squares)(const int16_t *, size_t, int16_t);
+  int64_t (*sum_products)(const int16_t *, int16_t, const int16_t *, int16_t, size_t);
+  int64_t (*sum_squares_of_sum)(const int16_t *, int16_t, const int16_t *, int16_t, size_t);
+  int64_t (*sum_squares_of_difference)(const int16_t *, int16_t, const int16_t *, int16_t, size_t);
+  void (*correlation_sums)(const int16_t *, const int16_t *, const int16_t *, const int16_t *, size_t, int64_t *);
+  void (*to_double_windowed)(const int16_t *, size_t, int16_t, const double *, double *);
+  void (*add_power)(const double *, size_t, double *);
+  void (*add_waveform)(const int16_t *, size_t, int16_t, int32_t *);
+  int64_t (*sum_squares32)(const int32_t *, size_t);
+  void (*outside_band)(const int16_t *, size_t, int16_t, int16_t, uint64_t *);
+  int16_t (*max)(const int16_t *, size_t);
+
+  Kernels() {
+    isa = simd::kScalar;
+    to_double = ToDoubleScalar;
+    to_float = ToFloatScalar;
+    sum = SumScalar;
+    sum_squares = SumSquaresScalar;
+    sum_products = SumProductsScalar;
+    sum_squares_of_sum = SumSquaresOfSumScalar;
+    sum_squares_of_difference = SumSquaresOfDifferenceScalar;
+    correlation_sums = CorrelationSumsScalar;
+    to_double_windowed = ToDoubleWindowedScalar;
+    add_power = AddPowerScalar;
+    add_waveform = AddWaveformScalar;
+    sum_squares32 = SumSquares32Scalar;
+    outside_band = OutsideBandScalar;
+    max = MaxScalar;
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      isa = simd::kAVX2;
+      to_double = ToDoubleAVX2;
+      to_float = ToFloatAVX2;
+      sum = SumAVX2;
+      sum_squares = SumSquaresAVX2;
+      sum_products = SumProductsAVX2;
+      sum_squares_of_sum = SumSquaresOfSumAVX2;
+      sum_squares_of_difference = SumSquaresOfDifferenceAVX2;
+      correlation_sums = CorrelationSumsAVX2;
+      to_double_windowed = ToDoubleWindowedAVX2;
+      add_power = AddPowerAVX2;
+      add_waveform = AddWaveformAVX2;
+      sum_squares32 = SumSquares32AVX2;
+      outside_band = OutsideBandAVX2;
+      max = MaxAVX2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+      isa = simd::kSSE2;
+      to_double = ToDoubleSSE2;
+      to_float = ToFloatSSE2;
+      sum = SumSSE2;
+      sum_squares = SumSquaresSSE2;
+      sum_products = SumProductsSSE2;
+      sum_squares_of_sum = SumSquaresOfSumSSE2;
+      sum_squares_of_difference = SumSquaresOfDifferenceSSE2;
+      correlation_sums = CorrelationSumsSSE2;
+      to_double_windowed = ToDoubleWindowedSSE2;
+      add_power = AddPowerSSE2;
+      add_waveform = AddWaveformSSE2;
+      sum_squares32 = SumSquares32SSE2;
+      outside_band = OutsideBandSSE2;
+      max = MaxSSE2;
+    }
+#endif
+  }
+};
+
+// picked once, on first use
+const Kernels &Get() {
+  static const Kernels kernels;
+  return kernels;
+}
+
+} // namespace
+
+simd::InstructionSet simd::Available() { return Get().isa; }
+
+const char *simd::Name(simd::InstructionSet isa) {
+  switch (isa) {
+    case kAVX2: return "AVX2";
+    case kSSE2: return "SSE2";
+    default: return "scalar";
+  }
+}
+
+void simd::ToDouble(const int16_t *in, size_t n, int16_t baseline, double *out) {
+  Get().to_double(in, n, baseline, out);
+}
+
+void simd::ToFloat(const int16_t *in, size_t n, int16_t baseline, float *out) {
+  Get().to_float(in, n, baseline, out);
+}
+
+int64_t simd::Sum(const int16_t *a, size_t n) {
+  return Get().sum(a, n);
+}
+
+int64_t simd::SumSquares(const int16_t *a, size_t n, int16_t base) {
+  return Get().sum_squares(a, n, base);
+}
+
+int64_t simd::SumProducts(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n) {
+  return Get().sum_products(a, base_a, b, base_b, n);
+}
+
+int64_t simd::SumSquaresOfSum(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n) {
+  return Get().sum_squares_of_sum(a, base_a, b, base_b, n);
+}
+
+int64_t simd::SumSquaresOfDifference(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n) {
+  return Get().sum_squares_of_difference(a, base_a, b, base_b, n);
+}
+
+void simd::CorrelationSums(const int16_t *a, const int16_t *mask_a, const int16_t *b, const int16_t *mask_b, size_t n, int64_t sums[3]) {
+  Get().correlation_sums(a, mask_a, b, mask_b, n, sums);
+}
+
+void simd::ToDoubleWindowed(const int16_t *in, size_t n, int16_t baseline, const double *window, double *out) {
+  Get().to_double_windowed(in, n, baseline, window, out);
+}
+
+void simd::AddPower(const double *in, size_t n, double *out) {
+  Get().add_power(in, n, out);
+}
+
+void simd::AddWaveform(const int16_t *in, size_t n, int16_t baseline, int32_t *out) {
+  Get().add_waveform(in, n, baseline, out);
+}
+
+int64_t simd::SumSquares32(const int32_t *a, size_t n) {
+  return Get().sum_squares32(a, n);
+}
+
+void simd::OutsideBand(const int16_t *a, size_t n, int16_t lo, int16_t hi, uint64_t *bits) {
+  Get().outside_band(a, n, lo, hi, bits);
+}
+
+int16_t simd::Max(const int16_t *a, size_t n) {
+  return Get().max(a, n);
+}
@@ -0,0 +1,68 @@
+#ifndef _sbnddaq_analysis_SIMD
+#define _sbnddaq_analysis_SIMD
+#include <cstdint>
+#include <cstddef>
+
+// Vectorized kernels for the hot loops of the TPC analysis.
+//
+// Each kernel has an AVX2, an SSE2 and a plain scalar implementation. The
+// best one supported by the machine is picked once at runtime, so the
+// library can be built for a generic target and still use AVX2 where it
+// is available.
+namespace tpcAnalysis {
+namespace simd {
+
+enum InstructionSet { kScalar, kSSE2, kAVX2 };
+
+// the instruction set used by the kernels on this machine
+InstructionSet Available();
+const char *Name(InstructionSet isa);
+
+// out[i] = (double)(in[i] - baseline) for i in [0, n)
+void ToDouble(const int16_t *in, size_t n, int16_t baseline, double *out);
+// out[i] = (float)(in[i] - baseline) for i in [0, n)
+void ToFloat(const int16_t *in, size_t n, int16_t baseline, float *out);
+// out[i] = (double)(in[i] - baseline) * window[i] for i in [0, n)
+void ToDoubleWindowed(const int16_t *in, size_t n, int16_t baseline, const double *window, double *out);
+
+// out[i] += in[2i]^2 + in[2i+1]^2 for i in [0, n), i.e. adds the power of
+// n complex (FFTW) values
+void AddPower(const double *in, size_t n, double *out);
+
+// Reductions over int16 waveforms, accumulated in 64 bits.
+//
+// Baseline subtracted values are computed in 16 bits, which is exact for
+// ADC values and baselines inside the (12 bit) ADC range.
+
+// sum of a[i]
+int64_t Sum(const int16_t *a, size_t n);
+// sum of (a[i] - base)^2
+int64_t SumSquares(const int16_t *a, size_t n, int16_t base);
+// sum of (a[i] - base_a) * (b[i] - base_b)
+int64_t SumProducts(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n);
+// sum of ((a[i] - base_a) + (b[i] - base_b))^2
+int64_t SumSquaresOfSum(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n);
+// sum of ((a[i] - base_a) - (b[i] - base_b))^2
+int64_t SumSquaresOfDifference(const int16_t *a, int16_t base_a, const int16_t *b, int16_t base_b, size_t n);
+
+// Sums needed to correlate two masked waveforms, where the masks are 0 or -1 (all bits set):
+// sums[0] += sum of a[i] * b[i]
+// sums[1] += sum of a[i]^2 where mask_b[i] is set
+// sums[2] += sum of b[i]^2 where mask_a[i] is set
+void CorrelationSums(const int16_t *a, const int16_t *mask_a, const int16_t *b, const int16_t *mask_b, size_t n, int64_t sums[3]);
+
+// out[i] += in[i] - baseline for i in [0, n), e.g. to sum up a group of waveforms
+void AddWaveform(const int16_t *in, size_t n, int16_t baseline, int32_t *out);
+// sum of a[i]^2 over a summed waveform
+int64_t SumSquares32(const int32_t *a, size_t n);
+
+// Sets bit (i % 64) of bits[i / 64] if a[i] < lo or a[i] > hi, and clears it
+// otherwise. Fills all (n + 63) / 64 words (bits past n are cleared).
+void OutsideBand(const int16_t *a, size_t n, int16_t lo, int16_t hi, uint64_t *bits);
+
+// largest of a[i] for i in [0, n) (the lowest int16 if n is 0)
+int16_t Max(const int16_t *a, size_t n);
+
+} // namespace simd
+} // namespace tpcAnalysis
+#endif
@@ -0,0 +1,381 @@
+#include <vector>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <iterator>
+#include <algorithm>
+#include <iostream>
+
+#include "sbndaq-online/helpers/Utilities.h"
+
+#include "Snapshot.hh"
+
+using namespace tpcAnalysis;
+
+// NOTE: packed values are written in host byte order, which is little-endian
+// on all of the DAQ machines (and is what the python readers expect)
+
+size_t snapshot::EncodeWaveform(const int16_t *data, size_t n, Encoding encoding, std::string &out) {
+  size_t start = out.size();
+  if (encoding == kRaw) {
+    out.resize(start + n * sizeof(int16_t));
+    memcpy(&out[start], data, n * sizeof(int16_t));
+    return n * sizeof(int16_t);
+  }
+
+  // each difference fits in 17 bits, so takes at most 3 bytes
+  out.resize(start + 3 * n);
+  uint8_t *ptr = (uint8_t *)&out[start];
+  int32_t last = 0;
+  for (size_t i = 0; i < n; i++) {
+    int32_t diff = (int32_t)data[i] - last;
+    last = data[i];
+    uint32_t zigzag = ((uint32_t)diff << 1) ^ (uint32_t)(diff >> 31);
+    while (zigzag >= 0x80) {
+      *ptr++ = (uint8_t)(zigzag | 0x80);
+      zigzag >>= 7;
+    }
+    *ptr++ = (uint8_t)zigzag;
+  }
+  size_t n_bytes = ptr - (uint8_t *)&out[start];
+  out.resize(start + n_bytes);
+  return n_bytes;
+}
+
+bool snapshot::DecodeWaveform(const char *data, size_t n_bytes, Encoding encoding, std::vector<int16_t> &out) {
+  out.clear();
+  if (encoding == kRaw) {
+    if (n_bytes % sizeof(int16_t) != 0) return false;
+    out.resize(n_bytes / sizeof(int16_t));
+    memcpy(out.data(), data, n_bytes);
+    return true;
+  }
+
+  const uint8_t *ptr = (const uint8_t *)data;
+  const uint8_t *end = ptr + n_bytes;
+  int32_t last = 0;
+  while (ptr != end) {
+    uint32_t zigzag = 0;
+    unsigned shift = 0;
+    while (true) {
+      if (ptr == end || shift > 14) return false;
+      uint8_t byte = *ptr++;
+      zigzag |= (uint32_t)(byte & 0x7F) << shift;
+      shift += 7;
+      if (!(byte & 0x80)) break;
+    }
+    int32_t diff = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+    last += diff;
+    out.push_back((int16_t)last);
+  }
+  return true;
+}
+
+uint16_t snapshot::FloatToHalf(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint16_t sign = (bits >> 16) & 0x8000;
+  uint32_t abs = bits & 0x7FFFFFFF;
+
+  // infinity and NaN
+  if (abs >= 0x7F800000) return sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 : 0);
+  // saturate at the largest half
+  if (abs >= 0x477FF000) return sign | 0x7BFF;
+  // subnormal halfs (and zero)
+  if (abs < 0x38800000) {
+    if (abs <= 0x33000000) return sign;
+    uint32_t mantissa = (abs & 0x7FFFFF) | 0x800000;
+    unsigned shift = 126 - (abs >> 23);
+    uint32_t ret = mantissa >> shift;
+    uint32_t remainder = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (ret & 1))) ret++;
+    return sign | ret;
+  }
+  // re-bias the exponent and round off the mantissa
+  uint32_t ret = (abs - 0x38000000) >> 13;
+  uint32_t remainder = abs & 0x1FFF;
+  if (remainder > 0x1000 || (remainder == 0x1000 && (ret & 1))) ret++;
+  return sign | ret;
+}
+
+float snapshot::HalfToFloat(uint16_t value) {
+  uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+  uint32_t exponent = (value >> 10) & 0x1F;
+  uint32_t mantissa = value & 0x3FF;
+  uint32_t bits;
+  if (exponent == 0x1F) {
+    bits = sign | 0x7F800000 | (mantissa << 13);
+  }
+  else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+  else if (mantissa == 0) {
+    bits = sign;
+  }
+  // subnormal: normalize the mantissa
+  else {
+    exponent = 113;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+  }
+  float ret;
+  memcpy(&ret, &bits, sizeof(ret));
+  return ret;
+}
+
+void snapshot::EncodeFloats(const float *data, size_t n, std::string &out) {
+  size_t start = out.size();
+  out.resize(start + n * sizeof(float));
+  memcpy(&out[start], data, n * sizeof(float));
+}
+
+void snapshot::EncodeHalfs(const float *data, size_t n, std::string &out) {
+  size_t start = out.size();
+  out.resize(start + n * sizeof(uint16_t));
+  char *ptr = &out[start];
+  for (size_t i = 0; i < n; i++) {
+    uint16_t half = FloatToHalf(data[i]);
+    memcpy(ptr + i * sizeof(uint16_t), &half, sizeof(uint16_t));
+  }
+}
+
+void snapshot::Snapshot::SetWaveform(const std::string &key, const int16_t *data, size_t n, double tick_period, Encoding encoding) {
+  this->key = key;
+  data_type = "int16_t";
+  this->encoding = (encoding == kDeltaVarint) ? "delta_varint" : "raw";
+  this->tick_period = std::to_string(tick_period);
+  this->data.clear();
+  EncodeWaveform(data, n, encoding, this->data);
+  split = false;
+  sizes.clear();
+  offsets.clear();
+  run.clear();
+}
+
+void snapshot::Snapshot::SetFloats(const std::string &key, const float *data, size_t n, double tick_period, bool half) {
+  this->key = key;
+  data_type = half ? "float16" : "float";
+  encoding = "raw";
+  this->tick_period = std::to_string(tick_period);
+  this->data.clear();
+  if (half) EncodeHalfs(data, n, this->data);
+  else EncodeFloats(data, n, this->data);
+  split = false;
+  sizes.clear();
+  offsets.clear();
+  run.clear();
+}
+
+void snapshot::Snapshot::SetSplitWaveform(const std::string &key, const std::vector<std::vector<int16_t>> &waveforms,
+                                          const std::vector<float> &offsets, double tick_period) {
+  this->key = key;
+  data_type = "int16_t";
+  encoding = "raw";
+  this->tick_period = std::to_string(tick_period);
+  split = true;
+  data.clear();
+  sizes.clear();
+  for (auto const &waveform: waveforms) {
+    EncodeWaveform(waveform.data(), waveform.size(), kRaw, data);
+    uint32_t size = waveform.size();
+    sizes.append((const char *)&size, sizeof(size));
+  }
+  this->offsets.clear();
+  EncodeFloats(offsets.data(), offsets.size(), this->offsets);
+  run.clear();
+}
+
+void snapshot::Snapshot::SetEvent(unsigned run, unsigned subrun, unsigned event) {
+  this->run = std::to_string(run);
+  this->subrun = std::to_string(subrun);
+  this->event = std::to_string(event);
+}
+
+SnapshotWriter::SnapshotWriter(redisContext *context, double tick_period):
+  _context(context),
+  _tick_period(tick_period),
+  _n_pending(0),
+  _n_failed(0),
+  _n_bytes(0)
+{}
+
+void SnapshotWriter::AddWaveform(const std::string &key, const int16_t *data, size_t n, snapshot::Encoding encoding) {
+  _snapshot.SetWaveform(key, data, n, _tick_period, encoding);
+  Add(_snapshot);
+}
+
+void SnapshotWriter::AddFloats(const std::string &key, const float *data, size_t n, bool half) {
+  _snapshot.SetFloats(key, data, n, _tick_period, half);
+  Add(_snapshot);
+}
+
+void SnapshotWriter::Add(const snapshot::Snapshot &snapshot) {
+  if (_context == nullptr) return;
+
+  // The key is deleted and re-written in one transaction, so that no field
+  // of an earlier snapshot (or a key of another type) is left behind, and
+  // readers never see the key missing or half written
+  const std::string &key = snapshot.key;
+  const char *multi_argv[1] = {"MULTI"};
+  size_t multi_argvlen[1] = {5};
+  redisAppendCommandArgv(_context, 1, multi_argv, multi_argvlen);
+  const char *del_argv[2] = {"DEL", key.c_str()};
+  size_t del_argvlen[2] = {3, key.size()};
+  redisAppendCommandArgv(_context, 2, del_argv, del_argvlen);
+  _n_pending += 2;
+
+  // hiredis copies the arguments into its output buffer, so the snapshot can be re-used right away
+  const unsigned kMaxArgs = 24;
+  const char *argv[kMaxArgs];
+  size_t argvlen[kMaxArgs];
+  unsigned n_args = 0;
+  auto add_arg = [&](const char *arg, size_t len) {
+    argv[n_args] = arg;
+    argvlen[n_args] = len;
+    n_args ++;
+  };
+  auto add_field = [&](const char *field, const char *value, size_t len) {
+    add_arg(field, strlen(field));
+    add_arg(value, len);
+  };
+
+  add_arg("HSET", 4);
+  add_arg(key.c_str(), key.size());
+  add_field("DataType", snapshot.data_type, strlen(snapshot.data_type));
+  add_field("TickPeriod", snapshot.tick_period.c_str(), snapshot.tick_period.size());
+  add_field("Encoding", snapshot.encoding, strlen(snapshot.encoding));
+  add_field("Data", snapshot.data.data(), snapshot.data.size());
+  if (snapshot.split) {
+    add_field("SizeType", "uint32_t", 8);
+    add_field("Sizes", snapshot.sizes.data(), snapshot.sizes.size());
+    add_field("OffsetType", "float", 5);
+    add_field("Offsets", snapshot.offsets.data(), snapshot.offsets.size());
+  }
+  if (snapshot.run.size()) {
+    add_field("Run", snapshot.run.c_str(), snapshot.run.size());
+    add_field("SubRun", snapshot.subrun.c_str(), snapshot.subrun.size());
+    add_field("Event", snapshot.event.c_str(), snapshot.event.size());
+  }
+  redisAppendCommandArgv(_context, n_args, argv, argvlen);
+  const char *exec_argv[1] = {"EXEC"};
+  size_t exec_argvlen[1] = {4};
+  redisAppendCommandArgv(_context, 1, exec_argv, exec_argvlen);
+  _n_pending += 2;
+  _n_bytes += snapshot.data.size();
+
+  if (_n_pending >= kMaxPending) _n_failed += ReadReplies();
+}
+
+unsigned SnapshotWriter::Flush() {
+  unsigned n_failed = _n_failed + ReadReplies();
+  _n_failed = 0;
+  return n_failed;
+}
+
+unsigned SnapshotWriter::ReadReplies() {
+  unsigned n_failed = 0;
+  for (unsigned i = 0; i < _n_pending; i++) {
+    void *reply = nullptr;
+    if (redisGetReply(_context, &reply) != REDIS_OK) {
+      std::cerr << "Warning: failed to send snapshot to redis: " << _context->errstr << std::endl;
+      n_failed += _n_pending - i;
+      break;
+    }
+    redisReply *redis_reply = (redisReply *)reply;
+    if (redis_reply->type == REDIS_REPLY_ERROR) {
+      std::cerr << "Warning: redis error on snapshot: " << redis_reply->str << std::endl;
+      n_failed ++;
+    }
+    // the reply to EXEC holds the replies of the DEL and HSET
+    else if (redis_reply->type == REDIS_REPLY_ARRAY) {
+      for (size_t j = 0; j < redis_reply->elements; j++) {
+        if (redis_reply->element[j]->type == REDIS_REPLY_ERROR) {
+          std::cerr << "Warning: redis error on snapshot: " << redis_reply->element[j]->str << std::endl;
+          n_failed ++;
+        }
+      }
+    }
+    freeReplyObject(reply);
+  }
+  _n_pending = 0;
+  return n_failed;
+}
+
+SnapshotPublisher::SnapshotPublisher(const std::string &hostname, int port, unsigned max_queue_size):
+  _context(sbndaq::Connect2Redis(hostname, port)),
+  _writer(_context),
+  _max_queue_size(std::max(max_queue_size, 1u)),
+  _stop(false)
+{
+  _thread = std::thread(&SnapshotPublisher::Run, this);
+}
+
+SnapshotPublisher::~SnapshotPublisher() {
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _stop = true;
+  }
+  _wake.notify_one();
+  _thread.join();
+  if (_context) redisFree(_context);
+}
+
+void SnapshotPublisher::Publish(snapshot::Snapshot &snapshot) {
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    // replace the queued snapshot of the same key
+    auto queued = _queued_keys.find(snapshot.key);
+    if (queued != _queued_keys.end()) {
+      std::swap(*queued->second, snapshot);
+      _stats.n_coalesced ++;
+      return;
+    }
+    // or make room by dropping the oldest snapshot
+    if (_queue.size() >= _max_queue_size) {
+      _queued_keys.erase(_queue.front().key);
+      _spare.splice(_spare.end(), _queue, _queue.begin());
+      _stats.n_dropped ++;
+    }
+    if (_spare.empty()) _spare.emplace_back();
+    _queue.splice(_queue.end(), _spare, _spare.begin());
+    std::swap(_queue.back(), snapshot);
+    _queued_keys[_queue.back().key] = std::prev(_queue.end());
+  }
+  _wake.notify_one();
+}
+
+SnapshotPublisher::Stats SnapshotPublisher::GetStats() {
+  std::lock_guard<std::mutex> lock(_lock);
+  Stats ret = _stats;
+  ret.queue_depth = _queue.size();
+  return ret;
+}
+
+void SnapshotPublisher::Run() {
+  std::list<snapshot::Snapshot> batch;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _spare.splice(_spare.end(), batch);
+      _wake.wait(lock, [this] { return _stop || !_queue.empty(); });
+      if (_queue.empty()) break;
+      batch.splice(batch.end(), _queue);
+      _queued_keys.clear();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (auto const &snapshot: batch) _writer.Add(snapshot);
+    unsigned n_failed = _writer.Flush();
+    auto end = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> lock(_lock);
+    _stats.n_published += batch.size();
+    _stats.n_failed += n_failed;
+    _stats.flush_latency = std::chrono::duration<float, std::milli>(end - start).count();
+    _stats.flush_size = batch.size();
+  }
+}
@@ -0,0 +1,181 @@
+#ifndef _sbnddaq_analysis_Snapshot
+#define _sbnddaq_analysis_Snapshot
+#include <vector>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+
+struct redisContext;
+
+// Binary encoding of waveform and FFT snapshots sent to redis.
+//
+// Each snapshot is stored as a redis hash in the same layout as the one
+// written by sbndaq::SendWaveform (and read by DatabaseTools/view_waveform_binary.py):
+//   DataType:   type of the decoded values ("int16_t", "float" or "float16")
+//   TickPeriod: period of each sample
+//   Encoding:   "raw" (packed little-endian values) or "delta_varint"
+//   Data:       the encoded values
+// plus, for split waveforms, the Sizes and Offsets (in ticks) of each piece
+// and, if set, the Run, SubRun and Event the snapshot was taken from. Each
+// snapshot replaces its key in one MULTI/EXEC transaction (a DEL and a single
+// HSET). Commands are pipelined and the replies are only read when the
+// writer is flushed.
+namespace tpcAnalysis {
+namespace snapshot {
+
+enum Encoding {
+  kRaw,         // packed int16
+  kDeltaVarint, // difference to the previous value, zig-zag encoded into a LEB128 varint
+};
+
+// Append the encoded waveform to out. Returns the number of bytes written.
+size_t EncodeWaveform(const int16_t *data, size_t n, Encoding encoding, std::string &out);
+// Inverse of EncodeWaveform. Returns false if the data is malformed.
+bool DecodeWaveform(const char *data, size_t n_bytes, Encoding encoding, std::vector<int16_t> &out);
+
+// IEEE half precision conversion (rounding to nearest even). Finite values
+// too large for a half are saturated to the largest half (65504).
+uint16_t FloatToHalf(float value);
+float HalfToFloat(uint16_t value);
+
+// Append packed float32 / float16 values to out
+void EncodeFloats(const float *data, size_t n, std::string &out);
+void EncodeHalfs(const float *data, size_t n, std::string &out);
+
+// A single encoded snapshot, ready to be sent
+class Snapshot {
+public:
+  std::string key;
+  const char *data_type;
+  const char *encoding;
+  std::string tick_period;
+  std::string data;
+  // uint32_t sizes and float offsets of each piece of a split waveform
+  bool split;
+  std::string sizes;
+  std::string offsets;
+  // event the snapshot was taken from (not sent if run is empty)
+  std::string run;
+  std::string subrun;
+  std::string event;
+
+  Snapshot(): data_type(""), encoding("raw"), split(false) {}
+
+  // waveform (stored as int16_t)
+  void SetWaveform(const std::string &key, const int16_t *data, size_t n, double tick_period, Encoding encoding);
+  // float spectrum, stored as float16 if half is set and float otherwise
+  void SetFloats(const std::string &key, const float *data, size_t n, double tick_period, bool half);
+  // waveform split into pieces, the i-th starting at tick offsets[i]
+  void SetSplitWaveform(const std::string &key, const std::vector<std::vector<int16_t>> &waveforms,
+                        const std::vector<float> &offsets, double tick_period);
+  // set the event of the snapshot (after one of the above, which clear it)
+  void SetEvent(unsigned run, unsigned subrun, unsigned event);
+};
+
+} // namespace snapshot
+
+class SnapshotWriter {
+public:
+  // pending commands are flushed once this many have been queued up
+  static const unsigned kMaxPending = 1024;
+
+  explicit SnapshotWriter(redisContext *context=nullptr, double tick_period=0.5);
+  void SetContext(redisContext *context) { _context = context; }
+  void SetTickPeriod(double tick_period) { _tick_period = tick_period; }
+
+  // queue up a waveform (stored as int16_t)
+  void AddWaveform(const std::string &key, const int16_t *data, size_t n, snapshot::Encoding encoding);
+  // queue up a float spectrum, stored as float16 if half is set and float otherwise
+  void AddFloats(const std::string &key, const float *data, size_t n, bool half);
+  // queue up an already encoded snapshot
+  void Add(const snapshot::Snapshot &snapshot);
+
+  // Send all of the queued up commands and wait for the replies.
+  // Returns the number of commands which failed, including those in the
+  // batches flushed automatically (every kMaxPending) since the last call.
+  unsigned Flush();
+
+  unsigned NPending() const { return _n_pending; }
+  // total bytes of snapshot data queued up since construction
+  size_t NBytes() const { return _n_bytes; }
+
+private:
+  // read the replies to the pending commands. Returns the number of failures.
+  unsigned ReadReplies();
+
+  redisContext *_context;
+  double _tick_period;
+  snapshot::Snapshot _snapshot;
+  unsigned _n_pending;
+  // failed commands of the automatic flushes, returned by the next Flush()
+  unsigned _n_failed;
+  size_t _n_bytes;
+};
+
+// Sends snapshots to redis from a background thread, so that a slow
+// database does not hold up the event loop.
+//
+// Snapshots are encoded by the caller and handed to the thread through a
+// bounded queue. A snapshot replaces one of the same key still waiting in
+// the queue (only the newest is worth sending). If the queue is full, the
+// oldest snapshot is dropped. The thread sends everything in the queue at
+// once in one pipelined round-trip.
+class SnapshotPublisher {
+public:
+  class Stats {
+  public:
+    // number of snapshots waiting to be sent
+    unsigned queue_depth;
+    // totals since construction
+    unsigned long n_published;
+    unsigned long n_dropped;
+    unsigned long n_coalesced;
+    unsigned long n_failed;
+    // time to send the last batch of snapshots and its size
+    float flush_latency; // ms
+    unsigned flush_size;
+
+    Stats(): queue_depth(0), n_published(0), n_dropped(0), n_coalesced(0), n_failed(0), flush_latency(0.), flush_size(0) {}
+  };
+
+  SnapshotPublisher(const std::string &hostname, int port, unsigned max_queue_size=4096);
+  // sends anything left in the queue, then closes the connection
+  ~SnapshotPublisher();
+
+  SnapshotPublisher(SnapshotPublisher const &) = delete;
+  SnapshotPublisher & operator = (SnapshotPublisher const &) = delete;
+
+  // Hand a snapshot to the publishing thread. The snapshot is swapped with
+  // a spare one, so its buffers are re-used.
+  void Publish(snapshot::Snapshot &snapshot);
+
+  Stats GetStats();
+
+private:
+  void Run();
+
+  // owned by the publisher
+  redisContext *_context;
+  SnapshotWriter _writer;
+  unsigned _max_queue_size;
+
+  std::mutex _lock;
+  std::condition_variable _wake;
+  bool _stop;
+  std::list<snapshot::Snapshot> _queue;
+  // queued snapshot of each key
+  std::unordered_map<std::string, std::list<snapshot::Snapshot>::iterator> _queued_keys;
+  // sent snapshots, kept around for their buffers
+  std::list<snapshot::Snapshot> _spare;
+  Stats _stats;
+
+  std::thread _thread;
+};
+
+} // namespace tpcAnalysis
+#endif
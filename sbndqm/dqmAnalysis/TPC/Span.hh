@@ -0,0 +1,42 @@
+#ifndef _sbnddaq_analysis_Span
+#define _sbnddaq_analysis_Span
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace tpcAnalysis {
+// Non-owning view of a contiguous array (stand-in for C++20 std::span).
+//
+// Lets the analysis code work on ADC values wherever they are stored
+// (e.g. in a raw::RawDigit or a row of a larger matrix) without copying
+// them into a std::vector.
+template<typename T>
+class Span {
+public:
+  Span(): _data(NULL), _size(0) {}
+  Span(T *data, size_t size): _data(data), _size(size) {}
+  // implicit, so that a vector can be passed wherever a view is expected
+  Span(const std::vector<typename std::remove_const<T>::type> &vec): _data(vec.data()), _size(vec.size()) {}
+
+  T *data() const { return _data; }
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+
+  T &operator[](size_t i) const { return _data[i]; }
+  T *begin() const { return _data; }
+  T *end() const { return _data + _size; }
+
+  // view of [offset, offset + count)
+  Span subspan(size_t offset, size_t count) const { return Span(_data + offset, count); }
+
+private:
+  T *_data;
+  size_t _size;
+};
+
+// view of the ADC values of a waveform
+typedef Span<const int16_t> ADCView;
+
+} // namespace tpcAnalysis
+#endif
@@ -7,7 +7,6 @@
 #include <string>
 #include <vector>
 #include <sstream>
-#include <TVirtualFFT.h>
 #include "TStopwatch.h"
 #include "TROOT.h"
 #include "TTree.h"
@@ -29,6 +28,8 @@
 #include "ChannelData.hh"
 #include "sbndqm/Decode/TPC/HeaderData.hh"
 #include "Analysis.hh"
+#include "FFT.hh"
+#include "Snapshot.hh"
 
 #include "sbndaq-online/helpers/Waveform.h"
 #include "sbndaq-online/helpers/Utilities.h"
@@ -72,73 +73,113 @@ private:
   double stringSum = 0.0;
   void SendWaveform(raw::RawDigit const&);
   redisContext* context;
+  // queue up a channel to be Fourier transformed and sent
   double makeFFT(raw::RawDigit const&,int);
+  // Fourier transform and send all of the queued up channels
+  double sendFFTs();
+
+  // channels waiting to be Fourier transformed
+  std::vector<const raw::RawDigit *> fFFTDigits;
+  std::vector<int16_t> fFFTPedestals;
+  BatchFFT fFFT;
+  std::vector<float> fFFTMagnitudes;
+  // read the replies to all of the commands sent for this event
+  void flushReplies();
  
   std::string fOption;
   bool        fPedestal;
   std::string fWaveformKey;
   double fTickPeriod;
+  std::string fRedisHostname;
+  int         fRedisPort;
+  // "text" (sbndaq::SendWaveform), "raw" or "delta_varint" (see Snapshot.hh)
+  std::string fSnapshotEncoding;
+  // "text" (a redis list of the magnitudes), "float" or "float16" (see Snapshot.hh)
+  std::string fFFTEncoding;
+  SnapshotWriter fWriter;
+  // number of replies waiting to be read for the text FFT snapshots
+  unsigned fNPendingReplies = 0;
  };
 
 double tpcAnalysis::TPCWaveformAndFftRedis::makeFFT(raw::RawDigit const& rd,int Ped){
+  fFFTDigits.push_back(&rd);
+  fFFTPedestals.push_back(Ped);
+  if (fFFTDigits.size() == BatchFFT::kDefaultBatchSize) {
+    return sendFFTs();
+  }
+  return fSum + FSum;
+}
+
+double tpcAnalysis::TPCWaveformAndFftRedis::sendFFTs(){
    TStopwatch sendFFT;
-   TStopwatch redisFFT;
-   int NDIM = 4096;
-   TVirtualFFT *fftr2c = TVirtualFFT::FFT(1, &NDIM, "R2C EX K");
-   
 
-  if (rd.Channel() == 0){
+  if (fFFTDigits.empty()) return fSum + FSum;
+
+  if (fFFTDigits[0]->Channel() == 0){
     fSum = 0;
-Sum = 0;
+    FSum = 0;
   }
    sendFFT.Start();
+  // transform the whole batch at once
+  // channels with a different number of samples than the first get their own batch
+  size_t n_ticks = fFFTDigits[0]->Samples();
+  std::vector<const int16_t *> rows;
+  std::vector<int16_t> peds;
+  std::vector<const raw::RawDigit *> batch;
+  std::vector<const raw::RawDigit *> leftover_digits;
+  std::vector<int16_t> leftover_pedestals;
+  for (size_t i = 0; i < fFFTDigits.size(); i++) {
+    if (fFFTDigits[i]->Samples() == n_ticks) {
+      rows.push_back(fFFTDigits[i]->ADCs().data());
+      peds.push_back(fFFTPedestals[i]);
+      batch.push_back(fFFTDigits[i]);
+    }
+    else {
+      leftover_digits.push_back(fFFTDigits[i]);
+      leftover_pedestals.push_back(fFFTPedestals[i]);
+    }
+  }
+  fFFT.Set(n_ticks);
+  fFFT.Execute(rows.data(), rows.size(), peds.data());
+  fFFTMagnitudes.resize(fFFT.OutputSize());
+
+  for (size_t i_rd = 0; i_rd < batch.size(); i_rd++) {
+    const raw::RawDigit &rd = *batch[i_rd];
+    fFFT.Magnitude(i_rd, fFFTMagnitudes.data());
+  size_t n_fft = n_ticks / 2;
+  if (fFFTEncoding != "text") {
+    std::string key = "snapshot:fft:wire:" + std::to_string(rd.Channel());
+    fWriter.AddFloats(key, fFFTMagnitudes.data(), n_fft, fFFTEncoding == "float16");
+    continue;
+  }
   // store the waveform and also delete old lists                                                                                           
   redisAppendCommand(context, "DEL snapshot:fft:wire:%i", rd.Channel());
-  auto val = rd.ADCs();
-  for(size_t i_t=0; i_t< rd.Samples(); ++i_t){
-    val[i_t] = rd.ADC(i_t) - Ped;
-  }
-  std::vector<double> doubleVec(val.begin(),val.end());
-  //now run the FFT ... we already set it up!                                                                                               
-  fftr2c->SetPoints(doubleVec.data());
-  fftr2c->Transform();
-  TH1 *hfft_m = 0;
-  hfft_m = TH1::TransformHisto(fftr2c,hfft_m,"MAG");
-  size_t buffer_len = val.size() * 40 + 50;
-  char *buffer = new char[buffer_len];  
-  size_t print_len = sprintf(buffer, "RPUSH snapshot:fft:wire:%i", rd.Channel());
-  char *buffer_index = buffer + print_len;
+  size_t buffer_len = n_ticks * 40 + 50;
+  std::vector<char> buffer(buffer_len);
+  size_t print_len = sprintf(buffer.data(), "RPUSH snapshot:fft:wire:%i", rd.Channel());
   // throw in all of the data points                                                                                                            
-  for(int  i_fft=1; i_fft<=hfft_m->GetNbinsX()*(.5); ++i_fft){
-    float my_val = hfft_m->GetBinContent(i_fft);  
-    print_len += sprintf(buffer_index, " %f",my_val);
-    buffer_index = buffer + print_len;
+  for(size_t i_fft=0; i_fft < n_fft; ++i_fft){
+    float my_val = fFFTMagnitudes[i_fft];
+    print_len += sprintf(buffer.data() + print_len, " %f",my_val);
         if (print_len >= buffer_len - 1) {
     std::cerr << "ERROR: BUFFER OVERFLOW IN FFT DATA" << std::endl;
     std::exit(1);
      }
   }
-  // null terminate the string                            
-  *buffer_index = '\0';
-  redisAppendCommand(context, buffer);
+  redisAppendCommand(context, buffer.data());
+  // the replies are read once the whole event has been sent (in flushReplies)
+  fNPendingReplies += 2;
+  }
   sendFFT.Stop();
    FSum = FSum + sendFFT.RealTime();
-   if (rd.Channel() == 575) {
-     //   std::cout<<" Time to create the FFT for redis is "<<FSum <<" seconds."<<std::endl;
-    }
-  redisFFT.Start();
-  redisGetReply(context,NULL);
-  redisGetReply(context,NULL);
-  // delete the buffer                                                                                                                        
-  delete buffer;
-  redisFFT.Stop();
-   fSum = fSum + redisFFT.RealTime();
-   if (rd.Channel() == 575) {
-     // std::cout<<" Time to send the  FFT to redis is "<<fSum <<" seconds."<<std::endl;
-   }
-   if (rd.Channel() == 575) {
+   if (batch.back()->Channel() == 575) {
   std::cout<<" Total time "<<fSum + FSum <<" seconds."<<std::endl;
    }
+
+  fFFTDigits = leftover_digits;
+  fFFTPedestals = leftover_pedestals;
+  if (fFFTDigits.size()) return sendFFTs();
+
    double Time = fSum + FSum;
    
    return Time;
@@ -147,7 +188,32 @@ Sum = 0;
 void tpcAnalysis::TPCWaveformAndFftRedis::SendWaveform(raw::RawDigit const& rd) {
   std::string key = "snapshot:" + fWaveformKey + ":wire:" + std::to_string(rd.Channel());
   
-  sbndaq::SendWaveform(key, rd.ADCs());
+  if (fSnapshotEncoding == "text") {
+    sbndaq::SendWaveform(key, rd.ADCs());
+    return;
+  }
+  snapshot::Encoding encoding = (fSnapshotEncoding == "delta_varint") ? snapshot::kDeltaVarint : snapshot::kRaw;
+  fWriter.AddWaveform(key, rd.ADCs().data(), rd.ADCs().size(), encoding);
+}
+
+void tpcAnalysis::TPCWaveformAndFftRedis::flushReplies() {
+  TStopwatch redisFFT;
+  redisFFT.Start();
+  unsigned n_failed = fWriter.Flush();
+  for (; fNPendingReplies > 0; fNPendingReplies--) {
+    void *reply = nullptr;
+    if (redisGetReply(context, &reply) != REDIS_OK) {
+      n_failed += fNPendingReplies;
+      fNPendingReplies = 0;
+      break;
+    }
+    freeReplyObject(reply);
+  }
+  redisFFT.Stop();
+  fSum = fSum + redisFFT.RealTime();
+  if (n_failed) {
+    std::cerr << "Warning: " << n_failed << " snapshot commands failed" << std::endl;
+  }
 }
 
 
@@ -156,9 +222,24 @@ tpcAnalysis::TPCWaveformAndFftRedis::TPCWaveformAndFftRedis(fhicl::ParameterSet
   fOption(p.get<std::string>("Option","both")),
   fPedestal(p.get<bool>("Pedestal",true)),
   fWaveformKey(p.get<std::string>("WaveformKey", "waveform")),
-  fTickPeriod(p.get<double>("TickPeriod", 0.5))
-
+  fTickPeriod(p.get<double>("TickPeriod", 0.5)),
+  fRedisHostname(p.get<std::string>("RedisHostname","icarus-db01.fnal.gov")),
+  fRedisPort(p.get<int>("RedisPort",6379)),
+  // how to store the waveform and FFT snapshots
+  fSnapshotEncoding(p.get<std::string>("SnapshotEncoding", "text")),
+  fFFTEncoding(p.get<std::string>("FFTEncoding", "text"))
 {
+  context = sbndaq::Connect2Redis(fRedisHostname, fRedisPort);
+  fWriter.SetContext(context);
+  fWriter.SetTickPeriod(fTickPeriod);
+  if (fSnapshotEncoding != "text" && fSnapshotEncoding != "raw" && fSnapshotEncoding != "delta_varint") {
+    std::cerr << "Warning: unknown SnapshotEncoding (" << fSnapshotEncoding << "), using text" << std::endl;
+    fSnapshotEncoding = "text";
+  }
+  if (fFFTEncoding != "text" && fFFTEncoding != "float" && fFFTEncoding != "float16") {
+    std::cerr << "Warning: unknown FFTEncoding (" << fFFTEncoding << "), using text" << std::endl;
+    fFFTEncoding = "text";
+  }
 }
   
 void tpcAnalysis::TPCWaveformAndFftRedis::analyze(art::Event const & evt) {
@@ -228,6 +309,10 @@ void tpcAnalysis::TPCWaveformAndFftRedis::analyze(art::Event const & evt) {
        
       }
    }      
+   // send whatever is left
+   FFTtime = sendFFTs();
+   // and wait for the replies
+   flushReplies();
   
    timer.Stop();
    master.Stop();
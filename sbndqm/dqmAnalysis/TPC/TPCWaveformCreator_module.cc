@@ -27,6 +27,7 @@
 #include "ChannelData.hh"
 #include "sbndqm/Decode/TPC/HeaderData.hh"
 #include "Analysis.hh"
+#include "Snapshot.hh"
 
 #include "sbndaq-online/helpers/Utilities.h"
 
@@ -61,79 +62,113 @@ private:
   double stringSum = 0.0;
   redisContext* context;
   double makeStrings(raw::RawDigit const&);
+  // read the replies to all of the commands sent for this event
+  void flushReplies();
 
   std::string fRedisHostname;
   int         fRedisPort;
-  
+  // "text" (a redis list of the ADC values), "raw" or "delta_varint"
+  // (a binary snapshot, see Snapshot.hh)
+  std::string fSnapshotEncoding;
+  SnapshotWriter fWriter;
+  // number of replies waiting to be read for the text snapshots
+  unsigned fNPendingReplies = 0;
+  // if channel 575 was sent since the last flush (the timing is printed for it)
+  bool fReportTimes = false;
+
 };
 
 double tpcAnalysis::TPCWaveformCreator::makeStrings(raw::RawDigit const& rd){ 
    TStopwatch sendString;
-   TStopwatch redisString;
    
    if (rd.Channel() == 0){
      sSum = 0;
      rSum =0;
    }
+   if (rd.Channel() == 575) fReportTimes = true;
    sendString.Start();
+   if (fSnapshotEncoding != "text") {
+     std::string key = "snapshot:waveform:wire:" + std::to_string(rd.Channel());
+     snapshot::Encoding encoding = (fSnapshotEncoding == "delta_varint") ? snapshot::kDeltaVarint : snapshot::kRaw;
+     fWriter.AddWaveform(key, rd.ADCs().data(), rd.ADCs().size(), encoding);
+     sendString.Stop();
+     sSum = sSum + sendString.RealTime();
+     return rSum + sSum;
+   }
    // store the waveform and fft's
    // also delete old lists
     redisAppendCommand(context, "DEL snapshot:waveform:wire:%i", rd.Channel());
 
    // we're gonna put the whole waveform into one very large list 
    // allocate enough space for it 
-   // Assume at max 4 chars per int plus a space each plus another 50 chars to store the base of the command
-   auto waveform = rd.ADCs();
+   // Assume at max 6 chars per int plus a space each plus another 50 chars to store the base of the command
+   auto const &waveform = rd.ADCs();
    size_t buffer_len = waveform.size() * 10 + 50;
-   char *buffer = new char[buffer_len];
+   std::vector<char> buffer(buffer_len);
    
    // print in the base of the command
-   size_t print_len = sprintf(buffer, "RPUSH snapshot:waveform:wire:%i", rd.Channel());
-   char *buffer_index = buffer + print_len;
+   size_t print_len = sprintf(buffer.data(), "RPUSH snapshot:waveform:wire:%i", rd.Channel());
 
    // throw in all of the data points
    for (int16_t dat: waveform) {
-     print_len += sprintf(buffer_index, " %i", dat); 
-     buffer_index = buffer + print_len;
+     print_len += sprintf(buffer.data() + print_len, " %i", dat); 
      if (print_len >= buffer_len - 1) {
        std::cerr << "ERROR: BUFFER OVERFLOW IN WAVEFORM DATA" << std::endl;
        std::exit(1);
      }
    }
 
-   // null terminate the string
-   *buffer_index = '\0';
-   redisAppendCommand(context, buffer);
+   redisAppendCommand(context, buffer.data());
+   fNPendingReplies += 2;
    sendString.Stop();
    sSum = sSum + sendString.RealTime();
    if (rd.Channel() == 575) {
      std::cout<<" Time to read the buffer to redis is "<<sSum <<" seconds."<<std::endl;
    }
-   redisString.Start();
-   redisGetReply(context,NULL);
-   redisGetReply(context,NULL);                                                                                                                         
-   // delete the buffer                                                                                                                         
-   delete buffer;
-   redisString.Stop();
-   rSum = rSum + redisString.RealTime();
-   if (rd.Channel() == 575) {
-     std::cout<<" Time to receive the replies from  redis is "<<rSum <<" seconds."<<std::endl;
-   }
-   
-   if (rd.Channel() == 575) {
-     std::cout<<" Total time "<<sSum + rSum <<" seconds."<<std::endl;
-   }
+   // the replies are read once all of the channels have been sent (in flushReplies)
    double time = rSum + sSum;
    
    return time;
 }
 
+void tpcAnalysis::TPCWaveformCreator::flushReplies() {
+  TStopwatch redisString;
+  redisString.Start();
+  unsigned n_failed = fWriter.Flush();
+  for (; fNPendingReplies > 0; fNPendingReplies--) {
+    void *reply = nullptr;
+    if (redisGetReply(context, &reply) != REDIS_OK) {
+      n_failed += fNPendingReplies;
+      fNPendingReplies = 0;
+      break;
+    }
+    freeReplyObject(reply);
+  }
+  redisString.Stop();
+  rSum = rSum + redisString.RealTime();
+  if (n_failed) {
+    std::cerr << "Warning: " << n_failed << " waveform snapshot commands failed" << std::endl;
+  }
+  if (fReportTimes) {
+    std::cout<<" Time to receive the replies from  redis is "<<rSum <<" seconds."<<std::endl;
+    std::cout<<" Total time "<<sSum + rSum <<" seconds."<<std::endl;
+    fReportTimes = false;
+  }
+}
+
 tpcAnalysis::TPCWaveformCreator::TPCWaveformCreator(fhicl::ParameterSet const & p):
   art::EDAnalyzer::EDAnalyzer(p),
   fRedisHostname(p.get<std::string>("RedisHostname","icarus-db01.fnal.gov")),
-  fRedisPort(p.get<int>("RedisPort",6379))
+  fRedisPort(p.get<int>("RedisPort",6379)),
+  // how to store the waveform snapshots
+  fSnapshotEncoding(p.get<std::string>("SnapshotEncoding", "text"))
 {  
   context =  sbndaq::Connect2Redis(fRedisHostname,fRedisPort);//to make the configure options w/ password??  later 
+  fWriter.SetContext(context);
+  if (fSnapshotEncoding != "text" && fSnapshotEncoding != "raw" && fSnapshotEncoding != "delta_varint") {
+    std::cerr << "Warning: unknown SnapshotEncoding (" << fSnapshotEncoding << "), using text" << std::endl;
+    fSnapshotEncoding = "text";
+  }
 
   art::ServiceHandle<art::TFileService> tfs; 
   Times = tfs->make<TH1D>("Times","Channel_Times",100,0,2);   
@@ -254,6 +289,9 @@ void tpcAnalysis::TPCWaveformCreator::analyze(art::Event const & evt) {
      }
   }
 
+   // send everything and wait for the replies
+   flushReplies();
+
    timer.Stop();
    std::cout << " Time to create three types of  histograms is " << timer.RealTime()<< " seconds."<< std::endl;
 
@@ -0,0 +1,103 @@
+#include <vector>
+#include <string>
+#include <cmath>
+
+#include "art/Framework/Core/EDAnalyzer.h"
+#include "art/Framework/Core/ModuleMacros.h"
+
+#include "art/Framework/Principal/Event.h"
+
+#include "sbndqm/Decode/Mode/Mode.hh"
+#include "PeakFinder.hh"
+#include "Benchmark.hh"
+
+/*
+ * Compares the noise sigma used for the thresholds of the peak finding on
+ * the waveforms of real RawDigits:
+ *  - FIT: the ROOT gaussian fit to a histogram of the ADC values (Threshold,
+ *    threshold_calc == 1)
+ *  - ROBUST: the analytic estimate (RobustThreshold, threshold_calc == 4)
+ * The fit is taken as the reference, differences are relative to its sigma.
+ * Waveforms where the fit fails are not compared. The baseline of each
+ * waveform is found by mode finding (and is not timed).
+*/
+
+namespace tpcAnalysis {
+  class ThresholdBenchmark;
+}
+
+class tpcAnalysis::ThresholdBenchmark : public art::EDAnalyzer {
+public:
+  explicit ThresholdBenchmark(fhicl::ParameterSet const & p);
+
+  // Plugins should not be copied or assigned.
+  ThresholdBenchmark(ThresholdBenchmark const &) = delete;
+  ThresholdBenchmark(ThresholdBenchmark &&) = delete;
+  ThresholdBenchmark & operator = (ThresholdBenchmark const &) = delete;
+  ThresholdBenchmark & operator = (ThresholdBenchmark &&) = delete;
+
+  void analyze(art::Event const & e) override;
+  void endJob() override;
+
+private:
+  enum Algorithm { kFit, kRobust };
+
+  Benchmark _benchmark;
+  unsigned _n_mode_skip;
+  float _threshold_sigma;
+
+  RobustThreshold _robust_threshold;
+  std::vector<int16_t> _baselines;
+  std::vector<float> _fit;
+  std::vector<float> _robust;
+};
+
+tpcAnalysis::ThresholdBenchmark::ThresholdBenchmark(fhicl::ParameterSet const & p):
+  art::EDAnalyzer::EDAnalyzer(p),
+  _benchmark(p, {"FIT", "ROBUST"}),
+  _n_mode_skip(p.get<unsigned>("n_mode_skip", 1)),
+  _threshold_sigma(p.get<float>("threshold_sigma", 5.))
+{}
+
+void tpcAnalysis::ThresholdBenchmark::analyze(art::Event const & e) {
+  const std::vector<ADCView> &waveforms = _benchmark.Collect(e);
+  unsigned n_waveforms = waveforms.size();
+  _baselines.resize(n_waveforms);
+  _fit.resize(n_waveforms);
+  _robust.resize(n_waveforms);
+  for (unsigned i = 0; i < n_waveforms; i++) {
+    _baselines[i] = Mode(waveforms[i].data(), waveforms[i].size(), _n_mode_skip);
+  }
+
+  _benchmark.Result(kFit).time = _benchmark.Time([&]() {
+    for (unsigned i = 0; i < n_waveforms; i++) {
+      // the threshold of the fit is baseline + n_sigma * sigma
+      Threshold threshold(waveforms[i], _baselines[i], _threshold_sigma, false);
+      _fit[i] = (threshold.Val() - _baselines[i]) / _threshold_sigma;
+    }
+  });
+  _benchmark.Result(kRobust).time = _benchmark.Time([&]() {
+    for (unsigned i = 0; i < n_waveforms; i++) {
+      _robust[i] = _robust_threshold.Sigma(waveforms[i], _baselines[i]);
+    }
+  });
+
+  for (unsigned i = 0; i < n_waveforms; i++) {
+    // no usable sigma from the fit
+    if (!(_fit[i] > 0.) || std::isinf(_fit[i])) {
+      _benchmark.Result(kFit).n_no_reference ++;
+      _benchmark.Result(kRobust).n_no_reference ++;
+      continue;
+    }
+    _benchmark.Result(kFit).Compare(0.);
+    _benchmark.Result(kRobust).Compare((_robust[i] - _fit[i]) / _fit[i]);
+  }
+
+  _benchmark.EndEvent(e);
+}
+
+void tpcAnalysis::ThresholdBenchmark::endJob() {
+  _benchmark.Print("THRESHOLD BENCHMARK (threshold_sigma: " + std::to_string(_threshold_sigma) + ")");
+}
+
+DEFINE_ART_MODULE(tpcAnalysis::ThresholdBenchmark)
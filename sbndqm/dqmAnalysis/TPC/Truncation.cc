@@ -0,0 +1,39 @@
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+#include "Truncation.hh"
+
+using namespace tpcAnalysis;
+
+namespace {
+  // number of values from the top of the distribution to a fraction of it
+  // (in single precision, so that round numbers of values round as before)
+  size_t FromTop(size_t n_values, float fraction) {
+    float n = n_values * (1.f - fraction) + 0.5f;
+    return n > 0.f ? (size_t)n : 0;
+  }
+}
+
+float tpcAnalysis::NthLargest(std::vector<float> &values, size_t k) {
+  if (k == 0) return std::numeric_limits<float>::infinity();
+  if (k > values.size()) return -std::numeric_limits<float>::infinity();
+  std::nth_element(values.begin(), values.begin() + k - 1, values.end(), std::greater<float>());
+  return values[k - 1];
+}
+
+Truncation::Truncation(std::vector<float> &values, float lower, float upper) {
+  size_t k_hi = FromTop(values.size(), upper);
+  size_t k_lo = FromTop(values.size(), lower);
+  lo = NthLargest(values, k_lo);
+  // the values above the lower cut are now all in front, so the upper cut
+  // is only searched among them
+  if (k_hi > 0 && k_hi < k_lo && k_lo <= values.size()) {
+    std::nth_element(values.begin(), values.begin() + k_hi - 1, values.begin() + k_lo - 1, std::greater<float>());
+    hi = values[k_hi - 1];
+  }
+  else {
+    hi = NthLargest(values, k_hi);
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef _sbnddaq_analysis_Truncation
+#define _sbnddaq_analysis_Truncation
+#include <vector>
+#include <cstddef>
+
+/*
+  * Cut values to truncate a distribution, e.g. to drop the tails of the
+  * hit areas (delta rays, noise) before fitting them.
+  *
+  * The cuts are order statistics found with std::nth_element, so they take
+  * linear time on average. The values are reordered in the process.
+*/
+
+namespace tpcAnalysis {
+
+// the k-th largest value (k = 1 is the maximum). The 0-th largest is taken
+// as +infinity, and past the smallest value as -infinity.
+float NthLargest(std::vector<float> &values, size_t k);
+
+// Keeps the values between the lower and upper fractions of the
+// distribution: a value passes if lo < value < hi, where hi is the
+// round(n * (1 - upper))-th largest value and lo the round(n * (1 - lower))-th
+// largest, as in the original ICARUS purity analysis.
+class Truncation {
+public:
+  Truncation(): lo(0.), hi(0.) {}
+  Truncation(std::vector<float> &values, float lower, float upper);
+
+  bool Passes(float value) const { return value > lo && value < hi; }
+
+  float lo;
+  float hi;
+};
+
+} // namespace tpcAnalysis
+#endif